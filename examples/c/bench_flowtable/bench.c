@@ -0,0 +1,302 @@
+/********************************************************************************
+ * Copyright (c) 2012, Chema Garcia                                             *
+ * All rights reserved.                                                         *
+ *                                                                              *
+ * Redistribution and use in source and binary forms, with or                   *
+ * without modification, are permitted provided that the following              *
+ * conditions are met:                                                          *
+ *                                                                              *
+ *    * Redistributions of source code must retain the above                    *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer.                                                             *
+ *                                                                              *
+ *    * Redistributions in binary form must reproduce the above                 *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer in the documentation and/or other materials provided         *
+ *      with the distribution.                                                  *
+ *                                                                              *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"  *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE    *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE   *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE    *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR          *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF         *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS     *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN      *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)      *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE   *
+ * POSSIBILITY OF SUCH DAMAGE.                                                  *
+ ********************************************************************************/
+
+/*
+ * This benchmark compares the chained hash table against the open addressing one
+ * (NTOH_SESSION_OPENADDR_TABLE) by creating N TCP streams / IPv4 flows and then
+ * looking them up in random order. TCP three way handshakes are also fed one by one
+ * (ntoh_process_packet) and in bursts (ntoh_process_packets).
+ *
+ * Usage: ./ntohbench [streams] [lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <libntoh.h>
+
+#define DEFAULT_STREAMS		1000000
+#define DEFAULT_LOOKUPS		10000000
+
+/* frames given at once to ntoh_process_packets */
+#define BURST_SIZE		32
+#define FRAME_SIZE		( sizeof ( struct ip ) + sizeof ( struct tcphdr ) )
+
+static void dummy_tcp_callback ( pntoh_tcp_stream_t stream , pntoh_tcp_peer_t orig , pntoh_tcp_peer_t dest , pntoh_tcp_segment_t seg , int reason , int extra )
+{
+	return;
+}
+
+static void dummy_ipv4_callback ( pntoh_ipv4_flow_t flow , pntoh_ipv4_tuple4_t tuple , unsigned char *data , size_t len , unsigned short reason )
+{
+	return;
+}
+
+static double elapsed ( struct timespec *start )
+{
+	struct timespec now;
+
+	clock_gettime ( CLOCK_MONOTONIC , &now );
+
+	return ( now.tv_sec - start->tv_sec ) * 1e9 + ( now.tv_nsec - start->tv_nsec );
+}
+
+static void set_tcp_tuple ( pntoh_tcp_tuple5_t tuple , unsigned int i )
+{
+	memset ( tuple , 0 , sizeof ( ntoh_tcp_tuple5_t ) );
+	tuple->protocol = 4;
+	tuple->source[0] = htonl ( 0x0A000000 + i );
+	tuple->destination[0] = htonl ( 0xC0A80001 );
+	tuple->sport = htons ( 1024 + ( i % 60000 ) );
+	tuple->dport = htons ( 80 );
+}
+
+static void set_ipv4_tuple ( pntoh_ipv4_tuple4_t tuple , unsigned int i )
+{
+	memset ( tuple , 0 , sizeof ( ntoh_ipv4_tuple4_t ) );
+	tuple->source = htonl ( 0x0A000000 + ( i >> 16 ) );
+	tuple->destination = htonl ( 0xC0A80001 );
+	tuple->protocol = IPPROTO_UDP;
+	tuple->id = (unsigned short) i;
+}
+
+static void bench_tcp ( unsigned int flags , unsigned int streams , unsigned int lookups )
+{
+	pntoh_tcp_session_t	session;
+	ntoh_tcp_tuple5_t	tuple;
+	struct timespec		start;
+	unsigned int		error = 0;
+	ntoh_pool_stats_t	stats;
+	unsigned int		i , found = 0;
+	double			ns;
+
+	if ( ! ( session = ntoh_tcp_new_session_ex ( streams , 0 , flags , &error ) ) )
+	{
+		fprintf ( stderr , "\n[e] Error %d creating TCP session: %s" , error , ntoh_get_errdesc ( error ) );
+		return;
+	}
+
+	clock_gettime ( CLOCK_MONOTONIC , &start );
+	for ( i = 0 ; i < streams ; i++ )
+	{
+		set_tcp_tuple ( &tuple , i );
+		ntoh_tcp_new_stream ( session , &tuple , dummy_tcp_callback , 0 , &error , 0 , 0 );
+	}
+	ns = elapsed ( &start );
+	fprintf ( stderr , "\t+ TCP insert: %.1f ns/stream\n" , ns / streams );
+
+	srand ( 1 );
+	clock_gettime ( CLOCK_MONOTONIC , &start );
+	for ( i = 0 ; i < lookups ; i++ )
+	{
+		set_tcp_tuple ( &tuple , (unsigned int) rand() % streams );
+		if ( ntoh_tcp_find_stream ( session , &tuple ) != 0 )
+			found++;
+	}
+	ns = elapsed ( &start );
+	fprintf ( stderr , "\t+ TCP lookup: %.1f ns/lookup (%u/%u found)\n" , ns / lookups , found , lookups );
+
+	ntoh_tcp_get_pool_stats ( session , NTOH_POOL_STREAMS , &stats );
+	fprintf ( stderr , "\t+ TCP streams pool: %lu in use, %lu allocated in %lu chunks\n" , (unsigned long) stats.in_use , (unsigned long) stats.capacity , stats.chunks );
+
+	ntoh_tcp_free_session ( session );
+}
+
+/* builds the step of a three way handshake (0: SYN, 1: SYN/ACK, 2: ACK) of the stream 'i' */
+static void build_segment ( unsigned char *frame , unsigned int i , unsigned int step )
+{
+	struct ip	*ip = (struct ip*) frame;
+	struct tcphdr	*tcp = (struct tcphdr*) ( frame + sizeof ( struct ip ) );
+	unsigned int	cisn = i * 1000 , sisn = i * 3000 + 7;
+
+	memset ( frame , 0 , FRAME_SIZE );
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons ( FRAME_SIZE );
+	ip->ip_p = IPPROTO_TCP;
+	tcp->th_off = 5;
+	tcp->th_win = htons ( 65535 );
+
+	if ( step == 1 )
+	{
+		ip->ip_src.s_addr = htonl ( 0xC0A80001 );
+		ip->ip_dst.s_addr = htonl ( 0x0A000000 + i );
+		tcp->th_sport = htons ( 80 );
+		tcp->th_dport = htons ( 1024 + ( i % 60000 ) );
+		tcp->th_seq = htonl ( sisn );
+		tcp->th_ack = htonl ( cisn + 1 );
+		tcp->th_flags = TH_SYN | TH_ACK;
+		return;
+	}
+
+	ip->ip_src.s_addr = htonl ( 0x0A000000 + i );
+	ip->ip_dst.s_addr = htonl ( 0xC0A80001 );
+	tcp->th_sport = htons ( 1024 + ( i % 60000 ) );
+	tcp->th_dport = htons ( 80 );
+	tcp->th_seq = htonl ( step == 0 ? cisn : cisn + 1 );
+	tcp->th_ack = htonl ( step == 0 ? 0 : sisn + 1 );
+	tcp->th_flags = step == 0 ? TH_SYN : TH_ACK;
+}
+
+static void bench_dispatch ( unsigned int flags , unsigned int streams , unsigned short burst )
+{
+	ntoh_dispatcher_t	disp;
+	unsigned char		frames[BURST_SIZE][FRAME_SIZE];
+	void			*pframes[BURST_SIZE];
+	size_t			lens[BURST_SIZE];
+	int			ret[BURST_SIZE];
+	struct timespec		start;
+	unsigned int		error = 0;
+	unsigned int		i , j , n , step , stride , ok = 0;
+	double			ns;
+
+	memset ( &disp , 0 , sizeof ( disp ) );
+	disp.linktype = NTOH_LINK_RAW;
+	disp.tcp_function = dummy_tcp_callback;
+
+	if ( ! ( disp.tcp = ntoh_tcp_new_session_ex ( streams , 0 , flags , &error ) ) )
+	{
+		fprintf ( stderr , "\n[e] Error %d creating TCP session: %s" , error , ntoh_get_errdesc ( error ) );
+		return;
+	}
+
+	/* visit the streams in a scattered order */
+	for ( stride = 2654435761U % streams ; stride > 1 && streams % stride == 0 ; stride-- );
+	if ( !stride )
+		stride = 1;
+
+	for ( i = 0 ; i < BURST_SIZE ; i++ )
+	{
+		pframes[i] = frames[i];
+		lens[i] = FRAME_SIZE;
+	}
+
+	clock_gettime ( CLOCK_MONOTONIC , &start );
+	for ( step = 0 ; step < 3 ; step++ )
+	{
+		for ( i = 0 ; i < streams ; i += n )
+		{
+			n = streams - i < BURST_SIZE ? streams - i : BURST_SIZE;
+
+			for ( j = 0 ; j < n ; j++ )
+				build_segment ( frames[j] , (unsigned int) ( ( (unsigned long) ( i + j ) * stride ) % streams ) , step );
+
+			if ( burst )
+				ntoh_process_packets ( &disp , pframes , lens , 0 , ret , n );
+			else
+				for ( j = 0 ; j < n ; j++ )
+					ret[j] = ntoh_process_packet ( &disp , frames[j] , FRAME_SIZE , 0 );
+
+			for ( j = 0 ; j < n ; j++ )
+				if ( ret[j] == NTOH_OK || ret[j] == NTOH_SYNCHRONIZING )
+					ok++;
+		}
+	}
+	ns = elapsed ( &start );
+	fprintf ( stderr , "\t+ TCP handshakes (%s): %.1f ns/segment (%u/%u accepted)\n" , burst ? "ntoh_process_packets" : "ntoh_process_packet" , ns / ( 3.0 * streams ) , ok , 3 * streams );
+
+	ntoh_tcp_free_session ( disp.tcp );
+}
+
+static void bench_ipv4 ( unsigned int flags , unsigned int flows , unsigned int lookups )
+{
+	pntoh_ipv4_session_t	session;
+	ntoh_ipv4_tuple4_t	tuple;
+	struct timespec		start;
+	unsigned int		error = 0;
+	unsigned int		i , found = 0;
+	double			ns;
+
+	if ( ! ( session = ntoh_ipv4_new_session_ex ( flows , 0 , flags , &error ) ) )
+	{
+		fprintf ( stderr , "\n[e] Error %d creating IPv4 session: %s" , error , ntoh_get_errdesc ( error ) );
+		return;
+	}
+
+	clock_gettime ( CLOCK_MONOTONIC , &start );
+	for ( i = 0 ; i < flows ; i++ )
+	{
+		set_ipv4_tuple ( &tuple , i );
+		ntoh_ipv4_new_flow ( session , &tuple , dummy_ipv4_callback , 0 , &error );
+	}
+	ns = elapsed ( &start );
+	fprintf ( stderr , "\t+ IPv4 insert: %.1f ns/flow\n" , ns / flows );
+
+	srand ( 1 );
+	clock_gettime ( CLOCK_MONOTONIC , &start );
+	for ( i = 0 ; i < lookups ; i++ )
+	{
+		set_ipv4_tuple ( &tuple , (unsigned int) rand() % flows );
+		if ( ntoh_ipv4_find_flow ( session , &tuple ) != 0 )
+			found++;
+	}
+	ns = elapsed ( &start );
+	fprintf ( stderr , "\t+ IPv4 lookup: %.1f ns/lookup (%u/%u found)\n" , ns / lookups , found , lookups );
+
+	ntoh_ipv4_free_session ( session );
+}
+
+int main ( int argc , char *argv[] )
+{
+	unsigned int	streams = argc > 1 ? (unsigned int) atoi ( argv[1] ) : DEFAULT_STREAMS;
+	unsigned int	lookups = argc > 2 ? (unsigned int) atoi ( argv[2] ) : DEFAULT_LOOKUPS;
+
+	if ( !streams || !lookups )
+	{
+		fprintf ( stderr , "\n[+] Usage: %s [streams] [lookups]\n" , argv[0] );
+		return 1;
+	}
+
+	fprintf ( stderr , "\n[i] libntoh version: %s\n" , ntoh_version() );
+	fprintf ( stderr , "[i] Streams/flows: %u | Lookups: %u\n" , streams , lookups );
+
+	ntoh_init ();
+
+	fprintf ( stderr , "\n[+] Chained hash table\n" );
+	bench_tcp ( NTOH_SESSION_DEFAULT , streams , lookups );
+	bench_dispatch ( NTOH_SESSION_DEFAULT , streams , 0 );
+	bench_dispatch ( NTOH_SESSION_DEFAULT , streams , 1 );
+	bench_ipv4 ( NTOH_SESSION_DEFAULT , streams , lookups );
+
+	fprintf ( stderr , "\n[+] Open addressing hash table\n" );
+	bench_tcp ( NTOH_SESSION_OPENADDR_TABLE , streams , lookups );
+	bench_dispatch ( NTOH_SESSION_OPENADDR_TABLE , streams , 0 );
+	bench_dispatch ( NTOH_SESSION_OPENADDR_TABLE , streams , 1 );
+	bench_ipv4 ( NTOH_SESSION_OPENADDR_TABLE , streams , lookups );
+
+	ntoh_exit ();
+
+	fprintf ( stderr , "\n" );
+
+	return 0;
+}
@@ -0,0 +1,197 @@
+/********************************************************************************
+ * Copyright (c) 2012, Chema Garcia                                             *
+ * All rights reserved.                                                         *
+ *                                                                              *
+ * Redistribution and use in source and binary forms, with or                   *
+ * without modification, are permitted provided that the following              *
+ * conditions are met:                                                          *
+ *                                                                              *
+ *    * Redistributions of source code must retain the above                    *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer.                                                             *
+ *                                                                              *
+ *    * Redistributions in binary form must reproduce the above                 *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer in the documentation and/or other materials provided         *
+ *      with the distribution.                                                  *
+ *                                                                              *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"  *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE    *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE   *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE    *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR          *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF         *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS     *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN      *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)      *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE   *
+ * POSSIBILITY OF SUCH DAMAGE.                                                  *
+ ********************************************************************************/
+
+/*
+ * This benchmark measures the cost of the out-of-order queues of a TCP peer. A single
+ * stream sends windows of segments where a given percentage of them is lost and only
+ * retransmitted at the end of the window, so every segment received after the first
+ * loss has to be queued until the hole is filled.
+ *
+ * Usage: ./ntohbenchooo [segments] [window]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <libntoh.h>
+
+#define DEFAULT_SEGMENTS	2000000
+#define DEFAULT_WINDOW		1000
+
+/* payload of every segment, a full window must fit in the advertised one (65535) */
+#define PAYLOAD_SIZE		64
+#define FRAME_SIZE		( sizeof ( struct ip ) + sizeof ( struct tcphdr ) + PAYLOAD_SIZE )
+
+#define CLIENT_ADDR		0x0A000001
+#define SERVER_ADDR		0xC0A80001
+#define CLIENT_ISN		100
+#define SERVER_ISN		5000
+
+static unsigned long delivered = 0;
+
+static void tcp_callback ( pntoh_tcp_stream_t stream , pntoh_tcp_peer_t orig , pntoh_tcp_peer_t dest , pntoh_tcp_segment_t seg , int reason , int extra )
+{
+	if ( seg != 0 )
+		delivered += seg->payload_len;
+
+	return;
+}
+
+static double elapsed ( struct timespec *start )
+{
+	struct timespec now;
+
+	clock_gettime ( CLOCK_MONOTONIC , &now );
+
+	return ( now.tv_sec - start->tv_sec ) * 1e9 + ( now.tv_nsec - start->tv_nsec );
+}
+
+static void build_segment ( unsigned char *frame , unsigned short server , unsigned int seq , unsigned int ack , unsigned char flags , unsigned short payload )
+{
+	struct ip	*ip = (struct ip*) frame;
+	struct tcphdr	*tcp = (struct tcphdr*) ( frame + sizeof ( struct ip ) );
+
+	memset ( frame , 0 , sizeof ( struct ip ) + sizeof ( struct tcphdr ) );
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons ( sizeof ( struct ip ) + sizeof ( struct tcphdr ) + payload );
+	ip->ip_p = IPPROTO_TCP;
+	ip->ip_src.s_addr = htonl ( server ? SERVER_ADDR : CLIENT_ADDR );
+	ip->ip_dst.s_addr = htonl ( server ? CLIENT_ADDR : SERVER_ADDR );
+	tcp->th_sport = htons ( server ? 80 : 1024 );
+	tcp->th_dport = htons ( server ? 1024 : 80 );
+	tcp->th_seq = htonl ( seq );
+	tcp->th_ack = htonl ( ack );
+	tcp->th_off = 5;
+	tcp->th_flags = flags;
+	tcp->th_win = htons ( 65535 );
+}
+
+static void bench_ooo ( unsigned int segments , unsigned int window , unsigned int loss )
+{
+	ntoh_dispatcher_t	disp;
+	unsigned char		frame[FRAME_SIZE];
+	unsigned int		*lost;
+	struct timespec		start;
+	unsigned int		error = 0;
+	unsigned int		i , j , n , nlost , sent = 0;
+	double			ns;
+
+	if ( ! ( lost = (unsigned int*) calloc ( window , sizeof ( unsigned int ) ) ) )
+		return;
+
+	memset ( &disp , 0 , sizeof ( disp ) );
+	disp.linktype = NTOH_LINK_RAW;
+	disp.tcp_function = tcp_callback;
+
+	if ( ! ( disp.tcp = ntoh_tcp_new_session ( 16 , 16 , &error ) ) )
+	{
+		fprintf ( stderr , "\n[e] Error %d creating TCP session: %s" , error , ntoh_get_errdesc ( error ) );
+		free ( lost );
+		return;
+	}
+
+	memset ( frame + FRAME_SIZE - PAYLOAD_SIZE , 'A' , PAYLOAD_SIZE );
+	build_segment ( frame , 0 , CLIENT_ISN , 0 , TH_SYN , 0 );
+	ntoh_process_packet ( &disp , frame , FRAME_SIZE - PAYLOAD_SIZE , 0 );
+	build_segment ( frame , 1 , SERVER_ISN , CLIENT_ISN + 1 , TH_SYN | TH_ACK , 0 );
+	ntoh_process_packet ( &disp , frame , FRAME_SIZE - PAYLOAD_SIZE , 0 );
+	build_segment ( frame , 0 , CLIENT_ISN + 1 , SERVER_ISN + 1 , TH_ACK , 0 );
+	ntoh_process_packet ( &disp , frame , FRAME_SIZE - PAYLOAD_SIZE , 0 );
+
+	delivered = 0;
+	srand ( 1 );
+	clock_gettime ( CLOCK_MONOTONIC , &start );
+	for ( i = 0 ; i < segments ; i += n )
+	{
+		n = segments - i < window ? segments - i : window;
+
+		/* first transmission, some segments get lost */
+		for ( j = nlost = 0 ; j < n ; j++ )
+		{
+			if ( (unsigned int) rand() % 100 < loss )
+			{
+				lost[nlost++] = i + j;
+				continue;
+			}
+
+			build_segment ( frame , 0 , CLIENT_ISN + 1 + ( i + j ) * PAYLOAD_SIZE , SERVER_ISN + 1 , TH_ACK | TH_PUSH , PAYLOAD_SIZE );
+			ntoh_process_packet ( &disp , frame , FRAME_SIZE , 0 );
+			sent++;
+		}
+
+		/* retransmissions */
+		for ( j = 0 ; j < nlost ; j++ )
+		{
+			build_segment ( frame , 0 , CLIENT_ISN + 1 + lost[j] * PAYLOAD_SIZE , SERVER_ISN + 1 , TH_ACK | TH_PUSH , PAYLOAD_SIZE );
+			ntoh_process_packet ( &disp , frame , FRAME_SIZE , 0 );
+			sent++;
+		}
+
+		/* the server acknowledges the whole window */
+		build_segment ( frame , 1 , SERVER_ISN + 1 , CLIENT_ISN + 1 + ( i + n ) * PAYLOAD_SIZE , TH_ACK , 0 );
+		ntoh_process_packet ( &disp , frame , FRAME_SIZE - PAYLOAD_SIZE , 0 );
+	}
+	ns = elapsed ( &start );
+	fprintf ( stderr , "\t+ %2u%% loss: %.1f ns/segment (%lu/%lu bytes delivered)\n" , loss , ns / sent , delivered , (unsigned long) segments * PAYLOAD_SIZE );
+
+	ntoh_tcp_free_session ( disp.tcp );
+	free ( lost );
+}
+
+int main ( int argc , char *argv[] )
+{
+	unsigned int	segments = argc > 1 ? (unsigned int) atoi ( argv[1] ) : DEFAULT_SEGMENTS;
+	unsigned int	window = argc > 2 ? (unsigned int) atoi ( argv[2] ) : DEFAULT_WINDOW;
+
+	if ( !segments || !window || window * PAYLOAD_SIZE > 65535 )
+	{
+		fprintf ( stderr , "\n[+] Usage: %s [segments] [window (max. %u)]\n" , argv[0] , 65535 / PAYLOAD_SIZE );
+		return 1;
+	}
+
+	fprintf ( stderr , "\n[i] libntoh version: %s\n" , ntoh_version() );
+	fprintf ( stderr , "[i] Segments: %u | Window: %u segments\n\n" , segments , window );
+
+	ntoh_init ();
+
+	bench_ooo ( segments , window , 1 );
+	bench_ooo ( segments , window , 5 );
+	bench_ooo ( segments , window , 20 );
+
+	ntoh_exit ();
+
+	fprintf ( stderr , "\n" );
+
+	return 0;
+}
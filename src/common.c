@@ -29,9 +29,16 @@
  ********************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
 #include <libntoh.h>
 #include <ipv4defrag.h>
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 // Uniqueness test for IP fragments, using their tuples
 // @contrib: Eosis - https://github.com/Eosis
 /*_HIDDEN inline int ipv4_tuple4_equals_to(pntoh_ipv4_tuple4_t x, pntoh_ipv4_tuple4_t y)
@@ -51,45 +58,411 @@
 	return 1;
 }*/
 
-/****************/
-/** HASH TABLE **/
-/****************/
-/* map the hash table */
-_HIDDEN phtable_t htable_map ( size_t size , fcmp_t *equal_func )
+/*****************************/
+/** OPEN ADDRESSING ENGINE  **/
+/*****************************/
+/*
+ * Swiss-table like layout: one control byte per slot holding either
+ * HT_EMPTY, HT_DELETED or the 7 high bits of the key (the "tag"), so a
+ * whole group of 16 slots is probed with a single SSE2 compare and only
+ * the slots whose tag matches are touched. The first HT_GROUP control
+ * bytes are mirrored after the end of the array, so a group can be
+ * loaded from any position without wrapping.
+ */
+#define HT_GROUP		16
+#define HT_EMPTY		((signed char)-128)
+#define HT_DELETED		((signed char)-2)
+#define HT_TAG(hash)		((signed char)(((hash) >> 25) & 0x7F))
+#define HT_MAX_LOAD(cap)	(((cap) * 7) / 8)
+
+/* bitmask of the group slots holding the given control byte */
+inline static unsigned int oa_match ( const signed char *group , signed char ctrl )
 {
-	phtable_t ret = 0;
+#ifdef __SSE2__
+	__m128i	val = _mm_loadu_si128 ( (const __m128i*) group );
 
-	if ( !size )
+	return (unsigned int) _mm_movemask_epi8 ( _mm_cmpeq_epi8 ( val , _mm_set1_epi8 ( ctrl ) ) );
+#else
+	unsigned int	ret = 0;
+	unsigned int	i = 0;
+
+	for ( i = 0 ; i < HT_GROUP ; i++ )
+		if ( group[i] == ctrl )
+			ret |= 1 << i;
+
+	return ret;
+#endif
+}
+
+/* bitmask of the group slots which are empty or deleted */
+inline static unsigned int oa_match_free ( const signed char *group )
+{
+#ifdef __SSE2__
+	return (unsigned int) _mm_movemask_epi8 ( _mm_loadu_si128 ( (const __m128i*) group ) );
+#else
+	unsigned int	ret = 0;
+	unsigned int	i = 0;
+
+	for ( i = 0 ; i < HT_GROUP ; i++ )
+		if ( group[i] < 0 )
+			ret |= 1 << i;
+
+	return ret;
+#endif
+}
+
+/* keys may come from weak hash functions (see ip_get_hashkey), so spread them before probing */
+inline static unsigned int oa_mix ( unsigned int key )
+{
+	key ^= key >> 16;
+	key *= 0x85EBCA6B;
+	key ^= key >> 13;
+	key *= 0xC2B2AE35;
+	key ^= key >> 16;
+
+	return key;
+}
+
+inline static void oa_set_ctrl ( phtable_t ht , size_t i , signed char ctrl )
+{
+	ht->ctrl[i] = ctrl;
+	if ( i < HT_GROUP )
+		ht->ctrl[ht->capacity + i] = ctrl;
+}
+
+/* allocates the slots for a given capacity (power of two) */
+static int oa_alloc ( phtable_t ht , size_t capacity )
+{
+	signed char	*ctrl = 0;
+	phtslot_t	slots = 0;
+
+	if ( ! ( ctrl = (signed char*) malloc ( capacity + HT_GROUP ) ) )
 		return 0;
 
-	ret = (phtable_t) calloc ( 1 , sizeof ( htable_t ) );
-	ret->table = (phtnode_t*) calloc ( size , sizeof ( phtnode_t ) );
-	ret->table_size = size;
-	ret->equals = equal_func;
+	if ( ! ( slots = (phtslot_t) calloc ( capacity , sizeof ( htslot_t ) ) ) )
+	{
+		free ( ctrl );
+		return 0;
+	}
+
+	memset ( ctrl , HT_EMPTY , capacity + HT_GROUP );
+
+	ht->ctrl = ctrl;
+	ht->slots = slots;
+	ht->capacity = capacity;
+	ht->used = 0;
+	ht->deleted = 0;
+
+	return 1;
+}
+
+/* returns the index of the first free slot in the probe sequence of 'hash' */
+static size_t oa_free_slot ( phtable_t ht , unsigned int hash )
+{
+	size_t		mask = ht->capacity - 1;
+	size_t		pos = hash & mask;
+	size_t		step = 0;
+	unsigned int	match = 0;
+
+	while ( ! ( match = oa_match_free ( &ht->ctrl[pos] ) ) )
+	{
+		step += HT_GROUP;
+		pos = ( pos + step ) & mask;
+	}
+
+	return ( pos + __builtin_ctz ( match ) ) & mask;
+}
+
+/* moves all the entries to a new array (drops the tombstones) */
+static int oa_rehash ( phtable_t ht , size_t capacity )
+{
+	htable_t	old = *ht;
+	size_t		i = 0;
+	size_t		pos = 0;
+
+	if ( ! oa_alloc ( ht , capacity ) )
+	{
+		*ht = old;
+		return 0;
+	}
+
+	for ( i = 0 ; i < old.capacity ; i++ )
+	{
+		if ( old.ctrl[i] < 0 )
+			continue;
+
+		pos = oa_free_slot ( ht , oa_mix ( old.slots[i].key ) );
+		oa_set_ctrl ( ht , pos , old.ctrl[i] );
+		ht->slots[pos] = old.slots[i];
+		ht->used++;
+	}
+
+	free ( old.ctrl );
+	free ( old.slots );
+
+	return 1;
+}
+
+/* returns the index of the slot holding the given key/tuple, or the capacity when not found */
+static size_t oa_lookup ( phtable_t ht , unsigned int key , void *ip_tuple4 )
+{
+	unsigned int	hash = oa_mix ( key );
+	size_t		mask = ht->capacity - 1;
+	size_t		pos = hash & mask;
+	size_t		step = 0;
+	size_t		idx = 0;
+	unsigned int	match = 0;
+	signed char	tag = HT_TAG(hash);
+
+	while ( step <= ht->capacity )
+	{
+		for ( match = oa_match ( &ht->ctrl[pos] , tag ) ; match != 0 ; match &= match - 1 )
+		{
+			idx = ( pos + __builtin_ctz ( match ) ) & mask;
+			if ( ht->slots[idx].key == key && ( !ip_tuple4 || ht->equals ( ip_tuple4 , ht->slots[idx].val ) ) )
+				return idx;
+		}
+
+		/* an empty slot ends the probe sequence */
+		if ( oa_match ( &ht->ctrl[pos] , HT_EMPTY ) )
+			break;
+
+		step += HT_GROUP;
+		pos = ( pos + step ) & mask;
+	}
+
+	return ht->capacity;
+}
+
+static int oa_insert ( phtable_t ht , unsigned int key , void *val )
+{
+	unsigned int	hash = oa_mix ( key );
+	size_t		pos = 0;
+
+	/* htable_insert migrates the table before it gets here, this is just the fallback */
+	if ( ht->used + ht->deleted + 1 > HT_MAX_LOAD(ht->capacity) )
+	{
+		/* grow only if the live entries need it, otherwise just purge the tombstones */
+		if ( ! oa_rehash ( ht , ( ht->used + 1 > HT_MAX_LOAD(ht->capacity) / 2 ) ? ht->capacity * 2 : ht->capacity ) )
+			return 0;
+	}
+
+	pos = oa_free_slot ( ht , hash );
+	if ( ht->ctrl[pos] == HT_DELETED )
+		ht->deleted--;
+
+	oa_set_ctrl ( ht , pos , HT_TAG(hash) );
+	ht->slots[pos].key = key;
+	ht->slots[pos].val = val;
+	ht->used++;
+
+	return 1;
+}
+
+static void *oa_remove ( phtable_t ht , unsigned int key , void *ip_tuple4 )
+{
+	size_t	pos = oa_lookup ( ht , key , ip_tuple4 );
+	void	*ret = 0;
+
+	if ( pos == ht->capacity )
+		return 0;
+
+	ret = ht->slots[pos].val;
+	ht->slots[pos].val = 0;
+	oa_set_ctrl ( ht , pos , HT_DELETED );
+	ht->used--;
+	ht->deleted++;
 
 	return ret;
 }
 
-/* insert a pair key-value into the hash table */
-_HIDDEN int htable_insert ( phtable_t ht  , unsigned int key , void *val )
+/*****************/
+/** OBJECT POOL **/
+/*****************/
+/* objects are aligned to 16 bytes and big enough to link them in the free list */
+#define POOL_ALIGN		16
+#define POOL_OBJSIZE(size)	( ( ( (size) < sizeof ( void* ) ? sizeof ( void* ) : (size) ) + POOL_ALIGN - 1 ) & ~( (size_t) POOL_ALIGN - 1 ) )
+#define POOL_HDRSIZE		POOL_OBJSIZE ( sizeof ( void* ) )
+
+/* carves 'count' new objects from a new chunk, pool locked */
+static int pool_grow ( pntoh_pool_t pool , size_t count )
 {
-	phtnode_t	node = 0;
-	phtnode_t	aux = 0;
-	unsigned int	index = 0;
+	unsigned char	*chunk = 0;
+	size_t		size = POOL_OBJSIZE ( pool->stats.object_size );
+	size_t		i;
 
-	if ( !ht || !val )
+	if ( ! ( chunk = (unsigned char*) malloc ( POOL_HDRSIZE + count * size ) ) )
 		return 0;
 
-	node = (phtnode_t) calloc ( 1 , sizeof ( htnode_t ) );
-	node->key = key;
-	node->val = val;
+	*(void**) chunk = pool->chunks;
+	pool->chunks = chunk;
 
-	index = key % ht->table_size;
+	for ( i = count ; i > 0 ; i-- )
+	{
+		*(void**) ( chunk + POOL_HDRSIZE + ( i - 1 ) * size ) = pool->free;
+		pool->free = chunk + POOL_HDRSIZE + ( i - 1 ) * size;
+	}
+
+	pool->stats.capacity += count;
+	pool->stats.chunks++;
+
+	return 1;
+}
+
+/*
+ * the pool is locked with the backend of its session ('mode'), but never needs a condition variable.
+ * Returns 0 if the preallocation failed, the pool is usable anyway (it grows on demand).
+ */
+_HIDDEN int pool_init ( pntoh_pool_t pool , size_t size , size_t prealloc , int mode )
+{
+	memset ( pool , 0 , sizeof ( ntoh_pool_t ) );
+	pool->stats.object_size = size;
+	pool->chunk = DEFAULT_POOL_CHUNK;
+	init_lockaccess ( &pool->lock , mode == LOCK_CONDVAR ? LOCK_MUTEX : mode );
+
+	return prealloc == 0 || pool_grow ( pool , prealloc );
+}
+
+/* returns a zeroed object */
+_HIDDEN void *pool_alloc ( pntoh_pool_t pool )
+{
+	void *ret = 0;
+
+	lock_access ( &pool->lock );
+
+	if ( pool->free != 0 || pool_grow ( pool , pool->chunk ) )
+	{
+		ret = pool->free;
+		pool->free = *(void**) ret;
+
+		pool->stats.allocs++;
+		if ( ++pool->stats.in_use > pool->stats.peak )
+			pool->stats.peak = pool->stats.in_use;
+	}
+
+	unlock_access ( &pool->lock );
+
+	if ( ret != 0 )
+		memset ( ret , 0 , pool->stats.object_size );
+
+	return ret;
+}
+
+_HIDDEN void pool_free ( pntoh_pool_t pool , void *obj )
+{
+	if ( !obj )
+		return;
+
+	lock_access ( &pool->lock );
+
+	*(void**) obj = pool->free;
+	pool->free = obj;
+	pool->stats.in_use--;
+
+	unlock_access ( &pool->lock );
+}
+
+_HIDDEN void pool_get_stats ( pntoh_pool_t pool , pntoh_pool_stats_t stats )
+{
+	lock_access ( &pool->lock );
+	*stats = pool->stats;
+	unlock_access ( &pool->lock );
+}
+
+/* releases all the chunks, the objects in use are lost */
+_HIDDEN void pool_destroy ( pntoh_pool_t pool )
+{
+	void *chunk = 0;
+
+	while ( ( chunk = pool->chunks ) != 0 )
+	{
+		pool->chunks = *(void**) chunk;
+		free ( chunk );
+	}
+
+	pool->free = 0;
+	free_lockaccess ( &pool->lock );
+}
+
+/*******************************/
+/** CHAINED ENGINE / STORAGE  **/
+/*******************************/
+/* chained nodes come from the table pool (if any) */
+inline static void ht_node_free ( phtable_t ht , phtnode_t node )
+{
+	if ( ht->pool != 0 )
+		pool_free ( ht->pool , node );
+	else
+		free ( node );
+}
+
+/* allocates the buckets/slots of a table for the given size (and at least 'capacity' open addressing slots) */
+static int ht_alloc ( phtable_t ht , size_t size , size_t capacity )
+{
+	if ( capacity < HT_GROUP )
+		capacity = HT_GROUP;
+
+	ht->table_size = size;
+
+	if ( ht->engine == HTABLE_OPENADDR )
+	{
+		while ( HT_MAX_LOAD(capacity) < size )
+			capacity <<= 1;
+
+		return oa_alloc ( ht , capacity );
+	}
+
+	return ( ht->table = (phtnode_t*) calloc ( size , sizeof ( phtnode_t ) ) ) != 0;
+}
+
+/* releases the buckets/slots of a table (not the values) */
+static void ht_free ( phtable_t ht )
+{
+	unsigned int	i = 0;
+	phtnode_t	aux = 0;
+
+	if ( ht->engine == HTABLE_OPENADDR )
+	{
+		free ( ht->ctrl );
+		free ( ht->slots );
+		ht->ctrl = 0;
+		ht->slots = 0;
+		ht->capacity = ht->used = ht->deleted = 0;
+	}else if ( ht->table != 0 )
+	{
+		for ( i = 0 ; i < ht->table_size ; i++ )
+			while ( ht->table[i] != 0 )
+			{
+				aux = ht->table[i]->next;
+				ht_node_free ( ht , ht->table[i] );
+				ht->table[i] = aux;
+			}
+
+		free ( ht->table );
+		ht->table = 0;
+	}
+
+	ht->table_size = 0;
+}
+
+/* number of buckets/slots to be walked */
+inline static size_t ht_buckets ( phtable_t ht )
+{
+	return ht->engine == HTABLE_OPENADDR ? ht->capacity : ht->table_size;
+}
+
+/* links an existing node into a chained table */
+inline static void ht_link ( phtable_t ht , phtnode_t node )
+{
+	unsigned int	index = node->key % ht->table_size;
+	phtnode_t	aux = 0;
+
+	node->next = 0;
 
 	if ( ht->table[index] == NULL )
 	{
 		ht->table[index] = node;
-		return 1;
+		return;
 	}
 
 	/* collision resolution by chaining */
@@ -98,26 +471,51 @@ _HIDDEN int htable_insert ( phtable_t ht  , unsigned int key , void *val )
 		aux = aux->next;
 
 	aux->next = node;
+}
+
+static int ht_insert ( phtable_t ht  , unsigned int key , void *val )
+{
+	phtnode_t	node = 0;
+
+	if ( ht->engine == HTABLE_OPENADDR )
+		return oa_insert ( ht , key , val );
+
+	if ( ht->pool != 0 )
+		node = (phtnode_t) pool_alloc ( ht->pool );
+	else
+		node = (phtnode_t) calloc ( 1 , sizeof ( htnode_t ) );
+
+	if ( !node )
+		return 0;
+
+	node->key = key;
+	node->val = val;
+	ht_link ( ht , node );
 
 	return 1;
 }
 
-/* returns the value associated to the given key */
-_HIDDEN void *htable_find ( phtable_t ht , unsigned int key, void* ip_tuple4 )
+static void *ht_find ( phtable_t ht , unsigned int key, void* ip_tuple4 )
 {
 	unsigned int	index = 0;
 	phtnode_t	node = 0;
 
-	if ( !ht )
+	if ( !ht->table_size )
 		return 0;
 
+	if ( ht->engine == HTABLE_OPENADDR )
+	{
+		index = oa_lookup ( ht , key , ip_tuple4 );
+		return index < ht->capacity ? ht->slots[index].val : 0;
+	}
+
 	index = key % ht->table_size;
 
 	node = ht->table[index];
 
 	// @contrib: Eosis - https://github.com/Eosis
 	if ( ip_tuple4 != 0 ) //if not null
-		while( node != 0 && ! ht->equals ( ip_tuple4 , node->val ) ) //!(ipv4_tuple4_equals_to((pntoh_ipv4_tuple4_t)ip_tuple4, &(((pntoh_ipv4_flow_t)(node->val))->ident))) )
+		while( node != 0 && ( node->key != key || ! ht->equals ( ip_tuple4 , node->val ) ) ) //!(ipv4_tuple4_equals_to((pntoh_ipv4_tuple4_t)ip_tuple4, &(((pntoh_ipv4_flow_t)(node->val))->ident))) )
 			node = node->next;
 	else
 		while ( node != 0 && node->key != key )
@@ -129,143 +527,1054 @@ _HIDDEN void *htable_find ( phtable_t ht , unsigned int key, void* ip_tuple4 )
 	return node->val;
 }
 
-/* removes a key-value pair from the hash table */
-_HIDDEN void *htable_remove ( phtable_t ht , unsigned int key, void* ip_tuple4 )
+static void *ht_remove ( phtable_t ht , unsigned int key, void* ip_tuple4 )
 {
 	unsigned int	index = 0;
+	phtnode_t	*pnode = 0;
 	phtnode_t	node = 0;
-	phtnode_t	aux = 0;
 	void		*ret = 0;
 
-	if ( !ht )
+	if ( !ht->table_size )
 		return 0;
 
-	index = key % ht->table_size;
-	node = ht->table[index];
-
-	if ( node->key == key )
-		ht->table[index] = node->next;
-	else
-	{
-		while ( node->next != 0 && node->next->key != key )
-			node = node->next;
+	if ( ht->engine == HTABLE_OPENADDR )
+		return oa_remove ( ht , key , ip_tuple4 );
 
-		// @contrib: Eosis - https://github.com/Eosis
-		if (ip_tuple4 != 0 ) //if not null
-			while( node->next != 0 && ! ht->equals ( ip_tuple4 , node->next->val ) ) //!(ipv4_tuple4_equals_to((pntoh_ipv4_tuple4_t)ip_tuple4, &(((pntoh_ipv4_flow_t)(node->next->val))->ident))) )
-				node = node->next;
-		else
-			while ( node->next != 0 && node->next->key != key )
-				node = node->next;
+	index = key % ht->table_size;
 
-		if ( node->next != 0 )
-		{
-			aux = node;
-			node = node->next;
-			aux->next = node->next;
-		}
-	}
+	// @contrib: Eosis - https://github.com/Eosis
+	for ( pnode = &ht->table[index] ; *pnode != 0 ; pnode = &(*pnode)->next )
+		if ( ip_tuple4 != 0 ? ht->equals ( ip_tuple4 , (*pnode)->val ) : (*pnode)->key == key )
+			break;
 
-	if ( !node )
+	if ( ! ( node = *pnode ) )
 		return 0;
 
+	*pnode = node->next;
 	ret = node->val;
-	free ( node );
+	ht_node_free ( ht , node );
 
 	return ret;
 }
 
-/* count the key-value pairs in a hash table */
-_HIDDEN unsigned int htable_count ( phtable_t ht )
+/* moves up to 'steps' buckets from the table being migrated to the current one, returns 0 if out of memory */
+static int ht_rehash_step ( phtable_t ht , unsigned int steps )
 {
-	unsigned int	i = 0;
-	unsigned int	ret = 0;
-	phtnode_t	aux = 0;
+	phtable_t	old = ht->rehash;
+	phtnode_t	node = 0;
+	size_t		i = 0;
 
-	if ( !ht )
-		return ret;
+	for ( ; steps > 0 && ht->rehash_pos < ht_buckets ( old ) ; steps-- )
+	{
+		i = ht->rehash_pos;
 
-	for ( i = 0 ; i < ht->table_size ; i++ )
-		for ( aux = ht->table[i] ; aux != 0 ; ret++ , aux = aux->next );
+		if ( old->engine == HTABLE_OPENADDR )
+		{
+			/* out of memory, the entry stays in the old table (still found there) until the next step */
+			if ( old->ctrl[i] >= 0 && ! ht_insert ( ht , old->slots[i].key , old->slots[i].val ) )
+				return 0;
 
-	return ret;
-}
+			if ( old->ctrl[i] >= 0 )
+			{
+				oa_set_ctrl ( old , i , HT_DELETED );
+				old->used--;
+				old->deleted++;
+			}
 
-/* gets the first key in a hash table */
-_HIDDEN unsigned int htable_first ( phtable_t ht )
-{
-	unsigned int ret = 0;
-	unsigned int i = 0;
+			ht->rehash_pos++;
+			continue;
+		}
 
-	if ( ! ht )
-		return ret;
+		/* the nodes are moved, not reallocated, so pending iterators stay valid */
+		while ( ( node = old->table[i] ) != 0 )
+		{
+			if ( ht->engine == HTABLE_OPENADDR && ! ht_insert ( ht , node->key , node->val ) )
+				return 0;
 
-	for ( i = 0 ; i < ht->table_size && ht->table[i] == 0 ; i++ );
+			old->table[i] = node->next;
 
-	if ( i < ht->table_size )
-		ret = ht->table[i]->key;
+			if ( ht->engine == HTABLE_OPENADDR )
+				ht_node_free ( old , node );
+			else
+				ht_link ( ht , node );
+		}
 
-	return ret;
+		ht->rehash_pos++;
+	}
+
+	/* migration finished, the holder is kept (empty) for the iterators */
+	if ( ht->rehash_pos >= ht_buckets ( old ) )
+		ht_free ( old );
+
+	return 1;
 }
 
-/* destroys entire hash table */
-_HIDDEN void htable_destroy ( phtable_t *ht )
+/* moves the current storage to the table being migrated and allocates a new one, no migration may be pending */
+static int ht_migrate ( phtable_t ht , size_t size , size_t capacity )
 {
-	unsigned int	i = 0;
-	phtnode_t	aux = 0;
+	htable_t tmp;
 
-	if ( !ht || !(*ht) )
-		return;
+	if ( !ht->rehash && ! ( ht->rehash = (phtable_t) calloc ( 1 , sizeof ( htable_t ) ) ) )
+		return 0;
 
-	for ( i = 0 ; i < (*ht)->table_size ; i++ )
-		while ( (*ht)->table[i] != 0 )
-		{
-			aux = (*ht)->table[i]->next;
-			free ( (*ht)->table[i] );
-			(*ht)->table[i] = aux;
-		}
+	tmp = *ht;
+	tmp.rehash = 0;
+	tmp.rehash_pos = 0;
+	if ( ! ht_alloc ( &tmp , size , capacity ) )
+		return 0;
 
-	free ( (*ht)->table );
-	free ( *ht );
+	/* current storage becomes the old table */
+	*ht->rehash = *ht;
+	ht->rehash->rehash = 0;
+	ht->rehash->rehash_pos = 0;
 
-	*ht = 0;
+	tmp.rehash = ht->rehash;
+	*ht = tmp;
 
-	return;
+	return 1;
 }
 
-/********************/
-/** ACCESS LOCKING **/
-/********************/
-_HIDDEN void lock_access ( pntoh_lock_t lock )
+/****************/
+/** HASH TABLE **/
+/****************/
+/* map the hash table */
+_HIDDEN phtable_t htable_map ( size_t size , fcmp_t *equal_func , unsigned short engine )
+{
+	phtable_t ret = 0;
+
+	if ( !size )
+		return 0;
+
+	if ( ! ( ret = (phtable_t) calloc ( 1 , sizeof ( htable_t ) ) ) )
+		return 0;
+
+	ret->equals = equal_func;
+	ret->engine = engine;
+
+	if ( ! ht_alloc ( ret , size , 0 ) )
+	{
+		free ( ret );
+		return 0;
+	}
+
+	return ret;
+}
+
+/* insert a pair key-value into the hash table */
+_HIDDEN int htable_insert ( phtable_t ht  , unsigned int key , void *val )
+{
+	if ( !ht || !val )
+		return 0;
+
+	if ( HTABLE_REHASHING(ht) )
+		ht_rehash_step ( ht , HTABLE_REHASH_STEPS );
+	/* tombstones purge (same capacity) or growth, migrated like a resize instead of a stop-the-world rehash */
+	else if ( ht->engine == HTABLE_OPENADDR && ht->used + ht->deleted + 1 > HT_MAX_LOAD(ht->capacity) )
+		ht_migrate ( ht , ht->table_size , ( ht->used + 1 > HT_MAX_LOAD(ht->capacity) / 2 ) ? ht->capacity * 2 : ht->capacity );
+
+	return ht_insert ( ht , key , val );
+}
+
+/* returns the value associated to the given key */
+_HIDDEN void *htable_find ( phtable_t ht , unsigned int key, void* ip_tuple4 )
+{
+	void *ret = 0;
+
+	if ( !ht )
+		return 0;
+
+	if ( HTABLE_REHASHING(ht) )
+		ht_rehash_step ( ht , HTABLE_REHASH_STEPS );
+
+	if ( ! ( ret = ht_find ( ht , key , ip_tuple4 ) ) && HTABLE_REHASHING(ht) )
+		ret = ht_find ( ht->rehash , key , ip_tuple4 );
+
+	return ret;
+}
+
+/* prefetches the bucket of a key, to be looked up a bit later */
+_HIDDEN void htable_prefetch ( phtable_t ht , unsigned int key )
+{
+	size_t pos = 0;
+
+	if ( !ht || !ht->table_size )
+		return;
+
+	if ( ht->engine == HTABLE_OPENADDR )
+	{
+		pos = oa_mix ( key ) & ( ht->capacity - 1 );
+		__builtin_prefetch ( &ht->ctrl[pos] );
+		__builtin_prefetch ( &ht->slots[pos] );
+	}else
+		__builtin_prefetch ( &ht->table[key % ht->table_size] );
+}
+
+/* removes a key-value pair from the hash table */
+_HIDDEN void *htable_remove ( phtable_t ht , unsigned int key, void* ip_tuple4 )
+{
+	void *ret = 0;
+
+	if ( !ht )
+		return 0;
+
+	if ( HTABLE_REHASHING(ht) )
+		ht_rehash_step ( ht , HTABLE_REHASH_STEPS );
+
+	if ( ! ( ret = ht_remove ( ht , key , ip_tuple4 ) ) && HTABLE_REHASHING(ht) )
+		ret = ht_remove ( ht->rehash , key , ip_tuple4 );
+
+	return ret;
+}
+
+/* starts an incremental resize, the entries are moved a few buckets at a time on each operation */
+_HIDDEN int htable_resize ( phtable_t ht , size_t size )
+{
+	if ( !ht || !size )
+		return 0;
+
+	/* only one migration at a time, finish the pending one */
+	while ( HTABLE_REHASHING(ht) )
+		if ( ! ht_rehash_step ( ht , HTABLE_REHASH_STEPS ) )
+			return 0;
+
+	return ht_migrate ( ht , size , 0 );
+}
+
+/* count the key-value pairs in a hash table */
+_HIDDEN unsigned int htable_count ( phtable_t ht )
+{
+	unsigned int	i = 0;
+	unsigned int	ret = 0;
+	phtnode_t	aux = 0;
+
+	if ( !ht )
+		return ret;
+
+	if ( HTABLE_REHASHING(ht) )
+		ret = htable_count ( ht->rehash );
+
+	if ( ht->engine == HTABLE_OPENADDR )
+		return ret + (unsigned int) ht->used;
+
+	for ( i = 0 ; i < ht->table_size ; i++ )
+		for ( aux = ht->table[i] ; aux != 0 ; ret++ , aux = aux->next );
+
+	return ret;
+}
+
+/* gets the first key in a hash table */
+_HIDDEN unsigned int htable_first ( phtable_t ht )
+{
+	unsigned int ret = 0;
+	unsigned int i = 0;
+
+	if ( ! ht )
+		return ret;
+
+	if ( HTABLE_REHASHING(ht) && ( ret = htable_first ( ht->rehash ) ) != 0 )
+		return ret;
+
+	if ( ht->engine == HTABLE_OPENADDR )
+	{
+		for ( i = 0 ; i < ht->capacity && ht->ctrl[i] < 0 ; i++ );
+
+		if ( i < ht->capacity )
+			ret = ht->slots[i].key;
+
+		return ret;
+	}
+
+	for ( i = 0 ; i < ht->table_size && ht->table[i] == 0 ; i++ );
+
+	if ( i < ht->table_size )
+		ret = ht->table[i]->key;
+
+	return ret;
+}
+
+/* returns the next value of the table, or 0 at the end. The returned value can be removed while iterating */
+_HIDDEN void *htable_iterate ( phtable_t ht , phtiter_t it )
 {
-	pthread_mutex_lock( &lock->mutex );
+	phtable_t	cur = 0;
+	phtnode_t	node = 0;
+	size_t		i = 0;
+
+	if ( !ht || !it )
+		return 0;
+
+	/* the table being migrated (if any) is walked first */
+	if ( !it->table )
+		it->table = HTABLE_REHASHING(ht) ? ht->rehash : ht;
+
+	for ( cur = it->table ; ; cur = it->table = ht , it->pos = 0 , it->node = 0 )
+	{
+		if ( cur->engine == HTABLE_OPENADDR )
+		{
+			while ( it->pos < cur->capacity )
+			{
+				i = it->pos++;
+				if ( cur->ctrl[i] >= 0 )
+					return cur->slots[i].val;
+			}
+		}else{
+			while ( it->node == 0 && it->pos < cur->table_size )
+				it->node = cur->table[it->pos++];
 
-	while ( lock->use )
-		pthread_cond_wait( &lock->pcond, &lock->mutex );
+			if ( ( node = it->node ) != 0 )
+			{
+				it->node = node->next;
+				return node->val;
+			}
+		}
 
-	lock->use = 1;
+		if ( cur == ht )
+			break;
+	}
 
-	pthread_mutex_unlock( &lock->mutex );
+	return 0;
+}
+
+/* destroys entire hash table */
+_HIDDEN void htable_destroy ( phtable_t *ht )
+{
+	if ( !ht || !(*ht) )
+		return;
+
+	if ( (*ht)->rehash != 0 )
+	{
+		ht_free ( (*ht)->rehash );
+		free ( (*ht)->rehash );
+	}
+
+	ht_free ( *ht );
+	free ( *ht );
+
+	*ht = 0;
 
 	return;
 }
 
-_HIDDEN void unlock_access ( pntoh_lock_t lock )
+/*****************/
+/** TIMER WHEEL **/
+/*****************/
+inline static void tw_unlink ( ptwentry_t entry )
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->next = entry->prev = 0;
+}
+
+_HIDDEN int twheel_init ( ptwheel_t wheel , size_t size , unsigned long now )
+{
+	size_t i;
+
+	/* power of 2, so the slot is just a mask */
+	for ( wheel->size = 1 ; wheel->size < size ; wheel->size <<= 1 );
+
+	if ( ! ( wheel->slots = (ptwentry_t) calloc ( wheel->size , sizeof ( twentry_t ) ) ) )
+	{
+		wheel->size = 0;
+		return 0;
+	}
+
+	for ( i = 0 ; i < wheel->size ; i++ )
+		wheel->slots[i].next = wheel->slots[i].prev = &wheel->slots[i];
+
+	wheel->current = now;
+	wheel->count = 0;
+
+	return 1;
+}
+
+/* queues (or requeues) an entry to expire at 'expire' */
+_HIDDEN void twheel_add ( ptwheel_t wheel , ptwentry_t entry , unsigned long expire )
+{
+	ptwentry_t head;
+
+	if ( TWHEEL_QUEUED ( entry ) )
+		tw_unlink ( entry );
+	else
+		wheel->count++;
+
+	/* already late, goes to the slot being processed */
+	entry->expire = expire;
+	if ( expire < wheel->current )
+		expire = wheel->current;
+
+	head = &wheel->slots[expire & ( wheel->size - 1 )];
+	entry->next = head;
+	entry->prev = head->prev;
+	head->prev->next = entry;
+	head->prev = entry;
+}
+
+_HIDDEN void twheel_del ( ptwheel_t wheel , ptwentry_t entry )
+{
+	if ( ! TWHEEL_QUEUED ( entry ) )
+		return;
+
+	tw_unlink ( entry );
+	wheel->count--;
+}
+
+/* unlinks and returns the next entry expired at 'now', 0 when there are no more */
+_HIDDEN ptwentry_t twheel_expire ( ptwheel_t wheel , unsigned long now )
+{
+	ptwentry_t	head , entry;
+
+	if ( ! wheel->count )
+	{
+		if ( now >= wheel->current )
+			wheel->current = now + 1;
+		return 0;
+	}
+
+	/* a whole turn already covers every slot */
+	if ( now >= wheel->current + wheel->size )
+		wheel->current = now - wheel->size + 1;
+
+	for ( ; wheel->current <= now ; wheel->current++ )
+	{
+		head = &wheel->slots[wheel->current & ( wheel->size - 1 )];
+
+		for ( entry = head->next ; entry != head ; entry = entry->next )
+			if ( entry->expire <= now )
+			{
+				twheel_del ( wheel , entry );
+				return entry;
+			}
+	}
+
+	return 0;
+}
+
+/* gets the earliest expiration of the queued entries (they may be requeued then), returns 0 if there are none */
+_HIDDEN int twheel_next ( ptwheel_t wheel , unsigned long *expire )
+{
+	ptwentry_t	head , entry;
+	unsigned long	t;
+
+	if ( ! wheel->count )
+		return 0;
+
+	*expire = ULONG_MAX;
+
+	/* the first slot holding an entry of its own turn has the earliest one, late entries are in the current slot */
+	for ( t = wheel->current ; t < wheel->current + wheel->size ; t++ )
+	{
+		head = &wheel->slots[t & ( wheel->size - 1 )];
+
+		for ( entry = head->next ; entry != head ; entry = entry->next )
+		{
+			if ( entry->expire <= t )
+			{
+				*expire = entry->expire;
+				return 1;
+			}
+
+			if ( entry->expire < *expire )
+				*expire = entry->expire;
+		}
+	}
+
+	/* every entry is beyond the wheel horizon */
+	return 1;
+}
+
+_HIDDEN void twheel_free ( ptwheel_t wheel )
+{
+	free ( wheel->slots );
+	wheel->slots = 0;
+	wheel->size = wheel->count = 0;
+}
+
+/*******************/
+/** TIMER SERVICE **/
+/*******************/
+static struct
+{
+	/// protects everything below, never held while a check runs
+	pthread_mutex_t	mutex;
+	/// signaled on (un)registration, on each finished check and on stop
+	pthread_cond_t	cond;
+	/// registered sessions
+	pntoh_timer_t	list;
+	pthread_t	tids[MAX_TIMER_THREADS];
+	/// configured and running threads
+	unsigned int	size;
+	unsigned int	started;
+	int		stop;
+} timers = { PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t timers_once = PTHREAD_ONCE_INIT;
+
+static void timers_setup ( void )
+{
+	pthread_condattr_t attr;
+
+	/* the waits are not affected by wall clock changes */
+	pthread_condattr_init ( &attr );
+	pthread_condattr_setclock ( &attr , CLOCK_MONOTONIC );
+	pthread_cond_init ( &timers.cond , &attr );
+	pthread_condattr_destroy ( &attr );
+
+	timers.size = DEFAULT_TIMER_THREADS;
+}
+
+inline static unsigned long timers_now ( void )
+{
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_MONOTONIC , &ts );
+
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/* returns a due timer not being run, or sets 'wait' to the milliseconds until the next one (ULONG_MAX if none) */
+inline static pntoh_timer_t timers_next ( unsigned long now , unsigned long *wait )
+{
+	pntoh_timer_t timer;
+
+	*wait = ULONG_MAX;
+
+	for ( timer = timers.list ; timer != 0 ; timer = timer->next )
+	{
+		if ( timer->running )
+			continue;
+
+		if ( timer->due <= now )
+			return timer;
+
+		if ( timer->due - now < *wait )
+			*wait = timer->due - now;
+	}
+
+	return 0;
+}
+
+/* runs a check without holding the service mutex, it must be held when called */
+inline static void timers_run ( pntoh_timer_t timer )
+{
+	timer->running = 1;
+	pthread_mutex_unlock ( &timers.mutex );
+
+	timer->check ( timer->session );
+
+	pthread_mutex_lock ( &timers.mutex );
+	timer->running = 0;
+	timer->due = timers_now() + timer->period;
+	pthread_cond_broadcast ( &timers.cond );
+}
+
+static void *timers_thread ( void *p )
+{
+	pntoh_timer_t	timer;
+	unsigned long	wait;
+	struct timespec	ts;
+
+	pthread_mutex_lock ( &timers.mutex );
+
+	while ( !timers.stop )
+	{
+		if ( ( timer = timers_next ( timers_now() , &wait ) ) != 0 )
+		{
+			timers_run ( timer );
+			continue;
+		}
+
+		if ( wait == ULONG_MAX )
+		{
+			pthread_cond_wait ( &timers.cond , &timers.mutex );
+			continue;
+		}
+
+		clock_gettime ( CLOCK_MONOTONIC , &ts );
+		ts.tv_sec += wait / 1000;
+		if ( ( ts.tv_nsec += ( wait % 1000 ) * 1000000 ) >= 1000000000 )
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait ( &timers.cond , &timers.mutex , &ts );
+	}
+
+	pthread_mutex_unlock ( &timers.mutex );
+
+	return 0;
+}
+
+/* starts the missing threads, the service mutex must be held */
+inline static void timers_start ( void )
+{
+	for ( ; !timers.stop && timers.started < timers.size ; timers.started++ )
+		if ( pthread_create ( &timers.tids[timers.started] , 0 , timers_thread , 0 ) != 0 )
+			break;
+}
+
+/* stops and joins all the threads, the registered sessions are kept */
+static void timers_stop ( void )
+{
+	pthread_t	tids[MAX_TIMER_THREADS];
+	unsigned int	count , i;
+
+	pthread_mutex_lock ( &timers.mutex );
+
+	timers.stop = 1;
+	pthread_cond_broadcast ( &timers.cond );
+	count = timers.started;
+	memcpy ( tids , timers.tids , count * sizeof ( pthread_t ) );
+	timers.started = 0;
+
+	pthread_mutex_unlock ( &timers.mutex );
+
+	for ( i = 0 ; i < count ; i++ )
+		pthread_join ( tids[i] , 0 );
+
+	pthread_mutex_lock ( &timers.mutex );
+	timers.stop = 0;
+	pthread_mutex_unlock ( &timers.mutex );
+}
+
+_HIDDEN void timers_register ( pntoh_timer_t timer , void (*check) ( void* ) , void *session , unsigned long period )
+{
+	pthread_once ( &timers_once , timers_setup );
+
+	pthread_mutex_lock ( &timers.mutex );
+
+	timer->check = check;
+	timer->session = session;
+	timer->period = period;
+	timer->due = timers_now() + period;
+	timer->running = 0;
+	timer->next = timers.list;
+	timers.list = timer;
+
+	/* threads are started with the first session */
+	timers_start();
+	pthread_cond_broadcast ( &timers.cond );
+
+	pthread_mutex_unlock ( &timers.mutex );
+}
+
+_HIDDEN void timers_unregister ( pntoh_timer_t timer )
+{
+	pntoh_timer_t *ptr;
+
+	if ( !timer->check )
+		return;
+
+	pthread_mutex_lock ( &timers.mutex );
+
+	while ( timer->running )
+		pthread_cond_wait ( &timers.cond , &timers.mutex );
+
+	for ( ptr = &timers.list ; *ptr != 0 && *ptr != timer ; ptr = &(*ptr)->next );
+
+	if ( *ptr != 0 )
+		*ptr = timer->next;
+
+	timer->check = 0;
+	timer->next = 0;
+
+	pthread_mutex_unlock ( &timers.mutex );
+}
+
+_HIDDEN void timers_exit ( void )
+{
+	pthread_once ( &timers_once , timers_setup );
+	timers_stop();
+}
+
+int ntoh_set_timer_threads ( unsigned int threads )
+{
+	if ( threads > MAX_TIMER_THREADS )
+		return NTOH_ERROR_PARAMS;
+
+	pthread_once ( &timers_once , timers_setup );
+	timers_stop();
+
+	pthread_mutex_lock ( &timers.mutex );
+
+	timers.size = threads;
+	if ( timers.list != 0 )
+		timers_start();
+
+	pthread_mutex_unlock ( &timers.mutex );
+
+	return NTOH_OK;
+}
+
+void ntoh_run_timers ( void )
+{
+	pntoh_timer_t	timer;
+	unsigned long	now , wait;
+
+	pthread_once ( &timers_once , timers_setup );
+
+	pthread_mutex_lock ( &timers.mutex );
+
+	/* each check moves its timer forward, so every timer runs once at most */
+	for ( now = timers_now() ; ( timer = timers_next ( now , &wait ) ) != 0 ; )
+		timers_run ( timer );
+
+	pthread_mutex_unlock ( &timers.mutex );
+}
+
+/*******************/
+/** EPOCH SERVICE **/
+/*******************/
+static struct
+{
+	/// record of each thread
+	pthread_key_t		key;
+	/// all the records, never released (reused by new threads)
+	pntoh_epoch_record_t	records;
+	/// global epoch, only moves forward once every reader has seen it
+	unsigned long		global;
+} epochs;
+
+static pthread_once_t epochs_once = PTHREAD_ONCE_INIT;
+
+/* thread exit, its record can be reused */
+static void epochs_release ( void *p )
+{
+	pntoh_epoch_record_t rec = (pntoh_epoch_record_t) p;
+
+	rec->nest = 0;
+	__atomic_store_n ( &rec->state , 0 , __ATOMIC_RELEASE );
+	__atomic_store_n ( &rec->inuse , 0 , __ATOMIC_RELEASE );
+}
+
+static void epochs_setup ( void )
+{
+	pthread_key_create ( &epochs.key , epochs_release );
+}
+
+/* gets (or takes) the record of the calling thread */
+static pntoh_epoch_record_t epochs_record ( void )
+{
+	pntoh_epoch_record_t	rec = 0;
+	int			unused = 0;
+
+	pthread_once ( &epochs_once , epochs_setup );
+
+	if ( ( rec = (pntoh_epoch_record_t) pthread_getspecific ( epochs.key ) ) != 0 )
+		return rec;
+
+	for ( rec = __atomic_load_n ( &epochs.records , __ATOMIC_ACQUIRE ) ; rec != 0 ; rec = rec->next , unused = 0 )
+		if ( __atomic_compare_exchange_n ( &rec->inuse , &unused , 1 , 0 , __ATOMIC_ACQUIRE , __ATOMIC_RELAXED ) )
+			break;
+
+	if ( rec == 0 )
+	{
+		if ( ! ( rec = (pntoh_epoch_record_t) calloc ( 1 , sizeof ( ntoh_epoch_record_t ) ) ) )
+			return 0;
+
+		rec->inuse = 1;
+		rec->next = __atomic_load_n ( &epochs.records , __ATOMIC_RELAXED );
+		while ( ! __atomic_compare_exchange_n ( &epochs.records , &rec->next , rec , 1 , __ATOMIC_RELEASE , __ATOMIC_RELAXED ) );
+	}
+
+	pthread_setspecific ( epochs.key , rec );
+
+	return rec;
+}
+
+/* moves the global epoch forward if every thread in a read section has seen the current one */
+static unsigned long epochs_advance ( void )
+{
+	pntoh_epoch_record_t	rec = 0;
+	unsigned long		epoch = __atomic_load_n ( &epochs.global , __ATOMIC_SEQ_CST );
+	unsigned long		state = 0;
+
+	for ( rec = __atomic_load_n ( &epochs.records , __ATOMIC_ACQUIRE ) ; rec != 0 ; rec = rec->next )
+		if ( ( ( state = __atomic_load_n ( &rec->state , __ATOMIC_SEQ_CST ) ) & 1 ) && ( state >> 1 ) != epoch )
+			return epoch;
+
+	/* on failure, another thread moved it */
+	if ( __atomic_compare_exchange_n ( &epochs.global , &epoch , epoch + 1 , 0 , __ATOMIC_SEQ_CST , __ATOMIC_SEQ_CST ) )
+		epoch++;
+
+	return epoch;
+}
+
+_HIDDEN unsigned long epoch_retire ( void )
+{
+	/* the unlink must be visible before reading the epoch */
+	__atomic_thread_fence ( __ATOMIC_SEQ_CST );
+
+	return __atomic_load_n ( &epochs.global , __ATOMIC_SEQ_CST );
+}
+
+/* two epochs later, every reader that could see the object has left its read section */
+_HIDDEN int epoch_expired ( unsigned long epoch )
+{
+	if ( __atomic_load_n ( &epochs.global , __ATOMIC_ACQUIRE ) - epoch >= 2 )
+		return 1;
+
+	return epochs_advance() - epoch >= 2;
+}
+
+int ntoh_epoch_enter ( void )
+{
+	pntoh_epoch_record_t rec = epochs_record();
+
+	if ( !rec )
+		return NTOH_ERROR_NOMEM;
+
+	/* the structures are read after publishing the epoch */
+	if ( rec->nest++ == 0 )
+	{
+		__atomic_store_n ( &rec->state , ( __atomic_load_n ( &epochs.global , __ATOMIC_RELAXED ) << 1 ) | 1 , __ATOMIC_SEQ_CST );
+		__atomic_thread_fence ( __ATOMIC_SEQ_CST );
+	}
+
+	return NTOH_OK;
+}
+
+void ntoh_epoch_exit ( void )
+{
+	pntoh_epoch_record_t rec = 0;
+
+	pthread_once ( &epochs_once , epochs_setup );
+
+	if ( ! ( rec = (pntoh_epoch_record_t) pthread_getspecific ( epochs.key ) ) || rec->nest == 0 )
+		return;
+
+	if ( --rec->nest == 0 )
+		__atomic_store_n ( &rec->state , 0 , __ATOMIC_RELEASE );
+}
+
+/***********/
+/** CLOCK **/
+/***********/
+_HIDDEN void get_session_time ( unsigned int flags , const struct timeval *clock , struct timeval *tv )
+{
+	if ( flags & NTOH_SESSION_CALLER_CLOCK )
+		*tv = *clock;
+	else
+		gettimeofday ( tv , 0 );
+}
+
+/* the clock never goes backwards (capture timestamps may be slightly disordered) */
+_HIDDEN int set_session_time ( struct timeval *clock , const struct timeval *tv )
+{
+	int ret = 0;
+
+	if ( ! timercmp ( tv , clock , > ) )
+		return ret;
+
+	ret = ( tv->tv_sec != clock->tv_sec );
+	*clock = *tv;
+
+	return ret;
+}
+
+/**************/
+/** TOEPLITZ **/
+/**************/
+_HIDDEN unsigned int toeplitz_hash ( const unsigned char *key , const unsigned char *data , size_t len )
+{
+	unsigned long long	window;
+	unsigned int		ret = 0;
+	size_t			i;
+	int			bit;
+
+	for ( i = 0 ; i < len ; i++ )
+	{
+		/* 40 bits of the key starting at this byte, each input bit selects the 32 bits starting at its position */
+		window = ( (unsigned long long) key[i] << 32 ) | ( (unsigned long long) key[i + 1] << 24 ) |
+			( (unsigned long long) key[i + 2] << 16 ) | ( (unsigned long long) key[i + 3] << 8 ) | key[i + 4];
+
+		for ( bit = 0 ; bit < 8 ; bit++ )
+			if ( data[i] & ( 0x80 >> bit ) )
+				ret ^= (unsigned int) ( window >> ( 8 - bit ) );
+	}
+
+	return ret;
+}
+
+/****************/
+/** SEMAPHORES **/
+/****************/
+/* changes the amount of units of a counting semaphore keeping the units already taken */
+_HIDDEN int resize_semaphore ( sem_t *sem , size_t cursize , size_t newsize )
 {
-	pthread_mutex_lock( &lock->mutex );
+	int	avail = 0;
+	size_t	i = 0;
+
+	if ( newsize >= cursize )
+	{
+		for ( i = cursize ; i < newsize ; i++ )
+			sem_post ( sem );
+
+		return 1;
+	}
+
+	sem_getvalue ( sem , &avail );
+	if ( avail < 0 || (size_t) avail < cursize - newsize )
+		return 0;
+
+	for ( i = newsize ; i < cursize ; i++ )
+		if ( sem_trywait ( sem ) != 0 )
+		{
+			/* taken meanwhile, give back what we got */
+			for ( ; i > newsize ; i-- )
+				sem_post ( sem );
+
+			return 0;
+		}
+
+	return 1;
+}
+
+/********************/
+/** ACCESS LOCKING **/
+/********************/
+#if defined(__x86_64__) || defined(__i386__)
+# define CPU_RELAX()	__builtin_ia32_pause()
+#else
+# define CPU_RELAX()
+#endif
 
+_HIDDEN void init_lockaccess ( pntoh_lock_t lock , int mode )
+{
 	lock->use = 0;
-	pthread_cond_signal( &lock->pcond );
+	lock->mode = mode;
+
+	switch ( mode )
+	{
+		case LOCK_CONDVAR:
+			pthread_cond_init ( &lock->pcond , 0 );
+			/* fall through */
+		case LOCK_MUTEX:
+			pthread_mutex_init ( &lock->mutex , 0 );
+			break;
+	}
+
+	return;
+}
+
+_HIDDEN void lock_access ( pntoh_lock_t lock )
+{
+	if ( lock == 0 )
+		return;
+
+	switch ( lock->mode )
+	{
+		case LOCK_MUTEX:
+			pthread_mutex_lock ( &lock->mutex );
+			break;
+
+		case LOCK_SPIN:
+			while ( __atomic_exchange_n ( &lock->use , 1 , __ATOMIC_ACQUIRE ) )
+				while ( __atomic_load_n ( &lock->use , __ATOMIC_RELAXED ) )
+					CPU_RELAX();
+			break;
+
+		case LOCK_NONE:
+			break;
+
+		default:
+			pthread_mutex_lock( &lock->mutex );
+
+			while ( lock->use )
+				pthread_cond_wait( &lock->pcond, &lock->mutex );
+
+			lock->use = 1;
+
+			pthread_mutex_unlock( &lock->mutex );
+			break;
+	}
+
+	return;
+}
+
+_HIDDEN void unlock_access ( pntoh_lock_t lock )
+{
+	if ( lock == 0 )
+		return;
 
-	pthread_mutex_unlock( &lock->mutex );
+	switch ( lock->mode )
+	{
+		case LOCK_MUTEX:
+			pthread_mutex_unlock ( &lock->mutex );
+			break;
+
+		case LOCK_SPIN:
+			__atomic_store_n ( &lock->use , 0 , __ATOMIC_RELEASE );
+			break;
+
+		case LOCK_NONE:
+			break;
+
+		default:
+			pthread_mutex_lock( &lock->mutex );
+
+			lock->use = 0;
+			pthread_cond_signal( &lock->pcond );
+
+			pthread_mutex_unlock( &lock->mutex );
+			break;
+	}
 
 	return;
 }
 
+_HIDDEN int trylock_access ( pntoh_lock_t lock )
+{
+	int ret = 0;
+
+	if ( lock == 0 )
+		return 1;
+
+	switch ( lock->mode )
+	{
+		case LOCK_MUTEX:
+			ret = ( pthread_mutex_trylock ( &lock->mutex ) == 0 );
+			break;
+
+		case LOCK_SPIN:
+			ret = !__atomic_exchange_n ( &lock->use , 1 , __ATOMIC_ACQUIRE );
+			break;
+
+		case LOCK_NONE:
+			ret = 1;
+			break;
+
+		default:
+			pthread_mutex_lock( &lock->mutex );
+
+			if ( !lock->use )
+			{
+				lock->use = 1;
+				ret = 1;
+			}
+
+			pthread_mutex_unlock( &lock->mutex );
+			break;
+	}
+
+	return ret;
+}
+
 _HIDDEN void free_lockaccess ( pntoh_lock_t lock )
 {
-	pthread_cond_destroy( &lock->pcond );
-	pthread_mutex_destroy( &lock->mutex );
+	if ( lock == 0 )
+		return;
+
+	switch ( lock->mode )
+	{
+		case LOCK_CONDVAR:
+			pthread_cond_destroy( &lock->pcond );
+			pthread_mutex_destroy( &lock->mutex );
+			break;
+
+		case LOCK_MUTEX:
+			pthread_mutex_destroy( &lock->mutex );
+			break;
+	}
 
 	return;
 }
@@ -0,0 +1,360 @@
+/********************************************************************************
+ * Copyright (c) 2012, Chema Garcia                                             *
+ * All rights reserved.                                                         *
+ *                                                                              *
+ * Redistribution and use in source and binary forms, with or                   *
+ * without modification, are permitted provided that the following              *
+ * conditions are met:                                                          *
+ *                                                                              *
+ *    * Redistributions of source code must retain the above                    *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer.                                                             *
+ *                                                                              *
+ *    * Redistributions in binary form must reproduce the above                 *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer in the documentation and/or other materials provided         *
+ *      with the distribution.                                                  *
+ *                                                                              *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"  *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE    *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE   *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE    *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR          *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF         *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS     *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN      *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)      *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE   *
+ * POSSIBILITY OF SUCH DAMAGE.                                                  *
+ ********************************************************************************/
+
+#define __FAVOR_BSD
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libntoh.h>
+
+/** @brief reads a 16 bits big endian value **/
+#define GET_U16(p)	( (unsigned short) ( ( ((unsigned char*)(p))[0] << 8 ) | ((unsigned char*)(p))[1] ) )
+
+/** @brief Decodes an IPv4 header **/
+inline static int decode_ipv4 ( struct ip *ip , size_t len , pntoh_packet_t pkt )
+{
+	if ( len < sizeof(struct ip) )
+		return NTOH_INCORRECT_LENGTH;
+
+	if ( ip->ip_v != 4 )
+		return NTOH_NOT_IPV4;
+
+	if ( ( pkt->iphdr_len = 4 * ( ip->ip_hl ) ) < sizeof(struct ip) )
+		return NTOH_INCORRECT_IP_HEADER_LENGTH;
+
+	if ( ( pkt->len = ntohs ( ip->ip_len ) ) < pkt->iphdr_len )
+		return NTOH_INCORRECT_LENGTH;
+
+	if ( pkt->len > len )
+		return NTOH_NOT_ENOUGH_DATA;
+
+	pkt->version = 4;
+	pkt->protocol = ip->ip_p;
+	pkt->fragment = NTOH_IPV4_IS_FRAGMENT(ip->ip_off);
+
+	return NTOH_OK;
+}
+
+/** @brief Decodes an IPv6 header and skips the extension headers **/
+inline static int decode_ipv6 ( struct ip6_hdr *ip , size_t len , pntoh_packet_t pkt )
+{
+	unsigned char *ext = 0;
+
+	if ( len < sizeof(struct ip6_hdr) )
+		return NTOH_INCORRECT_LENGTH;
+
+	if ( ((ip->ip6_vfc >> 4) & 0x0F) != 6 )
+		return NTOH_NOT_IPV6;
+
+	if ( ( pkt->len = sizeof ( struct ip6_hdr ) + ntohs ( ip->ip6_plen ) ) > len )
+		return NTOH_NOT_ENOUGH_DATA;
+
+	pkt->version = 6;
+	pkt->iphdr_len = sizeof ( struct ip6_hdr );
+	pkt->protocol = ip->ip6_nxt;
+
+	/* the IPv6 defragmentation only handles a fragment header right after the IPv6 one */
+	if ( pkt->protocol == IPPROTO_FRAGMENT )
+	{
+		if ( pkt->len < sizeof ( struct ip6_hdr ) + sizeof ( struct ip6_frag ) )
+			return NTOH_INCORRECT_LENGTH;
+
+		pkt->fragment = NTOH_IPV6_IS_FRAGMENT(ip) ? 1 : 0;
+		return NTOH_OK;
+	}
+
+	while ( pkt->protocol == IPPROTO_HOPOPTS || pkt->protocol == IPPROTO_ROUTING || pkt->protocol == IPPROTO_DSTOPTS )
+	{
+		if ( pkt->iphdr_len + 8 > pkt->len )
+			return NTOH_INCORRECT_IP_HEADER_LENGTH;
+
+		ext = (unsigned char*) ip + pkt->iphdr_len;
+		pkt->protocol = ext[0];
+		pkt->iphdr_len += ( ext[1] + 1 ) * 8;
+	}
+
+	if ( pkt->iphdr_len > pkt->len )
+		return NTOH_INCORRECT_IP_HEADER_LENGTH;
+
+	return NTOH_OK;
+}
+
+/** @brief API to decode a captured frame **/
+int ntoh_decode_packet ( unsigned int linktype , void *frame , size_t len , pntoh_packet_t pkt )
+{
+	unsigned char	*data = (unsigned char*) frame;
+	unsigned short	type = 0;
+	int		ret = NTOH_OK;
+
+	if ( !frame || !pkt )
+		return NTOH_ERROR_PARAMS;
+
+	memset ( pkt , 0 , sizeof ( ntoh_packet_t ) );
+
+	/* skip the link layer header */
+	switch ( linktype )
+	{
+		case NTOH_LINK_RAW:
+			if ( !len )
+				return NTOH_INCORRECT_LENGTH;
+
+			if ( ( *data >> 4 ) == 4 )
+				type = NTOH_ETHERTYPE_IPV4;
+			else if ( ( *data >> 4 ) == 6 )
+				type = NTOH_ETHERTYPE_IPV6;
+			else
+				return NTOH_INCORRECT_IP_HEADER;
+			break;
+
+		case NTOH_LINK_ETHERNET:
+			if ( len < NTOH_ETHERNET_HDR_LEN )
+				return NTOH_INCORRECT_LENGTH;
+
+			type = GET_U16 ( data + NTOH_ETHERNET_HDR_LEN - 2 );
+			data += NTOH_ETHERNET_HDR_LEN;
+			len -= NTOH_ETHERNET_HDR_LEN;
+
+			while ( type == NTOH_ETHERTYPE_VLAN || type == NTOH_ETHERTYPE_QINQ )
+			{
+				if ( len < NTOH_VLAN_TAG_LEN )
+					return NTOH_INCORRECT_LENGTH;
+
+				type = GET_U16 ( data + NTOH_VLAN_TAG_LEN - 2 );
+				data += NTOH_VLAN_TAG_LEN;
+				len -= NTOH_VLAN_TAG_LEN;
+			}
+			break;
+
+		case NTOH_LINK_LINUX_SLL:
+			if ( len < NTOH_LINUX_SLL_HDR_LEN )
+				return NTOH_INCORRECT_LENGTH;
+
+			type = GET_U16 ( data + NTOH_LINUX_SLL_HDR_LEN - 2 );
+			data += NTOH_LINUX_SLL_HDR_LEN;
+			len -= NTOH_LINUX_SLL_HDR_LEN;
+			break;
+
+		default:
+			return NTOH_ERROR_PARAMS;
+	}
+
+	pkt->ip = (void*) data;
+
+	switch ( type )
+	{
+		case NTOH_ETHERTYPE_IPV4:
+			ret = decode_ipv4 ( (struct ip*) data , len , pkt );
+			break;
+
+		case NTOH_ETHERTYPE_IPV6:
+			ret = decode_ipv6 ( (struct ip6_hdr*) data , len , pkt );
+			break;
+
+		default:
+			return NTOH_PACKET_IGNORED;
+	}
+
+	if ( ret != NTOH_OK )
+		return ret;
+
+	if ( !pkt->fragment && pkt->protocol == IPPROTO_TCP )
+		ret = tcp_decode_header ( pkt );
+
+	return ret;
+}
+
+/** @brief Sends a decoded IP fragment to its defragmentation session **/
+inline static int process_fragment ( pntoh_dispatcher_t disp , pntoh_packet_t pkt )
+{
+	ntoh_ipv4_tuple4_t	tuple4;
+	ntoh_ipv6_tuple4_t	tuple6;
+	pntoh_ipv4_flow_t	flow4 = 0;
+	pntoh_ipv6_flow_t	flow6 = 0;
+	unsigned int		error = 0;
+
+	if ( pkt->version == 4 && disp->ipv4 != 0 )
+	{
+		if ( !disp->ipv4_function && !disp->ipv4_vfunction && !disp->ipv4->link )
+			return NTOH_ERROR_NOFUNCTION;
+
+		memset ( &tuple4 , 0 , sizeof ( tuple4 ) );
+		ntoh_ipv4_get_tuple4 ( (struct ip*) pkt->ip , &tuple4 );
+
+		if ( ! ( flow4 = ipv4_get_flow ( disp->ipv4 , &tuple4 , disp->ipv4_function , disp->ipv4_vfunction , disp->udata , &error ) ) )
+			return error;
+
+		return ntoh_ipv4_add_fragment ( disp->ipv4 , flow4 , (struct ip*) pkt->ip );
+	}
+
+	if ( pkt->version == 6 && disp->ipv6 != 0 )
+	{
+		if ( !disp->ipv6_function && !disp->ipv6_vfunction && !disp->ipv6->link )
+			return NTOH_ERROR_NOFUNCTION;
+
+		memset ( &tuple6 , 0 , sizeof ( tuple6 ) );
+		ntoh_ipv6_get_tuple4 ( (struct ip6_hdr*) pkt->ip , &tuple6 );
+
+		if ( ! ( flow6 = ipv6_get_flow ( disp->ipv6 , &tuple6 , disp->ipv6_function , disp->ipv6_vfunction , disp->udata , &error ) ) )
+			return error;
+
+		return ntoh_ipv6_add_fragment ( disp->ipv6 , flow6 , (struct ip6_hdr*) pkt->ip );
+	}
+
+	return NTOH_PACKET_IGNORED;
+}
+
+/** @brief Sends an IPv6 atomic fragment (offset 0 and no more fragments) to its defragmentation session **/
+inline static int process_atomic ( pntoh_dispatcher_t disp , pntoh_packet_t pkt , void *udata )
+{
+	if ( pkt->version != 6 || !disp->ipv6 )
+		return NTOH_PACKET_IGNORED;
+
+	/* a fragment header after other extension headers is not handled */
+	if ( pkt->fragment || pkt->iphdr_len != sizeof ( struct ip6_hdr ) )
+		return NTOH_PACKET_IGNORED;
+
+	if ( !disp->ipv6_function && !disp->ipv6_vfunction && !disp->ipv6->link )
+		return NTOH_ERROR_NOFUNCTION;
+
+	return ipv6_atomic_datagram ( disp->ipv6 , pkt , disp->ipv6_function , disp->ipv6_vfunction , disp->udata , udata );
+}
+
+/** @brief Sends a defragmented datagram to the reassembly of the linked TCP session **/
+_HIDDEN int tcp_link_datagram ( pntoh_tcp_link_t link , void *datagram , size_t len )
+{
+	ntoh_packet_t	pkt;
+	int		ret = NTOH_OK;
+
+	if ( ( ret = ntoh_decode_packet ( NTOH_LINK_RAW , datagram , len , &pkt ) ) != NTOH_OK )
+		return ret;
+
+	if ( pkt.fragment || pkt.protocol != IPPROTO_TCP )
+		return NTOH_PACKET_IGNORED;
+
+	return tcp_process_packet ( link->tcp , &pkt , link->function , link->udata , 0 , link->enable_check_timeout , link->enable_check_nowindow );
+}
+
+/** @brief API to send a captured frame to its session **/
+int ntoh_process_packet ( pntoh_dispatcher_t disp , void *frame , size_t len , void *udata )
+{
+	ntoh_packet_t	pkt;
+	int		ret = NTOH_OK;
+
+	if ( !disp )
+		return NTOH_ERROR_PARAMS;
+
+	if ( ( ret = ntoh_decode_packet ( disp->linktype , frame , len , &pkt ) ) != NTOH_OK )
+		return ret;
+
+	/* IP fragments */
+	if ( pkt.fragment )
+		return process_fragment ( disp , &pkt );
+
+	/* datagrams complete on arrival skip the flows table */
+	if ( pkt.protocol == IPPROTO_FRAGMENT )
+		return process_atomic ( disp , &pkt , udata );
+
+	/* TCP segments */
+	if ( pkt.protocol == IPPROTO_TCP && disp->tcp != 0 )
+	{
+		if ( !disp->tcp_function )
+			return NTOH_ERROR_NOFUNCTION;
+
+		return tcp_process_packet ( disp->tcp , &pkt , disp->tcp_function , disp->udata , udata , disp->enable_check_timeout , disp->enable_check_nowindow );
+	}
+
+	return NTOH_PACKET_IGNORED;
+}
+
+/** @brief Adds the TCP segments gathered from a burst, 'index' gives the position of each one in 'ret' **/
+inline static void process_segments ( pntoh_dispatcher_t disp , pntoh_packet_t *segments , void **segments_udata , unsigned int *index , unsigned int total , int *ret )
+{
+	int		segments_ret[DEFAULT_TCP_BURST];
+	unsigned int	i;
+
+	if ( !total )
+		return;
+
+	tcp_process_burst ( disp->tcp , segments , segments_udata , segments_ret , total , disp->tcp_function , disp->udata , disp->enable_check_timeout , disp->enable_check_nowindow );
+
+	for ( i = 0 ; i < total ; i++ )
+		ret[index[i]] = segments_ret[i];
+}
+
+/** @brief API to send a burst of captured frames to their sessions **/
+int ntoh_process_packets ( pntoh_dispatcher_t disp , void **frames , size_t *lens , void **udata , int *ret , unsigned int count )
+{
+	ntoh_packet_t	pkts[DEFAULT_TCP_BURST];
+	pntoh_packet_t	segments[DEFAULT_TCP_BURST];
+	void		*segments_udata[DEFAULT_TCP_BURST];
+	unsigned int	index[DEFAULT_TCP_BURST];
+	unsigned int	base , n , i , total;
+
+	if ( !disp || !frames || !lens || !ret )
+		return NTOH_ERROR_PARAMS;
+
+	for ( base = 0 ; base < count ; base += n )
+	{
+		n = count - base < DEFAULT_TCP_BURST ? count - base : DEFAULT_TCP_BURST;
+		total = 0;
+
+		for ( i = 0 ; i < n ; i++ )
+		{
+			if ( ( ret[base + i] = ntoh_decode_packet ( disp->linktype , frames[base + i] , lens[base + i] , &pkts[i] ) ) != NTOH_OK )
+				continue;
+
+			/* a defragmented datagram may reach a linked TCP session, after the segments received before it */
+			if ( pkts[i].fragment || pkts[i].protocol == IPPROTO_FRAGMENT )
+			{
+				process_segments ( disp , segments , segments_udata , index , total , ret );
+				total = 0;
+			}
+
+			if ( pkts[i].fragment )
+				ret[base + i] = process_fragment ( disp , &pkts[i] );
+			else if ( pkts[i].protocol == IPPROTO_FRAGMENT )
+				ret[base + i] = process_atomic ( disp , &pkts[i] , udata != 0 ? udata[base + i] : 0 );
+			else if ( pkts[i].protocol != IPPROTO_TCP || !disp->tcp )
+				ret[base + i] = NTOH_PACKET_IGNORED;
+			else if ( !disp->tcp_function )
+				ret[base + i] = NTOH_ERROR_NOFUNCTION;
+			else
+			{
+				index[total] = base + i;
+				segments[total] = &pkts[i];
+				segments_udata[total++] = udata != 0 ? udata[base + i] : 0;
+			}
+		}
+
+		process_segments ( disp , segments , segments_udata , index , total , ret );
+	}
+
+	return NTOH_OK;
+}
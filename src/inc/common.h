@@ -31,6 +31,9 @@
  * POSSIBILITY OF SUCH DAMAGE.                                                  *
  ********************************************************************************/
 
+#include <stddef.h>
+#include <sys/time.h>
+
 #ifndef _HIDDEN
 # define _HIDDEN __attribute__((visibility("hidden")))
 #endif
@@ -43,32 +46,281 @@ typedef struct _hash_node_
 	unsigned int		key;
 } htnode_t , *phtnode_t;
 
+/* open addressing slot */
+typedef struct
+{
+	unsigned int		key;
+	void			*val;
+} htslot_t , *phtslot_t;
+
 typedef unsigned short fcmp_t (void *a, void *b);
 
-/* hash table definition */
+/** @brief hash table engines **/
+enum htable_engine
+{
+	HTABLE_CHAINED = 0,
+	HTABLE_OPENADDR
+};
+
+/** @brief hash table engine selected by the session flags **/
+#define HTABLE_ENGINE(flags)	( ( (flags) & NTOH_SESSION_OPENADDR_TABLE ) ? HTABLE_OPENADDR : HTABLE_CHAINED )
+
+/** @brief locking backends **/
+enum lock_mode
+{
+	LOCK_CONDVAR = 0,
+	LOCK_MUTEX,
+	LOCK_SPIN,
+	LOCK_NONE
+};
+
+/** @brief locking backend selected by the session flags **/
+#define LOCK_MODE(flags)	( ( (flags) & NTOH_SESSION_LOCK_MASK ) >> 9 )
+
+/** @brief IP defragmentation memory budget counters **/
+typedef struct
+{
+	/// bytes held by the stored fragments (headers + data)
+	size_t		mem_used;
+	/// memory budget of the session
+	size_t		mem_max;
+	/// fragments rejected because the budget was exhausted
+	unsigned long	rejected;
+	/// flows evicted to make room for new fragments
+	unsigned long	evicted;
+	/// bytes released by the evicted flows
+	unsigned long	evicted_bytes;
+	/// datagrams complete on arrival (IPv6 atomic fragments) delivered without flow state, always 0 for IPv4
+	unsigned long	atomic;
+	/// flows stored in the session
+	unsigned int	flows;
+} ntoh_defrag_stats_t , *pntoh_defrag_stats_t;
+
+/** @brief object pool statistics **/
 typedef struct
+{
+	/// size of each object
+	size_t		object_size;
+	/// objects carved from the chunks (in use + free)
+	size_t		capacity;
+	/// objects in use
+	size_t		in_use;
+	/// max. objects in use at once
+	size_t		peak;
+	/// total allocations served
+	unsigned long	allocs;
+	/// memory chunks requested to the system
+	unsigned long	chunks;
+} ntoh_pool_stats_t , *pntoh_pool_stats_t;
+
+/**
+ * @brief object pool
+ *
+ * Fixed size objects carved from chunks and reused through a free list.
+ * The memory is only given back to the system when the pool is destroyed.
+ */
+typedef struct _ntoh_pool_
+{
+	/// free objects list
+	void			*free;
+	/// allocated chunks
+	void			*chunks;
+	/// objects per new chunk
+	size_t			chunk;
+	ntoh_lock_t		lock;
+	ntoh_pool_stats_t	stats;
+} ntoh_pool_t , *pntoh_pool_t;
+
+/** @brief Default objects per chunk when a pool grows **/
+#ifndef DEFAULT_POOL_CHUNK
+# define DEFAULT_POOL_CHUNK	256
+#endif
+
+/* hash table definition */
+typedef struct _hash_table_
 {
 	size_t		table_size;
 	phtnode_t	*table;
 	fcmp_t		*equals;
+	unsigned short	engine;
+
+	/* open addressing engine (see htable_map) */
+	size_t		capacity;
+	signed char	*ctrl;
+	phtslot_t	slots;
+	size_t		used;
+	size_t		deleted;
+
+	/* chained nodes are taken from here when set (malloc otherwise) */
+	pntoh_pool_t	pool;
+
+	/* table being migrated by an incremental resize (see htable_resize) */
+	struct _hash_table_	*rehash;
+	size_t			rehash_pos;
 } htable_t , *phtable_t;
 
+/* hash table iterator, must be zeroed before the first call */
+typedef struct
+{
+	size_t		pos;
+	phtnode_t	node;
+	phtable_t	table;
+} htiter_t , *phtiter_t;
+
+/** @brief is the table being resized? **/
+#define HTABLE_REHASHING(ht)	( (ht)->rehash != 0 && (ht)->rehash->table_size != 0 )
+
+/** @brief Buckets moved to the new table on each operation while resizing **/
+#ifndef HTABLE_REHASH_STEPS
+# define HTABLE_REHASH_STEPS	8
+#endif
+
 /******************************************************************/
 /** Hash Table implementation (collision resolution by chaining) **/
+/** or open addressing with SIMD probing of the control bytes    **/
 /******************************************************************/
-phtable_t htable_map ( size_t size , fcmp_t *equal_func );
+phtable_t htable_map ( size_t size , fcmp_t *equal_func , unsigned short engine );
 int htable_insert ( phtable_t ht  , unsigned int key , void *val );
 void *htable_find ( phtable_t ht , unsigned int key, void *ip_tuple4 );
+void htable_prefetch ( phtable_t ht , unsigned int key );
 void *htable_remove ( phtable_t ht , unsigned int key, void *ip_tuple4 );
+int htable_resize ( phtable_t ht , size_t size );
 unsigned int htable_count ( phtable_t ht );
 unsigned int htable_first ( phtable_t ht );
+void *htable_iterate ( phtable_t ht , phtiter_t it );
 void htable_destroy ( phtable_t *ht );
 
+/*****************/
+/** Object pool **/
+/*****************/
+int pool_init ( pntoh_pool_t pool , size_t size , size_t prealloc , int mode );
+void *pool_alloc ( pntoh_pool_t pool );
+void pool_free ( pntoh_pool_t pool , void *obj );
+void pool_get_stats ( pntoh_pool_t pool , pntoh_pool_stats_t stats );
+void pool_destroy ( pntoh_pool_t pool );
+
+/** @brief timer wheel entry, embedded in the objects to be expired **/
+typedef struct _twheel_entry_
+{
+	struct _twheel_entry_	*next;
+	struct _twheel_entry_	*prev;
+	/// absolute expiration time (seconds)
+	unsigned long		expire;
+} twentry_t , *ptwentry_t;
+
+/**
+ * @brief timer wheel
+ *
+ * Hashed wheel with one slot per second. Entries expiring beyond the
+ * wheel horizon stay in their slot until its turn comes again.
+ */
+typedef struct
+{
+	/// list heads, one per slot
+	ptwentry_t	slots;
+	/// number of slots (power of 2)
+	size_t		size;
+	/// next second to be processed
+	unsigned long	current;
+	/// queued entries
+	size_t		count;
+} twheel_t , *ptwheel_t;
+
+/** @brief gets the object containing a timer wheel entry **/
+#define TWHEEL_ITEM(entry,type,member)	( (type*) ( (char*)(entry) - offsetof ( type , member ) ) )
+
+/** @brief is the entry queued in a timer wheel? **/
+#define TWHEEL_QUEUED(entry)		( (entry)->prev != 0 )
+
+/** @brief Default number of slots of the timer wheels (seconds) **/
+#ifndef DEFAULT_TWHEEL_SLOTS
+# define DEFAULT_TWHEEL_SLOTS	256
+#endif
+
+/*****************/
+/** Timer wheel **/
+/*****************/
+int twheel_init ( ptwheel_t wheel , size_t size , unsigned long now );
+void twheel_add ( ptwheel_t wheel , ptwentry_t entry , unsigned long expire );
+void twheel_del ( ptwheel_t wheel , ptwentry_t entry );
+ptwentry_t twheel_expire ( ptwheel_t wheel , unsigned long now );
+int twheel_next ( ptwheel_t wheel , unsigned long *expire );
+void twheel_free ( ptwheel_t wheel );
+
+/** @brief session registered in the library timer service **/
+typedef struct _ntoh_timer_
+{
+	struct _ntoh_timer_	*next;
+	/// expires the timed out objects of 'session', 0 when not registered
+	void			(*check) ( void* );
+	void			*session;
+	/// check period and next check (milliseconds, monotonic clock)
+	unsigned long		period;
+	unsigned long		due;
+	/// the check is being run by a thread
+	int			running;
+} ntoh_timer_t , *pntoh_timer_t;
+
+/** @brief Default number of threads of the timer service **/
+#ifndef DEFAULT_TIMER_THREADS
+# define DEFAULT_TIMER_THREADS	1
+#endif
+
+/** @brief Max. number of threads of the timer service **/
+#ifndef MAX_TIMER_THREADS
+# define MAX_TIMER_THREADS	64
+#endif
+
+/*******************/
+/** Timer service **/
+/*******************/
+/** @brief Registers a session whose timeouts are checked every 'period' milliseconds **/
+void timers_register ( pntoh_timer_t timer , void (*check) ( void* ) , void *session , unsigned long period );
+/** @brief Unregisters a session, waiting for its check if running (never call it from a check) **/
+void timers_unregister ( pntoh_timer_t timer );
+/** @brief Stops the threads of the timer service **/
+void timers_exit ( void );
+
+/** @brief thread registered in the epoch service (see ntoh_epoch_enter) **/
+typedef struct _ntoh_epoch_record_
+{
+	struct _ntoh_epoch_record_	*next;
+	/// (epoch << 1) | 1 while inside a read section, 0 otherwise
+	unsigned long			state;
+	/// read sections entered and not left yet
+	unsigned int			nest;
+	/// owned by a running thread (released on thread exit)
+	int				inuse;
+} ntoh_epoch_record_t , *pntoh_epoch_record_t;
+
+/*******************/
+/** Epoch service **/
+/*******************/
+/** @brief Epoch of an object just unlinked from a lock-free structure (to be passed to epoch_expired) **/
+unsigned long epoch_retire ( void );
+/** @brief Can an object retired at 'epoch' be reused? (no reader can reach it anymore) **/
+int epoch_expired ( unsigned long epoch );
+
+/** @brief Current time of a session: set by the caller (NTOH_SESSION_CALLER_CLOCK) or the system one **/
+void get_session_time ( unsigned int flags , const struct timeval *clock , struct timeval *tv );
+
+/** @brief Sets the caller clock of a session, returns 1 when it moves to a new second **/
+int set_session_time ( struct timeval *clock , const struct timeval *tv );
+
+/** @brief Toeplitz hash (as computed by the NICs for RSS) of 'len' bytes, 'key' must be 'len' + 4 bytes long at least **/
+unsigned int toeplitz_hash ( const unsigned char *key , const unsigned char *data , size_t len );
+
+/** @brief Resizes a counting semaphore keeping the units already taken **/
+int resize_semaphore ( sem_t *sem , size_t cursize , size_t newsize );
 
-/** @brief Access locking **/
+/** @brief Initializes a lock using the given backend (enum lock_mode) **/
+void init_lockaccess ( pntoh_lock_t lock , int mode );
+/** @brief Access locking (a null lock is never contended) **/
 void lock_access ( pntoh_lock_t lock );
 /** @brief Access unlocking **/
 void unlock_access ( pntoh_lock_t lock );
+/** @brief Access locking without waiting, returns 1 if the lock has been taken **/
+int trylock_access ( pntoh_lock_t lock );
 void free_lockaccess ( pntoh_lock_t lock );
 
 #endif /* __LIBNTOH_COMMON_H__ */
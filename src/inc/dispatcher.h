@@ -0,0 +1,199 @@
+#ifndef __LIBNTOH_DISPATCHER_H__
+# define __LIBNTOH_DISPATCHER_H__
+
+/********************************************************************************
+ * Copyright (c) 2012, Chema Garcia                                             *
+ * All rights reserved.                                                         *
+ *                                                                              *
+ * Redistribution and use in source and binary forms, with or                   *
+ * without modification, are permitted provided that the following              *
+ * conditions are met:                                                          *
+ *                                                                              *
+ *    * Redistributions of source code must retain the above                    *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer.                                                             *
+ *                                                                              *
+ *    * Redistributions in binary form must reproduce the above                 *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer in the documentation and/or other materials provided         *
+ *      with the distribution.                                                  *
+ *                                                                              *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"  *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE    *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE   *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE    *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR          *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF         *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS     *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN      *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)      *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE   *
+ * POSSIBILITY OF SUCH DAMAGE.                                                  *
+ ********************************************************************************/
+
+
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+/** @brief link layer of the frames given to ntoh_process_packet **/
+enum ntoh_linktype
+{
+	NTOH_LINK_RAW = 0,	// no link layer header, frames start at the IP header
+	NTOH_LINK_ETHERNET,	// Ethernet II, with or without 802.1Q/802.1ad tags
+	NTOH_LINK_LINUX_SLL	// Linux cooked capture
+};
+
+/** @brief ethertypes handled by the dispatcher **/
+#define NTOH_ETHERTYPE_IPV4	0x0800
+#define NTOH_ETHERTYPE_IPV6	0x86DD
+#define NTOH_ETHERTYPE_VLAN	0x8100
+#define NTOH_ETHERTYPE_QINQ	0x88A8
+
+/** @brief link header lengths **/
+#define NTOH_ETHERNET_HDR_LEN	14
+#define NTOH_VLAN_TAG_LEN	4
+#define NTOH_LINUX_SLL_HDR_LEN	16
+
+/** @brief Packet decoded by ntoh_decode_packet (all pointers point into the given frame) **/
+typedef struct
+{
+	/// IP header
+	void			*ip;
+	/// length of the IP datagram (from the IP header, link padding excluded)
+	size_t			len;
+	/// IP header length, IPv6 extension headers included
+	size_t			iphdr_len;
+	/// IP version (4 or 6)
+	unsigned char		version;
+	/// upper layer protocol
+	unsigned char		protocol;
+	/// the packet is an IP fragment
+	unsigned char		fragment;
+	/// TCP header (only for non fragmented TCP segments)
+	struct tcphdr		*tcp;
+	size_t			tcphdr_len;
+	size_t			payload_len;
+	/// TSval of the TCP timestamp option, 0 if not present
+	unsigned int		tstamp;
+	/// tuple5 of the TCP segment
+	ntoh_tcp_tuple5_t	tuple;
+} ntoh_packet_t, *pntoh_packet_t;
+
+/** @brief Where and how ntoh_process_packet delivers the packets **/
+typedef struct
+{
+	/// link layer of the frames (NTOH_LINK_*)
+	unsigned int		linktype;
+	/// sessions, packets of a protocol without session are ignored
+	pntoh_tcp_session_t	tcp;
+	pntoh_ipv4_session_t	ipv4;
+	pntoh_ipv6_session_t	ipv6;
+	/// callbacks given to the new streams and flows
+	pntoh_tcp_callback_t	tcp_function;
+	pipv4_dfcallback_t	ipv4_function;
+	pipv6_dfcallback_t	ipv6_function;
+	/// if set, used instead of ipv4_function/ipv6_function (datagrams delivered as an iovec)
+	pipv4_dfvcallback_t	ipv4_vfunction;
+	pipv6_dfvcallback_t	ipv6_vfunction;
+	/// checks enabled on the new streams (see ntoh_tcp_new_stream)
+	unsigned short		enable_check_timeout;
+	unsigned short		enable_check_nowindow;
+	/// user-defined data of the new streams and flows
+	void			*udata;
+} ntoh_dispatcher_t, *pntoh_dispatcher_t;
+
+/** @brief TCP session linked to an IPv4/IPv6 defragmentation session **/
+typedef struct _ntoh_tcp_link_
+{
+	pntoh_tcp_session_t	tcp;
+	/// callback and user-defined data given to the new streams
+	pntoh_tcp_callback_t	function;
+	void			*udata;
+	/// checks enabled on the new streams (see ntoh_tcp_new_stream)
+	unsigned short		enable_check_timeout;
+	unsigned short		enable_check_nowindow;
+} ntoh_tcp_link_t, *pntoh_tcp_link_t;
+
+/**
+ * @brief Decodes the link, IP and TCP headers of a frame
+ *
+ * The headers are validated once. IPv6 extension headers are skipped, and only a
+ * fragment header right after the IPv6 header is reported as a fragment.
+ *
+ * @param linktype Link layer of the frame (NTOH_LINK_*)
+ * @param frame Captured frame
+ * @param len Captured length
+ * @param pkt Output packet descriptor
+ * @return NTOH_OK on success, NTOH_PACKET_IGNORED if it is not an IP packet, or the corresponding error code
+ */
+int ntoh_decode_packet ( unsigned int linktype , void *frame , size_t len , pntoh_packet_t pkt );
+
+/**
+ * @brief Decodes a frame and sends it to the IPv4/IPv6 defragmentation or TCP reassembly session
+ *
+ * The stream or flow is looked up, and created if needed, taking the session lock once.
+ * New TCP streams are only created by a SYN segment.
+ *
+ * @param disp Dispatcher with the sessions and the callbacks
+ * @param frame Captured frame
+ * @param len Captured length
+ * @param udata User-defined data of this segment/fragment
+ * @return The value returned by ntoh_tcp_add_segment/ntoh_ipv(4|6)_add_fragment, NTOH_PACKET_IGNORED
+ * if no session handles the packet, or an API error (NTOH_ERROR_*) if the stream/flow cannot be created
+ */
+int ntoh_process_packet ( pntoh_dispatcher_t disp , void *frame , size_t len , void *udata );
+
+/**
+ * @brief Decodes a burst of frames and sends them to their sessions, in order
+ *
+ * The TCP segments are handled DEFAULT_TCP_BURST at a time: all of them are hashed first,
+ * then the hash buckets and the streams are prefetched and looked up (or created) taking
+ * the session lock once, and finally the segments are added. The segments gathered so far
+ * are added before each IP fragment, as the datagram it completes may carry TCP too.
+ *
+ * @param disp Dispatcher with the sessions and the callbacks
+ * @param frames Captured frames
+ * @param lens Captured length of each frame
+ * @param udata User-defined data of each segment/fragment (may be 0)
+ * @param ret Output, the value ntoh_process_packet would have returned for each frame
+ * @param count Number of frames
+ * @return NTOH_OK on success or NTOH_ERROR_PARAMS
+ */
+int ntoh_process_packets ( pntoh_dispatcher_t disp , void **frames , size_t *lens , void **udata , int *ret , unsigned int count );
+
+/**
+ * @brief Links a TCP session to an IPv4 defragmentation session
+ *
+ * The defragmented datagrams carrying TCP are sent to the reassembly of the TCP session
+ * from the defragmentation itself (as ntoh_process_packet does with the TCP segments, without
+ * segment user-defined data) instead of to the flow callback. Other datagrams, and the datagrams
+ * not completed, are still delivered to the flow callback, which is optional once linked.
+ * With NTOH_SESSION_INPLACE_DEFRAG the datagram is not copied at all.
+ *
+ * @param session IPv4 session
+ * @param tcp TCP session, or 0 to unlink it
+ * @param function Callback of the new TCP streams
+ * @param udata User-defined data of the new TCP streams
+ * @param enable_check_timeout Timeout checks of the new TCP streams
+ * @param enable_check_nowindow Window checks of the new TCP streams
+ * @return NTOH_OK on success or the corresponding error code
+ */
+int ntoh_ipv4_link_tcp ( pntoh_ipv4_session_t session , pntoh_tcp_session_t tcp , pntoh_tcp_callback_t function , void *udata , unsigned short enable_check_timeout , unsigned short enable_check_nowindow );
+
+/**
+ * @brief Links a TCP session to an IPv6 defragmentation session (see ntoh_ipv4_link_tcp)
+ */
+int ntoh_ipv6_link_tcp ( pntoh_ipv6_session_t session , pntoh_tcp_session_t tcp , pntoh_tcp_callback_t function , void *udata , unsigned short enable_check_timeout , unsigned short enable_check_nowindow );
+
+/* implemented by each module, used by the dispatcher */
+_HIDDEN int tcp_decode_header ( pntoh_packet_t pkt );
+_HIDDEN int tcp_process_packet ( pntoh_tcp_session_t session , pntoh_packet_t pkt , pntoh_tcp_callback_t function , void *udata , void *segment_udata , unsigned short enable_check_timeout , unsigned short enable_check_nowindow );
+_HIDDEN void tcp_process_burst ( pntoh_tcp_session_t session , pntoh_packet_t *pkts , void **segment_udata , int *ret , unsigned int count , pntoh_tcp_callback_t function , void *udata , unsigned short enable_check_timeout , unsigned short enable_check_nowindow );
+_HIDDEN pntoh_ipv4_flow_t ipv4_get_flow ( pntoh_ipv4_session_t session , pntoh_ipv4_tuple4_t tuple4 , pipv4_dfcallback_t function , pipv4_dfvcallback_t vfunction , void *udata , unsigned int *error );
+_HIDDEN pntoh_ipv6_flow_t ipv6_get_flow ( pntoh_ipv6_session_t session , pntoh_ipv6_tuple4_t tuple4 , pipv6_dfcallback_t function , pipv6_dfvcallback_t vfunction , void *udata , unsigned int *error );
+_HIDDEN int ipv6_atomic_datagram ( pntoh_ipv6_session_t session , pntoh_packet_t pkt , pipv6_dfcallback_t function , pipv6_dfvcallback_t vfunction , void *udata , void *segment_udata );
+
+/* implemented by the dispatcher, used by the defragmentation modules */
+_HIDDEN int tcp_link_datagram ( pntoh_tcp_link_t link , void *datagram , size_t len );
+
+#endif /* __LIBNTOH_DISPATCHER_H__ */
@@ -32,6 +32,7 @@
  ********************************************************************************/
 
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/ip6.h>
 
@@ -70,7 +71,7 @@ typedef struct _ipv6_fragment_
 } ntoh_ipv6_fragment_t , *pntoh_ipv6_fragment_t;
 
 /** @brief Struct to store the information of each IPv6 flow */
-typedef struct
+typedef struct _ipv6_flow_
 {
 	/// flow identification data
 	ntoh_ipv6_tuple4_t 	ident;
@@ -86,10 +87,25 @@ typedef struct
 	struct ip6_hdr		*final_iphdr;
 	/// user defined function to receive defragmented packets
 	void 			*function;
+	/// user defined function to receive them as an iovec, used instead of 'function' (ntoh_ipv6_new_flow_iov)
+	void			*vfunction;
 	/// last activity
 	struct timeval 		last_activ;
 	/// user-defined data
 	void 			*udata;
+	/// datagram buffer, fragments copied at their offsets (NTOH_SESSION_INPLACE_DEFRAG)
+	unsigned char		*buffer;
+	/// received 8 bytes blocks of the buffer (one bit each)
+	unsigned char		*coverage;
+	/// data bytes allocated in the buffer
+	size_t			size;
+	/// bytes charged to the fragments memory budget
+	size_t			mem;
+	/// creation order (oldest flow first), evicted when the budget is exhausted
+	struct _ipv6_flow_	*next;
+	struct _ipv6_flow_	*prev;
+	/// expiration timer (see the session timer wheel)
+	twentry_t		timer;
 	ntoh_lock_t 		lock;
 } ntoh_ipv6_flow_t, *pntoh_ipv6_flow_t;
 
@@ -103,11 +119,23 @@ typedef struct _ipv6_session_
 
 	/// max. number of IP flows
 	sem_t 			max_flows;
-	sem_t 			max_fragments;
+	/// fragments memory budget and counters
+	ntoh_defrag_stats_t	stats;
+	/// flows in creation order (see ntoh_ipv6_flow_t)
+	struct _ipv6_flow_	*flows_head;
+	struct _ipv6_flow_	*flows_tail;
+	/// flows queued by expiration time, only the stale ones are visited by the timeouts check
+	twheel_t		timers;
+	/// TCP session fed with the defragmented TCP datagrams (see ntoh_ipv6_link_tcp)
+	struct _ntoh_tcp_link_	*link;
 	/// hash table to store IP flows
 	pipv6_flows_table_t 	flows;
-	/// connection tables related
-	pthread_t 		tID;
+	/// session creation flags
+	unsigned int 		flags;
+	/// caller supplied time (NTOH_SESSION_CALLER_CLOCK)
+	struct timeval		clock;
+	/// timeouts check in the timer service (unless NTOH_SESSION_CALLER_CLOCK)
+	ntoh_timer_t		timer;
 	ntoh_lock_t 		lock;
 }ntoh_ipv6_session_t , *pntoh_ipv6_session_t;
 
@@ -128,6 +156,11 @@ typedef struct
 # define MAX_IPV6_DATAGRAM_LENGTH	4294967295UL   // max size of jumbograms (using hop-by-hop options header)
 #endif
 
+/// delay to check the flows timeout (ms)
+#ifndef DEFAULT_IPV6_TIMEOUT_DELAY
+# define DEFAULT_IPV6_TIMEOUT_DELAY	1000
+#endif
+
 /// IPv6 fragment timeout
 #ifndef DEFAULT_IPV6_FRAGMENT_TIMEOUT
 # define DEFAULT_IPV6_FRAGMENT_TIMEOUT	15
@@ -138,13 +171,38 @@ typedef struct
 # define DEFAULT_IPV6_MAX_FLOWS		1024
 #endif
 
-/// max. IPv6 allowed fragments
-#ifndef DEFAULT_IPV6_MAX_FRAGMENTS
-# define DEFAULT_IPV6_MAX_FRAGMENTS	((12*1024*1024) / sizeof(ntoh_ipv6_fragment_t))
+/// IPv6 fragments memory budget (bytes) when max_mem is not given
+#ifndef DEFAULT_IPV6_MAX_MEM
+# define DEFAULT_IPV6_MAX_MEM		(12*1024*1024)
+#endif
+
+/// slices delivered to a pipv6_dfvcallback_t without allocating the vector
+#ifndef DEFAULT_IPV6_IOVEC
+# define DEFAULT_IPV6_IOVEC		64
+#endif
+
+/// oldest flows considered when one has to be evicted (NTOH_SESSION_EVICT_*)
+#ifndef DEFAULT_IPV6_EVICT_SCAN
+# define DEFAULT_IPV6_EVICT_SCAN	32
+#endif
+
+/// max. flows expired at once before releasing the session lock
+#ifndef DEFAULT_IPV6_EXPIRE_BATCH
+# define DEFAULT_IPV6_EXPIRE_BATCH	256
 #endif
 
 typedef void(*pipv6_dfcallback_t) ( pntoh_ipv6_flow_t , pntoh_ipv6_tuple4_t , unsigned char* , size_t , unsigned short );
 
+/**
+ * @brief callback receiving a defragmented datagram without linearizing it
+ *
+ * Arguments: flow, tuple, final IP header fixed to describe the whole datagram (0 if the final fragment was
+ * not received), the data as ordered slices of the fragments, the amount of slices, the total length of the
+ * slices and the reason. The slices are owned by the library and only valid until the callback returns.
+ * Only the slices of a complete datagram (NTOH_REASON_DEFRAGMENTED_DATAGRAM) are known to be contiguous.
+ */
+typedef void(*pipv6_dfvcallback_t) ( pntoh_ipv6_flow_t , pntoh_ipv6_tuple4_t , struct ip6_hdr* , const struct iovec* , int , size_t , unsigned short );
+
 /**
  * @brief Initializes the IPv6 defragmentation
  */
@@ -171,8 +229,24 @@ void ntoh_ipv6_free_session ( pntoh_ipv6_session_t session );
 pntoh_ipv6_session_t ntoh_ipv6_new_session ( unsigned int max_flows , unsigned long max_mem , unsigned int *error );
 
 /**
- * @brief resizes the hash table of a given IPv4 session
- * @param IPv4 Session
+ * @brief Creates a new session to defragment IPv6 with the given creation flags
+ * @param max_flows Max number of allowed flows in this session
+ * @param max_mem Max. amount of memory used by the session
+ * @param flags Session creation flags (NTOH_SESSION_*). Once max_mem bytes of fragments are stored, new
+ * fragments are rejected (NTOH_FRAGMENTS_BUDGET_EXCEEDED) unless an NTOH_SESSION_EVICT_* policy is given: then
+ * the oldest flow not in use among the DEFAULT_IPV6_EVICT_SCAN first ones is released (NTOH_REASON_EVICTED)
+ * @param error Returned error code
+ * @return A pointer to the new session or 0 when it fails
+ */
+pntoh_ipv6_session_t ntoh_ipv6_new_session_ex ( unsigned int max_flows , unsigned long max_mem , unsigned int flags , unsigned int *error );
+
+/**
+ * @brief resizes the hash table of a given IPv6 session
+ *
+ * The flows are migrated to the new table a few buckets at a time
+ * on each lookup/insertion, so the session is never blocked.
+ *
+ * @param IPv6 Session
  * @param size The new size of the hash table
  * @return NTOH_OK on success or the corresponding error code
  *
@@ -196,6 +270,16 @@ pntoh_ipv6_flow_t ntoh_ipv6_find_flow ( pntoh_ipv6_session_t session , pntoh_ipv
  */
 pntoh_ipv6_flow_t ntoh_ipv6_new_flow ( pntoh_ipv6_session_t session , pntoh_ipv6_tuple4_t tuple4 , pipv6_dfcallback_t function , void *udata , unsigned int *error);
 
+/**
+ * @brief Adds a new IPv6 flow whose datagrams are delivered as an iovec (see pipv6_dfvcallback_t)
+ * @param tuple4 Flow information
+ * @param function User defined function to receive defragmented datagrams
+ * @param udata User defined data associated with this flow
+ * @param error Returned error code
+ * @return A pointer to the new created flow
+ */
+pntoh_ipv6_flow_t ntoh_ipv6_new_flow_iov ( pntoh_ipv6_session_t session , pntoh_ipv6_tuple4_t tuple4 , pipv6_dfvcallback_t function , void *udata , unsigned int *error );
+
 /**
  * @brief Frees an IPv6 flow
  * @param flow IPv6 flow to be freed
@@ -205,12 +289,62 @@ void ntoh_ipv6_free_flow ( pntoh_ipv6_session_t session , pntoh_ipv6_flow_t *flo
 
 /**
  * @brief Adds a new IPv6 fragment to a given flow
+ *
+ * An atomic fragment (offset 0, no more fragments) is delivered on its own, like the
+ * dispatcher does, and the flow is released if it holds no other fragments.
+ *
  * @param flow Flow where the new fragment will be added
  * @param iphdr IPv6 Header of the fragment
  * @return NTOH_OK on success, or error code when it fails
  */
 int ntoh_ipv6_add_fragment ( pntoh_ipv6_session_t session , pntoh_ipv6_flow_t flow , struct ip6_hdr *iphdr );
 
+/**
+ * @brief Sets the current time of a session created with NTOH_SESSION_CALLER_CLOCK
+ *
+ * Used for the flows last activity and timeouts instead of the system time. There is
+ * no timeouts thread in this mode: timed out flows are released from this call each
+ * time the clock moves to a new second.
+ *
+ * @param session IPv6 Session
+ * @param tv Current time
+ * @return NTOH_OK on success or the corresponding error code
+ */
+int ntoh_ipv6_set_time ( pntoh_ipv6_session_t session , const struct timeval *tv );
+
+/**
+ * @brief Expires the timed out flows of a session, from the calling thread
+ *
+ * Meant for sessions created with NTOH_SESSION_MANUAL_TIMERS (or NTOH_SESSION_CALLER_CLOCK) driven by
+ * an event loop: the work is bounded by 'max', and the call is repeated while it returns 'max'.
+ *
+ * @param session IPv6 Session
+ * @param now Current time, only used by NTOH_SESSION_CALLER_CLOCK sessions (0 to keep their clock)
+ * @param max Max. timers handled by this call, 0 for all the due ones
+ * @return Number of timers handled (expired flows and flows checked again later)
+ */
+unsigned int ntoh_ipv6_tick ( pntoh_ipv6_session_t session , const struct timeval *now , unsigned int max );
+
+/**
+ * @brief Gets the time before which ntoh_ipv6_tick has nothing to expire
+ *
+ * The flows deadlines are only updated when their timer fires, so the timer may be
+ * checked and queued again then.
+ *
+ * @param session IPv6 Session
+ * @param deadline Returned time (whole seconds, session clock), 0 if there are no flows
+ * @return NTOH_OK on success or the corresponding error code
+ */
+int ntoh_ipv6_next_deadline ( pntoh_ipv6_session_t session , struct timeval *deadline );
+
+/**
+ * @brief Gets the fragments memory budget counters of a session
+ * @param session IPv6 Session
+ * @param stats Returned counters
+ * @return NTOH_OK on success or the corresponding error code
+ */
+int ntoh_ipv6_get_stats ( pntoh_ipv6_session_t session , pntoh_defrag_stats_t stats );
+
 /**
  * @brief Returns the total count of flows stored in the global hash table
  * @return Total count of stored flows
@@ -39,6 +39,9 @@ extern "C"
 #include <pthread.h>
 #include <semaphore.h>
 
+/** @brief layout version of the public structures, increased on each incompatible change **/
+#define NTOH_ABI_VERSION	14
+
 /** @brief Common return values */
 #define NTOH_OK	0
 
@@ -72,6 +75,16 @@ extern "C"
 #define NTOH_SYNCHRONIZING			-25
 #define NTOH_NOT_INITIALIZED			-26
 
+/* Packet dispatcher return values */
+#define NTOH_PACKET_IGNORED			-27
+#define NTOH_RING_FULL				-28
+
+/* TCP streams reassembly return values (cont.) */
+#define NTOH_SEGMENT_DUPLICATED			-29
+
+/* IP defragmentation return values (cont.) */
+#define NTOH_FRAGMENTS_BUDGET_EXCEEDED		-30
+
 /* TCP streams reassembly notification cases values */
 #define NTOH_REASON_HSFAILED			1
 #define NTOH_REASON_ESTABLISHED			2
@@ -90,6 +103,9 @@ extern "C"
 #define NTOH_REASON_DEFRAGMENTED_DATAGRAM	13
 #define NTOH_REASON_TIMEDOUT_FRAGMENTS		14
 
+/* TCP streams reassembly / IP defragmentation notification cases values (cont.) */
+#define NTOH_REASON_EVICTED			15
+
 /* API errors */
 #define NTOH_ERROR_NOMEM			1
 #define NTOH_ERROR_NOSPACE			2
@@ -99,11 +115,39 @@ extern "C"
 #define NTOH_ERROR_PARAMS			6
 #define NTOH_ERROR_INIT				7
 
+/* Session creation flags */
+#define NTOH_SESSION_DEFAULT			0
+#define NTOH_SESSION_OPENADDR_TABLE		(1 << 0)	// open addressing streams/flows table (SIMD probing)
+#define NTOH_SESSION_CALLER_CLOCK		(1 << 1)	// time given by the caller (ntoh_*_set_time) instead of gettimeofday
+#define NTOH_SESSION_TOEPLITZ_HASH		(1 << 2)	// sharded sessions: streams spread by NTOH_HASH_TOEPLITZ_SYMMETRIC (as the NIC receive queues)
+#define NTOH_SESSION_STREAM_BUFFERS		(1 << 3)	// TCP payload kept by the library and delivered in segment->data
+
+/* what a session does when it is full (one of them): TCP sessions with a new stream once max_streams is reached,
+ * IP sessions with a new fragment once max_mem is reached (any EVICT_* policy evicts the oldest flow) */
+#define NTOH_SESSION_ADMIT_REJECT		(0 << 4)	// the new stream/fragment is rejected (NTOH_ERROR_NOSPACE / NTOH_FRAGMENTS_BUDGET_EXCEEDED)
+#define NTOH_SESSION_EVICT_LRU			(1 << 4)	// the least recently used stream is evicted (NTOH_REASON_EVICTED)
+#define NTOH_SESSION_EVICT_HALFOPEN		(2 << 4)	// half-open streams are evicted first, then the least recently used one
+#define NTOH_SESSION_EVICT_BUFFERED		(3 << 4)	// the stream holding more queued/buffered bytes is evicted
+#define NTOH_SESSION_ADMISSION_MASK		(3 << 4)
+
+#define NTOH_SESSION_HALFOPEN_TABLE		(1 << 6)	// TCP handshakes kept in a compact table, streams created once established
+#define NTOH_SESSION_INPLACE_DEFRAG		(1 << 7)	// IP fragments copied into a single datagram buffer per flow
+#define NTOH_SESSION_MANUAL_TIMERS		(1 << 8)	// timeouts only checked by ntoh_*_tick (and ntoh_*_set_time), not by the timer service
+
+/* how the session, its streams and flows are locked (one of them) */
+#define NTOH_SESSION_LOCK_CONDVAR		(0 << 9)	// mutex + condition variable, a lock may be released by another thread
+#define NTOH_SESSION_LOCK_MUTEX			(1 << 9)	// plain mutex
+#define NTOH_SESSION_LOCK_SPIN			(2 << 9)	// spinlock, for short critical sections and dedicated cores
+#define NTOH_SESSION_LOCK_NONE			(3 << 9)	// single threaded: no locking at all and streams without lock (implies NTOH_SESSION_MANUAL_TIMERS)
+#define NTOH_SESSION_LOCK_MASK			(3 << 9)
+
 typedef struct
 {
 	pthread_mutex_t	mutex;
 	pthread_cond_t	pcond;
 	int		use;
+	/// locking backend (see NTOH_SESSION_LOCK_*)
+	int		mode;
 } ntoh_lock_t , *pntoh_lock_t;
 
 /** @brief Header files */
@@ -111,6 +155,8 @@ typedef struct
 #include "ipv4defrag.h"
 #include "ipv6defrag.h"
 #include "tcpreassembly.h"
+#include "dispatcher.h"
+#include "shard.h"
 
 /**
  * @brief Returns library version
@@ -118,6 +164,12 @@ typedef struct
  */
 const char* ntoh_version ( void );
 
+/**
+ * @brief Returns the ABI version of the library, to be compared with NTOH_ABI_VERSION
+ * @return The ABI version the library was built with
+ */
+unsigned int ntoh_abi_version ( void );
+
 /**
  * @brief Returns the description string of ntoh_add_tcpsegment and ntoh_add_ipv4fragment
  * @param val Value returned by those functions
@@ -149,6 +201,38 @@ void ntoh_init ( void );
  */
 void ntoh_exit ( void );
 
+/**
+ * @brief Sets the number of threads checking the timeouts of the sessions (DEFAULT_TIMER_THREADS)
+ *
+ * All the sessions not created with NTOH_SESSION_CALLER_CLOCK or NTOH_SESSION_MANUAL_TIMERS share these threads. With 0 threads
+ * nothing runs in the background and the timeouts are only checked by ntoh_run_timers.
+ *
+ * @param threads Number of threads, up to MAX_TIMER_THREADS
+ * @return NTOH_OK on success, NTOH_ERROR_PARAMS if there are too many threads
+ */
+int ntoh_set_timer_threads ( unsigned int threads );
+
+/**
+ * @brief Checks the timeouts of the sessions whose check period has elapsed, from the calling thread
+ */
+void ntoh_run_timers ( void );
+
+/**
+ * @brief Starts a read section of the calling thread (sections can be nested)
+ *
+ * The streams returned by ntoh_tcp_find_stream within a read section are not reused until
+ * the section ends, even if they are released by another thread in the meantime. Read sections
+ * should be short: the released streams are kept in memory while any of them is running.
+ *
+ * @return NTOH_OK on success, NTOH_ERROR_NOMEM if the thread could not be registered
+ */
+int ntoh_epoch_enter ( void );
+
+/**
+ * @brief Ends a read section started by ntoh_epoch_enter
+ */
+void ntoh_epoch_exit ( void );
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,229 @@
+#ifndef __LIBNTOH_SHARD_H__
+# define __LIBNTOH_SHARD_H__
+
+/********************************************************************************
+ * Copyright (c) 2012, Chema Garcia                                             *
+ * All rights reserved.                                                         *
+ *                                                                              *
+ * Redistribution and use in source and binary forms, with or                   *
+ * without modification, are permitted provided that the following              *
+ * conditions are met:                                                          *
+ *                                                                              *
+ *    * Redistributions of source code must retain the above                    *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer.                                                             *
+ *                                                                              *
+ *    * Redistributions in binary form must reproduce the above                 *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer in the documentation and/or other materials provided         *
+ *      with the distribution.                                                  *
+ *                                                                              *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"  *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE    *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE   *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE    *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR          *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF         *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS     *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN      *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)      *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE   *
+ * POSSIBILITY OF SUCH DAMAGE.                                                  *
+ ********************************************************************************/
+
+#include <sys/time.h>
+
+/** @brief default slots of each shard ring (rounded up to a power of 2) **/
+#ifndef DEFAULT_SHARD_RING_SIZE
+# define DEFAULT_SHARD_RING_SIZE	1024
+#endif
+
+/** @brief max. IP datagram length copied to a shard ring slot **/
+#ifndef DEFAULT_SHARD_SNAPLEN
+# define DEFAULT_SHARD_SNAPLEN		2048
+#endif
+
+/** @brief empty polls before an idle worker starts sleeping **/
+#ifndef DEFAULT_SHARD_SPIN
+# define DEFAULT_SHARD_SPIN		1024
+#endif
+
+/** @brief usecs an idle worker sleeps between polls **/
+#ifndef DEFAULT_SHARD_SLEEP
+# define DEFAULT_SHARD_SLEEP		50
+#endif
+
+/** @brief max. shards per session **/
+#define NTOH_MAX_SHARDS			256
+
+#define NTOH_CACHELINE_SIZE		64
+
+/** @brief a decoded TCP segment waiting in a shard ring **/
+typedef struct
+{
+	/// decoded headers (pointing to data)
+	ntoh_packet_t	pkt;
+	/// user-defined data of the segment
+	void		*udata;
+	/// capture time (NTOH_SESSION_CALLER_CLOCK)
+	struct timeval	ts;
+	/// copy of the IP datagram
+	unsigned char	data[DEFAULT_SHARD_SNAPLEN];
+} ntoh_shard_slot_t, *pntoh_shard_slot_t;
+
+/**
+ * @brief single producer/single consumer ring
+ *
+ * head is only written by the capture thread and tail by the shard worker,
+ * each one on its own cache line. tail is advanced once the segments have been processed.
+ */
+typedef struct
+{
+	unsigned char		pad0[NTOH_CACHELINE_SIZE];
+	/// next slot to be written
+	unsigned int		head;
+	unsigned char		pad1[NTOH_CACHELINE_SIZE - sizeof ( unsigned int )];
+	/// next slot to be read
+	unsigned int		tail;
+	unsigned char		pad2[NTOH_CACHELINE_SIZE - sizeof ( unsigned int )];
+	/// size - 1
+	unsigned int		mask;
+	pntoh_shard_slot_t	slots;
+} ntoh_shard_ring_t, *pntoh_shard_ring_t;
+
+/** @brief shard counters **/
+typedef struct
+{
+	/// segments queued by the capture thread
+	unsigned long	queued;
+	/// segments dropped because the ring was full
+	unsigned long	dropped;
+	/// segments processed by the worker
+	unsigned long	processed;
+	/// processed segments rejected (neither NTOH_OK nor NTOH_SYNCHRONIZING)
+	unsigned long	errors;
+	/// streams stored in the shard
+	unsigned int	streams;
+} ntoh_shard_stats_t, *pntoh_shard_stats_t;
+
+struct _tcp_sharded_session_;
+
+/** @brief a shard: one TCP session owned by one worker thread **/
+typedef struct
+{
+	ntoh_shard_ring_t		ring;
+	/// TCP session, only used from the worker thread
+	pntoh_tcp_session_t		session;
+	struct _tcp_sharded_session_	*owner;
+	pthread_t			tID;
+	/// last time given by ntoh_tcp_sharded_set_time (usecs)
+	unsigned long long		clock;
+	/// the worker has to exit once the ring is empty
+	int				stop;
+	/// counters (see ntoh_shard_stats_t)
+	unsigned long			queued;
+	unsigned long			dropped;
+	unsigned long			processed;
+	unsigned long			errors;
+} ntoh_tcp_shard_t, *pntoh_tcp_shard_t;
+
+/** @brief TCP session split in shards, the streams are distributed by a symmetric hash of their tuple **/
+typedef struct _tcp_sharded_session_
+{
+	struct _tcp_sharded_session_	*next;
+	/// NTOH_SESSION_* flags
+	unsigned int			flags;
+	/// link layer, callback, checks and user-defined data of the new streams
+	ntoh_dispatcher_t		config;
+	/// number of shards
+	unsigned int			count;
+	pntoh_tcp_shard_t		shards;
+} ntoh_tcp_sharded_session_t, *pntoh_tcp_sharded_session_t;
+
+/**
+ * @brief Creates a TCP session split in shards, each one processed by its own worker thread
+ *
+ * Each shard is a TCP session with max_streams/shards streams, driven by its worker
+ * (NTOH_SESSION_CALLER_CLOCK is set on them). Both directions of a connection always go to the same shard,
+ * so the callbacks of a stream are always called from the same worker thread. With NTOH_SESSION_TOEPLITZ_HASH
+ * the shard is chosen as a NIC with the symmetric RSS key and the default indirection table would choose the receive queue.
+ *
+ * @param shards Number of shards (and worker threads)
+ * @param max_streams Max. number of streams of the whole session (0 = DEFAULT_TCP_MAX_STREAMS)
+ * @param max_timewait Max. number of streams in TIME-WAIT of the whole session (0 = default)
+ * @param ring_size Slots of each shard ring (0 = DEFAULT_SHARD_RING_SIZE)
+ * @param flags NTOH_SESSION_* flags. With NTOH_SESSION_CALLER_CLOCK the time is taken from the packets
+ * @param config Link layer, callback, checks and user-defined data of the new streams (the sessions are ignored)
+ * @param error Returned error code
+ * @return A pointer to the new session or 0 if it fails
+ */
+pntoh_tcp_sharded_session_t ntoh_tcp_new_sharded_session ( unsigned int shards , unsigned int max_streams , unsigned int max_timewait , unsigned int ring_size , unsigned int flags , pntoh_dispatcher_t config , unsigned int *error );
+
+/**
+ * @brief Stops the workers once their rings are empty and frees the session
+ * @param session Session to be freed
+ */
+void ntoh_tcp_free_sharded_session ( pntoh_tcp_sharded_session_t session );
+
+/**
+ * @brief Decodes a frame and queues it to the shard owning its stream
+ *
+ * Must be always called from the same thread. The IP datagram is copied, but udata
+ * must remain valid until the segment is given to the callback (NTOH_SESSION_STREAM_BUFFERS
+ * gives the payload to the callback without any udata).
+ *
+ * @param session Sharded session
+ * @param frame Captured frame
+ * @param len Captured length
+ * @param ts Capture time, mandatory with NTOH_SESSION_CALLER_CLOCK
+ * @param udata User-defined data of this segment
+ * @return NTOH_OK, NTOH_RING_FULL if the segment has been dropped, NTOH_PACKET_IGNORED if it is not a
+ * TCP segment, NTOH_INCORRECT_LENGTH if it is longer than DEFAULT_SHARD_SNAPLEN, or the decoding error
+ */
+int ntoh_tcp_sharded_add_packet ( pntoh_tcp_sharded_session_t session , void *frame , size_t len , const struct timeval *ts , void *udata );
+
+/**
+ * @brief Sets the time of the idle shards (NTOH_SESSION_CALLER_CLOCK)
+ * @param session Sharded session
+ * @param tv Current time
+ * @return NTOH_OK or NTOH_ERROR_PARAMS
+ */
+int ntoh_tcp_sharded_set_time ( pntoh_tcp_sharded_session_t session , const struct timeval *tv );
+
+/**
+ * @brief Waits until all the queued segments have been processed
+ * @param session Sharded session
+ */
+void ntoh_tcp_sharded_flush ( pntoh_tcp_sharded_session_t session );
+
+/**
+ * @brief Pins the worker of a shard to a CPU
+ * @param session Sharded session
+ * @param shard Shard index
+ * @param cpu CPU number
+ * @return NTOH_OK or NTOH_ERROR_PARAMS
+ */
+int ntoh_tcp_sharded_set_cpu ( pntoh_tcp_sharded_session_t session , unsigned int shard , unsigned int cpu );
+
+/**
+ * @brief Gets the counters of a shard
+ * @param session Sharded session
+ * @param shard Shard index
+ * @param stats Output counters
+ * @return NTOH_OK or NTOH_ERROR_PARAMS
+ */
+int ntoh_tcp_sharded_get_stats ( pntoh_tcp_sharded_session_t session , unsigned int shard , pntoh_shard_stats_t stats );
+
+/**
+ * @brief Gets the amount of streams stored in all the shards
+ * @param session Sharded session
+ * @return Number of streams
+ */
+unsigned int ntoh_tcp_sharded_count_streams ( pntoh_tcp_sharded_session_t session );
+
+/**
+ * @brief Frees all the sharded sessions (called by ntoh_exit, before the TCP sessions are released)
+ */
+void ntoh_shard_exit ( void );
+
+#endif /* __LIBNTOH_SHARD_H__ */
@@ -49,6 +49,14 @@
 # define IP4_ADDR_LEN	4
 #endif
 
+/** @brief 32 bits words of an IPv6 address **/
+#define IP6_ADDR_WORDS	( IP6_ADDR_LEN / sizeof ( unsigned int ) )
+
+/** @brief levels of the skiplist of queued segments (4^levels segments per peer keep O(log n) insertions) **/
+#ifndef DEFAULT_TCP_SEGMENT_LEVELS
+# define DEFAULT_TCP_SEGMENT_LEVELS	8
+#endif
+
 /** @brief connection status **/
 enum _ntoh_tcp_status_
 {
@@ -72,6 +80,14 @@ enum tcprs_resize_table
 	NTOH_RESIZE_TIMEWAIT
 };
 
+/** @brief object pools of a session **/
+enum tcprs_pool
+{
+	NTOH_POOL_STREAMS = 0,
+	NTOH_POOL_SEGMENTS,
+	NTOH_POOL_NODES
+};
+
 /** @brief who closed the connection? **/
 enum tcprs_who_closed
 {
@@ -105,10 +121,10 @@ typedef unsigned int ntoh_tcp_key_t;
 /** @brief data to generate the connection key **/
 typedef struct
 {
-	///source address
-	unsigned int 	source[IP6_ADDR_LEN];
+	///source address (IPv4 addresses use the first word, the rest is zeroed)
+	unsigned int 	source[IP6_ADDR_WORDS];
 	///destination address
-	unsigned int 	destination[IP6_ADDR_LEN];
+	unsigned int 	destination[IP6_ADDR_WORDS];
 	///source port
 	unsigned short 	sport;
 	///destination port
@@ -120,7 +136,12 @@ typedef struct
 /** @brief data sent to user-function **/
 typedef struct _tcp_segment_
 {
+	///next queued segment (skiplist level 0, ordered by seq)
 	struct _tcp_segment_ 	*next;
+	///next queued segment on the upper skiplist levels
+	struct _tcp_segment_ 	*skip[DEFAULT_TCP_SEGMENT_LEVELS - 1];
+	///skiplist levels of this segment
+	unsigned char		levels;
 	///SEQ number
 	unsigned long		seq;
 	///ACK number
@@ -135,79 +156,167 @@ typedef struct _tcp_segment_
 	struct timeval 		tv;
 	///user provided data
 	void 			*user_data;
+	///stream bytes delivered with this segment, in order and without duplicates (NTOH_SESSION_STREAM_BUFFERS).
+	///they are owned by the library and only valid during the callback
+	unsigned char		*data;
+	unsigned int		data_len;
 } ntoh_tcp_segment_t, *pntoh_tcp_segment_t;
 
-/** @brief peer information **/
+/** @brief payload of a peer kept by the library (NTOH_SESSION_STREAM_BUFFERS) **/
 typedef struct
 {
-	///IP address
-	unsigned int 		addr[IP6_ADDR_LEN];
-	///connection port
-	unsigned short 		port;
+	///stored bytes, data[start] is the byte at 'base'
+	unsigned char		*data;
+	///allocated bytes
+	size_t			size;
+	///offset of 'base' in data
+	size_t			start;
+	///relative SEQ. number of the first byte not delivered yet
+	unsigned long		base;
+	///relative SEQ. number following the last stored byte
+	unsigned long		end;
+} ntoh_tcp_buffer_t, *pntoh_tcp_buffer_t;
+
+/** @brief peer information (fields used on each segment first) **/
+typedef struct
+{
+	///NEXT SEQ. number
+	unsigned long 		next_seq;
 	///initial SEQ. number
 	unsigned long 		isn;
 	///initial ACK. number
 	unsigned long 		ian;
-	///NEXT SEQ. number
-	unsigned long 		next_seq;
+	///total window size
+	unsigned long 		totalwin;
+	///segments list (skiplist level 0, ordered by seq)
+	pntoh_tcp_segment_t	segments;
+	///first segment of the upper skiplist levels
+	pntoh_tcp_segment_t	skip[DEFAULT_TCP_SEGMENT_LEVELS - 1];
+	///payload bytes in the segments list
+	unsigned long		queued;
 	///TH_FIN | TH_RST sequence
 	unsigned long 		final_seq;
-	///TCP window size
-	unsigned int 		wsize;
 	///peer status
 	unsigned int 		status;
-	///segments list
-	pntoh_tcp_segment_t	segments;
-	///Max. Segment Size
-	unsigned int 		mss;
-	///Selective ACK.
-	unsigned int 		sack;
-	///window scale factor
-	unsigned int 		wscale;
-	///total window size
-	unsigned long 		totalwin;
 	///last ts
 	unsigned int 		lastts;
+	///TCP window size
+	unsigned int 		wsize;
+	///window scale factor
+	unsigned int 		wscale;
 	///send peer segments to user?
 	unsigned short 		receive;
+	///connection port
+	unsigned short 		port;
+	///Max. Segment Size
+	unsigned int 		mss;
+	///Selective ACK.
+	unsigned int 		sack;
+	///IP address
+	unsigned int 		addr[IP6_ADDR_WORDS];
+	///payload not delivered yet (NTOH_SESSION_STREAM_BUFFERS)
+	ntoh_tcp_buffer_t	buffer;
 } ntoh_tcp_peer_t, *pntoh_tcp_peer_t;
 
-/** @brief connection data **/
+/**
+ * @brief connection data
+ *
+ * Lookup and per segment fields come first (key, status, index link, tuple and both peers),
+ * the rest is only used on creation, expiration and release.
+ * Prefer the ntoh_tcp_stream_* accessors, the layout may change (see NTOH_ABI_VERSION).
+ */
 typedef struct _tcp_stream_
 {
-	struct _tcp_stream_	*next;
-
+	///connection key
+	ntoh_tcp_key_t 		key;
+	///connection status
+	unsigned int 		status;
+	///next stream in the same bucket of the lookup index of the session (see ntoh_tcp_find_stream)
+	struct _tcp_stream_	*hnext;
 	///data to generate the key to identify the connection
 	ntoh_tcp_tuple5_t 	tuple;
 	///client data
 	ntoh_tcp_peer_t 	client;
 	///server data
 	ntoh_tcp_peer_t 	server;
-	///connection key
-	ntoh_tcp_key_t 		key;
-	///connection status
-	unsigned int 		status;
-	///who closed the connection
-	unsigned short 		closedby;
-	///user-defined function to receive data
-	void 			*function;
 	///last activity
 	struct timeval 		last_activ;
-	///max. allowed SYN retries
-	unsigned int 		syn_retries;
-	///max. allowed SYN/ACK retries
-	unsigned int 		synack_retries;
+	///user-defined function to receive data
+	void 			*function;
 	///user-defined data linked to this stream
 	void 			*udata;
-	ntoh_lock_t		lock;
-
 	unsigned short 		enable_check_timeout;	// @contrib: di3online - https://github.com/di3online
 	unsigned short 		enable_check_nowindow;	// @contrib: di3online - https://github.com/di3online
+	///who closed the connection
+	unsigned short 		closedby;
+	///locked by a burst which still has segments for it, not to be evicted (see tcp_process_burst)
+	unsigned short		pinned;
+
+	///links of the LRU or TIME-WAIT queue of the session (the one of the table holding the stream)
+	struct _tcp_stream_	*next;
+	struct _tcp_stream_	*prev;
+	///expiration timer (see tcp_check_timeouts)
+	twentry_t		timer;
+	///max. allowed SYN retries
+	unsigned int 		syn_retries;
+	///max. allowed SYN/ACK retries
+	unsigned int 		synack_retries;
+	///stream lock, right after the stream in its pool object (0 with NTOH_SESSION_LOCK_NONE)
+	pntoh_lock_t		lock;
+	///epoch of the release, the stream is reused once no reader can reach it (see epoch_expired)
+	unsigned long		retired;
 } ntoh_tcp_stream_t, *pntoh_tcp_stream_t;
 
+/**
+ * @brief TCP handshake in progress (NTOH_SESSION_HALFOPEN_TABLE), 60 bytes
+ *
+ * Only what handle_new_connection needs is kept: the peers are rebuilt from it on each
+ * handshake segment, and a full stream is created once the connection is established.
+ */
+typedef struct
+{
+	///endpoints, as sent by the client (SYN)
+	unsigned int		source[IP6_ADDR_WORDS];
+	unsigned int		destination[IP6_ADDR_WORDS];
+	unsigned short		sport;
+	unsigned short		dport;
+	///initial SEQ. numbers of the client and the server
+	unsigned int		isn[2];
+	///expiration time (seconds), an expired entry is a free one
+	unsigned int		expire;
+	///TCP window and MSS of the client and the server
+	unsigned short		wsize[2];
+	unsigned short		mss[2];
+	///window scale factors (client in the low 4 bits)
+	unsigned char		wscale;
+	///NTOH_HALFOPEN_* flags
+	unsigned char		flags;
+	///connection status (NTOH_STATUS_CLOSED for free entries)
+	unsigned char		status;
+	///SYN/ACK retries
+	unsigned char		retries;
+} ntoh_tcp_halfopen_t, *pntoh_tcp_halfopen_t;
+
+/** @brief ntoh_tcp_halfopen_t flags **/
+#define NTOH_HALFOPEN_SACK(side)	( 1 << (side) )	// SACK permitted by the client (0) or the server (1)
+#define NTOH_HALFOPEN_IPV6		( 1 << 2 )
+
 typedef htable_t tcprs_streams_table_t;
 typedef phtable_t ptcprs_streams_table_t;
 
+/** @brief lock-free lookup index of the connections table, replaced as a whole when the session is resized **/
+typedef struct _tcp_index_
+{
+	///buckets - 1 (a power of two)
+	unsigned int		mask;
+	///epoch of the replacement, freed once no reader can reach it (see epoch_expired)
+	unsigned long		retired;
+	///next replaced index of the session
+	struct _tcp_index_	*next;
+	///streams of each bucket, linked by their 'hnext' field
+	pntoh_tcp_stream_t	buckets[];
+} ntoh_tcp_index_t, *pntoh_tcp_index_t;
+
 /** @brief TCP session data **/
 typedef struct _tcp_session_
 {
@@ -223,10 +332,48 @@ typedef struct _tcp_session_
     /* TIME-WAIT connections */
     ptcprs_streams_table_t 	timewait;
 
+    /* connections, least recently used first (kept in order with an NTOH_SESSION_EVICT_* policy) */
+    pntoh_tcp_stream_t		lru_head;
+    pntoh_tcp_stream_t		lru_tail;
+
+    /* TIME-WAIT connections in arrival order (evicted from the head) */
+    pntoh_tcp_stream_t		timewait_head;
+    pntoh_tcp_stream_t		timewait_tail;
+
+    /* lock-free lookup index of the connections table (0 with NTOH_SESSION_LOCK_NONE), updated with the session locked */
+    pntoh_tcp_index_t		index;
+    /* odd while the index is being replaced, the lookups missing a stream meanwhile take the session lock */
+    unsigned long		index_seq;
+    /* replaced indexes still reachable by the lock-free lookups */
+    pntoh_tcp_index_t		retired_index;
+
+    /* released streams still reachable by the lock-free lookups, oldest first (see ntoh_epoch_enter) */
+    pntoh_tcp_stream_t		retired_head;
+    pntoh_tcp_stream_t		retired_tail;
+
+    /* handshakes in progress (NTOH_SESSION_HALFOPEN_TABLE), sets of DEFAULT_TCP_HALFOPEN_WAYS entries */
+    pntoh_tcp_halfopen_t	halfopen;
+    unsigned int		halfopen_mask;
+
+    /* streams expiration */
+    twheel_t			timers;
+
+    /* caller supplied time (NTOH_SESSION_CALLER_CLOCK) */
+    struct timeval		clock;
+
+    /* streams, segments and hash table nodes allocation */
+    ntoh_pool_t			stream_pool;
+    ntoh_pool_t			segment_pool;
+    ntoh_pool_t			node_pool;
+
     int 			rand;
 
+    /* session creation flags */
+    unsigned int		flags;
+
     ntoh_lock_t			lock;
-    pthread_t 			tID;
+    /// timeouts check in the timer service (unless NTOH_SESSION_CALLER_CLOCK)
+    ntoh_timer_t		timer;
 } ntoh_tcp_session_t , *pntoh_tcp_session_t;
 
 /** @brief structure to store the TCP sessions and the initialization status **/
@@ -287,6 +434,59 @@ typedef void(*pntoh_tcp_callback_t) ( pntoh_tcp_stream_t , pntoh_tcp_peer_t , pn
 # define DEFAULT_TCP_MAX_TIMEWAIT_STREAMS(max)   (max>0?max/3:DEFAULT_TCP_MAX_STREAMS/3)
 #endif
 
+/** @brief Streams (and hash table nodes) preallocated for a session with 'max' streams **/
+#ifndef DEFAULT_TCP_POOL_PREALLOC
+# define DEFAULT_TCP_POOL_PREALLOC(max)	( (max) < 4096 ? (max) : 4096 )
+#endif
+
+/** @brief Segments preallocated per preallocated stream **/
+#ifndef DEFAULT_TCP_POOL_SEGMENTS
+# define DEFAULT_TCP_POOL_SEGMENTS	4
+#endif
+
+/** @brief Max. streams expired at once before releasing the session lock **/
+#ifndef DEFAULT_TCP_EXPIRE_BATCH
+# define DEFAULT_TCP_EXPIRE_BATCH	256
+#endif
+
+/** @brief Least recently used streams considered when one has to be evicted (NTOH_SESSION_EVICT_*) **/
+#ifndef DEFAULT_TCP_EVICT_SCAN
+# define DEFAULT_TCP_EVICT_SCAN		32
+#endif
+
+/** @brief entries of the half-open table of a session with 'max' streams (rounded up to a power of two) **/
+#ifndef DEFAULT_TCP_HALFOPEN_ENTRIES
+# define DEFAULT_TCP_HALFOPEN_ENTRIES(max)	( (max) < 1024 ? 1024 : (max) )
+#endif
+
+/** @brief entries looked up for each half-open connection, the oldest one is replaced when all of them are in use **/
+#ifndef DEFAULT_TCP_HALFOPEN_WAYS
+# define DEFAULT_TCP_HALFOPEN_WAYS	4
+#endif
+
+/** @brief initial and max. size of each peer buffer (NTOH_SESSION_STREAM_BUFFERS) **/
+#ifndef DEFAULT_TCP_BUFFER_SIZE
+# define DEFAULT_TCP_BUFFER_SIZE	4096
+#endif
+
+#ifndef DEFAULT_TCP_BUFFER_MAX
+# define DEFAULT_TCP_BUFFER_MAX		( 4 * 1024 * 1024 )
+#endif
+
+/** @brief flow hash functions (ntoh_tcp_hash_tuple) **/
+#define NTOH_HASH_SYMMETRIC		0	// SuperFastHash of the endpoints sorted, same value for both directions
+#define NTOH_HASH_TOEPLITZ		1	// Toeplitz with the default RSS key, as computed by the NICs (direction dependent)
+#define NTOH_HASH_TOEPLITZ_SYMMETRIC	2	// Toeplitz with the 0x6d5a repeated RSS key, same value for both directions
+
+/** @brief RSS key length and default indirection table size of the NICs **/
+#define NTOH_RSS_KEY_LEN		40
+#define NTOH_RSS_RETA_SIZE		128
+
+/** @brief Max. segments looked up at once (single session lock acquisition) by ntoh_process_packets **/
+#ifndef DEFAULT_TCP_BURST
+# define DEFAULT_TCP_BURST	64
+#endif
+
 /** @brief Delay to check session's streams timeout (ms) **/
 #ifndef DEFAULT_TIMEOUT_DELAY
 # define DEFAULT_TIMEOUT_DELAY	3000
@@ -311,6 +511,21 @@ void ntoh_tcp_exit ( void );
  */
 pntoh_tcp_session_t ntoh_tcp_new_session ( unsigned int max_streams , unsigned int max_timewait , unsigned int *error );
 
+/**
+ * @brief Creates a new session to reassemble TCP segments with the given creation flags
+ * @param max_streams Max number of allowed streams in this session
+ * @param max_timewait Max idle time fo TIME-WAIT connections (global)
+ * @param flags Session creation flags (NTOH_SESSION_*). Once max_streams is reached, new streams are rejected
+ * unless an NTOH_SESSION_EVICT_* policy is given: then a stream not in use among the DEFAULT_TCP_EVICT_SCAN
+ * least recently looked up ones is released (callback with NTOH_REASON_EVICTED) to make room for the new one
+ * With NTOH_SESSION_HALFOPEN_TABLE the handshakes seen by ntoh_process_packet(s) are kept in a fixed size table
+ * (see ntoh_tcp_halfopen_t), so they take no stream until they are established: there are no callbacks
+ * before NTOH_REASON_ESTABLISHED and the handshakes that never complete are silently dropped
+ * @param error Returned error code
+ * @return A pointer to the new session or 0 when it fails
+ */
+pntoh_tcp_session_t ntoh_tcp_new_session_ex ( unsigned int max_streams , unsigned int max_timewait , unsigned int flags , unsigned int *error );
+
 /**
  * @brief Releases all resources used by a session
  * @param session Session to be released
@@ -328,6 +543,11 @@ void ntoh_tcp_free_stream ( pntoh_tcp_session_t session , pntoh_tcp_stream_t *st
 
 /**
  * @brief Finds a TCP stream
+ *
+ * The lookup does not take the session lock (unless the session was created with NTOH_SESSION_LOCK_NONE),
+ * so it does not refresh the eviction order of the stream. The stream may be released by another thread
+ * at any time: call it within ntoh_epoch_enter / ntoh_epoch_exit to keep using it safely.
+ *
  * @param session TCP Session
  * @param tuple5 Stream information
  * @return Pointer to the stream on success or 0 when fails
@@ -347,6 +567,87 @@ pntoh_tcp_stream_t ntoh_tcp_find_stream ( pntoh_tcp_session_t session , pntoh_tc
  */
 pntoh_tcp_stream_t ntoh_tcp_new_stream ( pntoh_tcp_session_t session , pntoh_tcp_tuple5_t tuple5 , pntoh_tcp_callback_t function , void *udata , unsigned int *error, unsigned short enable_check_timeout, unsigned short enable_check_nowindow );
 
+/**
+ * @brief Sets the current time of a session created with NTOH_SESSION_CALLER_CLOCK
+ *
+ * All the timestamps (last activity, segments) and timeouts of the session use this
+ * clock, usually the capture timestamp of the packet about to be added. There is no
+ * timeouts thread in this mode: timed out streams are released (and notified) from
+ * this call each time the clock moves to a new second.
+ *
+ * @param session TCP Session
+ * @param tv Current time
+ * @return NTOH_OK on success or the corresponding error code
+ */
+int ntoh_tcp_set_time ( pntoh_tcp_session_t session , const struct timeval *tv );
+
+/**
+ * @brief Expires the timed out streams of a session, from the calling thread
+ *
+ * Meant for sessions created with NTOH_SESSION_MANUAL_TIMERS (or NTOH_SESSION_CALLER_CLOCK) driven by
+ * an event loop: the work is bounded by 'max', and the call is repeated while it returns 'max'.
+ *
+ * @param session TCP Session
+ * @param now Current time, only used by NTOH_SESSION_CALLER_CLOCK sessions (0 to keep their clock)
+ * @param max Max. timers handled by this call, 0 for all the due ones
+ * @return Number of timers handled (expired streams and streams checked again later)
+ */
+unsigned int ntoh_tcp_tick ( pntoh_tcp_session_t session , const struct timeval *now , unsigned int max );
+
+/**
+ * @brief Gets the time before which ntoh_tcp_tick has nothing to expire
+ *
+ * The streams deadlines are only updated when their timer fires, so the timer may be
+ * checked and queued again then.
+ *
+ * @param session TCP Session
+ * @param deadline Returned time (whole seconds, session clock), 0 if there are no streams
+ * @return NTOH_OK on success or the corresponding error code
+ */
+int ntoh_tcp_next_deadline ( pntoh_tcp_session_t session , struct timeval *deadline );
+
+/**
+ * @brief Gets the tuple identifying a stream (client to server direction)
+ * @param stream TCP stream
+ * @return Pointer to the stream tuple or 0 when fails
+ */
+pntoh_tcp_tuple5_t ntoh_tcp_stream_tuple ( pntoh_tcp_stream_t stream );
+
+/**
+ * @brief Gets the connection status of a stream (NTOH_STATUS_*)
+ * @param stream TCP stream
+ * @return Stream status
+ */
+unsigned int ntoh_tcp_stream_status ( pntoh_tcp_stream_t stream );
+
+/**
+ * @brief Gets one of the peers of a stream
+ * @param stream TCP stream
+ * @param who NTOH_SENT_BY_CLIENT or NTOH_SENT_BY_SERVER
+ * @return Pointer to the peer or 0 when fails
+ */
+pntoh_tcp_peer_t ntoh_tcp_stream_peer ( pntoh_tcp_stream_t stream , unsigned short who );
+
+/**
+ * @brief Gets the user-defined data linked to a stream
+ * @param stream TCP stream
+ * @return User-defined data given to ntoh_tcp_new_stream
+ */
+void *ntoh_tcp_stream_udata ( pntoh_tcp_stream_t stream );
+
+/**
+ * @brief Gets the statistics of one of the object pools of a session
+ *
+ * Streams, segments and hash table nodes are taken from per-session pools
+ * (preallocated from max_streams) and reused once released.
+ *
+ * @param session TCP Session
+ * @param pool Pool to be queried (NTOH_POOL_STREAMS | NTOH_POOL_SEGMENTS | NTOH_POOL_NODES)
+ * @param stats Returned statistics
+ * @return NTOH_OK on success or the corresponding error code
+ */
+int ntoh_tcp_get_pool_stats ( pntoh_tcp_session_t session , unsigned short pool , pntoh_pool_stats_t stats );
+
 /**
  * @brief Returns the total count of TCP streams stored in the global hash table
  * @param session TCP Session
@@ -388,8 +689,28 @@ unsigned int ntoh_tcp_get_size ( pntoh_tcp_session_t session );
  */
 unsigned int ntoh_tcp_get_tuple5 ( void *ip , struct tcphdr *tcp , pntoh_tcp_tuple5_t tuple );
 
+/**
+ * @brief Hashes the tuple5 of a TCP stream
+ *
+ * The Toeplitz functions hash the addresses and ports as the NICs do for RSS: with the same key, a packet
+ * goes to the receive queue stored at the entry hash % NTOH_RSS_RETA_SIZE of the NIC indirection table.
+ * They use a well known key: do not use them to index tables fed by untrusted traffic.
+ *
+ * @param tuple Tuple5 (from ntoh_tcp_get_tuple5)
+ * @param function Hash function (NTOH_HASH_*)
+ * @param seed Seed of NTOH_HASH_SYMMETRIC (ignored by the Toeplitz functions)
+ * @return The hash value, or 0 on error
+ */
+unsigned int ntoh_tcp_hash_tuple ( pntoh_tcp_tuple5_t tuple , unsigned int function , unsigned int seed );
+
 /**
  * @brief Resizes the hash tables (streams | timewait) of a given TCP session
+ *
+ * The streams are not moved at once: both tables live side by side and a few
+ * buckets are migrated on each lookup/insertion until the old one is empty.
+ * The lock-free lookup index of the streams table is rebuilt at once, the
+ * ntoh_tcp_find_stream calls missing a stream meanwhile take the session lock.
+ *
  * @param session TCP Session
  * @param table   Table action (NTOH_RESIZE_STREAMS,NTOH_RESIZE_TIMEWAIT)
  * @param newsize The new size of the table
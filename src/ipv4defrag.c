@@ -40,6 +40,10 @@ static ntoh_ipv4_params_t params = { 0 , 0 };
 
 #define NTOH_GET_IPV4_FRAGMENT_OFFSET(offset)	(8*(ntohs(offset)&IP_OFFMASK))
 #define IS_SET(a,b)				(a & b)
+/// room left in front of the datagram buffer for the final IP header (NTOH_SESSION_INPLACE_DEFRAG)
+#define DEFRAG_HEADROOM				60
+/// bytes of the coverage bitmap of 'size' data bytes (one bit per 8 bytes block)
+#define COVERAGE_BYTES(size)			( ( (size) + 63 ) / 64 )
 
 inline static ntoh_ipv4_key_t ip_get_hashkey ( pntoh_ipv4_tuple4_t tuple4 )
 {
@@ -116,12 +120,63 @@ pntoh_ipv4_flow_t ntoh_ipv4_find_flow ( pntoh_ipv4_session_t session , pntoh_ipv
 	return ret;
 }
 
-pntoh_ipv4_flow_t ntoh_ipv4_new_flow ( pntoh_ipv4_session_t session , pntoh_ipv4_tuple4_t tuple4 , pipv4_dfcallback_t function , void *udata , unsigned int *error)
+/** @brief Creates a new flow and inserts it into the session, the session must be locked **/
+inline static pntoh_ipv4_flow_t create_flow ( pntoh_ipv4_session_t session , pntoh_ipv4_tuple4_t tuple4 , pipv4_dfcallback_t function , pipv4_dfvcallback_t vfunction , void *udata , unsigned int *error )
 {
 	pntoh_ipv4_flow_t ret = 0;
 
-    if ( error != 0 )
-        *error = 0;
+	if ( sem_trywait( &session->max_flows ) != 0 )
+	{
+		*error = NTOH_ERROR_NOSPACE;
+		return ret;
+	}
+
+	if ( !( ret = (pntoh_ipv4_flow_t) calloc( 1, sizeof(ntoh_ipv4_flow_t) ) ) )
+	{
+		sem_post ( &session->max_flows );
+		*error = NTOH_ERROR_NOMEM;
+		return ret;
+	}
+
+	memcpy( &( ret->ident ), tuple4, sizeof(ntoh_ipv4_tuple4_t) );
+	ret->key = ip_get_hashkey( tuple4 );
+
+	get_session_time ( session->flags , &session->clock , &ret->last_activ );
+	ret->function = (void*) function;
+	ret->vfunction = (void*) vfunction;
+	ret->udata = udata;
+
+	init_lockaccess ( &ret->lock , session->lock.mode );
+
+	if ( ! htable_insert ( session->flows , ret->key , ret ) )
+	{
+		free_lockaccess ( &ret->lock );
+		free ( ret );
+		sem_post ( &session->max_flows );
+		*error = NTOH_ERROR_NOMEM;
+		return 0;
+	}
+
+	twheel_add ( &session->timers , &ret->timer , ret->last_activ.tv_sec + DEFAULT_IPV4_FRAGMENT_TIMEOUT + 1 );
+
+	/* appended to the creation order list */
+	ret->prev = session->flows_tail;
+	if ( session->flows_tail != 0 )
+		session->flows_tail->next = ret;
+	else
+		session->flows_head = ret;
+	session->flows_tail = ret;
+
+	return ret;
+}
+
+pntoh_ipv4_flow_t ntoh_ipv4_new_flow ( pntoh_ipv4_session_t session , pntoh_ipv4_tuple4_t tuple4 , pipv4_dfcallback_t function , void *udata , unsigned int *error)
+{
+	pntoh_ipv4_flow_t	ret = 0;
+	unsigned int		err = 0;
+
+	if ( error != 0 )
+		*error = 0;
 
 	if ( !params.init )
 	{
@@ -137,31 +192,69 @@ pntoh_ipv4_flow_t ntoh_ipv4_new_flow ( pntoh_ipv4_session_t session , pntoh_ipv4
 		return ret;
 	}
 
-	if ( sem_trywait( &session->max_flows ) != 0 )
+	lock_access( &session->lock );
+
+	ret = create_flow ( session , tuple4 , function , 0 , udata , &err );
+
+	unlock_access( &session->lock );
+
+	if ( error != 0 )
+		*error = err;
+
+	return ret;
+}
+
+pntoh_ipv4_flow_t ntoh_ipv4_new_flow_iov ( pntoh_ipv4_session_t session , pntoh_ipv4_tuple4_t tuple4 , pipv4_dfvcallback_t function , void *udata , unsigned int *error)
+{
+	pntoh_ipv4_flow_t	ret = 0;
+	unsigned int		err = 0;
+
+	if ( error != 0 )
+		*error = 0;
+
+	if ( !params.init )
 	{
 		if ( error != 0 )
-			*error = NTOH_ERROR_NOSPACE;
-
+			*error = NTOH_ERROR_INIT;
 		return ret;
 	}
 
-	if ( !( ret = (pntoh_ipv4_flow_t) calloc( 1, sizeof(ntoh_ipv4_flow_t) ) ) )
+	if ( !session || !tuple4 || !function )
+	{
+		if ( error != 0 )
+			*error = NTOH_ERROR_PARAMS;
 		return ret;
+	}
 
-	memcpy( &( ret->ident ), tuple4, sizeof(ntoh_ipv4_tuple4_t) );
-	ret->key = ip_get_hashkey( tuple4 );
+	lock_access( &session->lock );
 
-	gettimeofday( &ret->last_activ, 0 );
-	ret->function = (void*) function;
-	ret->udata = udata;
+	ret = create_flow ( session , tuple4 , 0 , function , udata , &err );
 
-	ret->lock.use = 0;
-	pthread_mutex_init ( &ret->lock.mutex , 0 );
-	pthread_cond_init ( &ret->lock.pcond , 0 );
+	unlock_access( &session->lock );
+
+	if ( error != 0 )
+		*error = err;
+
+	return ret;
+}
+
+/** @brief Looks for the flow of 'tuple4', creating it if needed, taking the session lock once **/
+_HIDDEN pntoh_ipv4_flow_t ipv4_get_flow ( pntoh_ipv4_session_t session , pntoh_ipv4_tuple4_t tuple4 , pipv4_dfcallback_t function , pipv4_dfvcallback_t vfunction , void *udata , unsigned int *error )
+{
+	pntoh_ipv4_flow_t ret = 0;
+
+	*error = NTOH_OK;
+
+	if ( !params.init )
+	{
+		*error = NTOH_ERROR_INIT;
+		return ret;
+	}
 
 	lock_access( &session->lock );
 
-	htable_insert ( session->flows , ret->key , ret );
+	if ( ! ( ret = htable_find ( session->flows , ip_get_hashkey( tuple4 ) , tuple4 ) ) )
+		ret = create_flow ( session , tuple4 , function , vfunction , udata , error );
 
 	unlock_access( &session->lock );
 
@@ -210,75 +303,241 @@ inline static unsigned short cksum(unsigned short *buf, int nwords)
 }
 
 
+/* fixes the final IP header to describe the whole datagram, returns its length */
+inline static unsigned int fix_header ( pntoh_ipv4_flow_t flow )
+{
+	struct ip	*iphdr = flow->final_iphdr;
+	unsigned int	offsethdr = 0;
+
+	if ( iphdr == 0 )
+		return offsethdr;
+
+	offsethdr = 4*iphdr->ip_hl;
+	iphdr->ip_len = htons(flow->total + offsethdr);
+	iphdr->ip_off = 0;
+	iphdr->ip_sum = 0;
+	iphdr->ip_sum = cksum ( (unsigned short*) iphdr , (int)offsethdr / 2 );
+
+	return offsethdr;
+}
+
 /* build the complete datagram from all collected IPv4 fragments */
-inline static unsigned char *build_datagram ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t flow )
+inline static unsigned char *build_datagram ( pntoh_ipv4_flow_t flow )
 {
-	pntoh_ipv4_fragment_t 	tmp;
 	pntoh_ipv4_fragment_t 	fragment;
-	struct ip				*iphdr;
 	unsigned int			offsethdr;
 	unsigned char 			*ret;
 
-	fragment = flow->fragments;
-	iphdr = flow->final_iphdr;
-	offsethdr = iphdr == 0 ? 0 : 4*iphdr->ip_hl;
-	ret = (unsigned char*) calloc ( flow->total + offsethdr , sizeof ( unsigned char ) );
+	offsethdr = fix_header ( flow );
+	flow->meat += offsethdr;
+	flow->total += offsethdr;
 
-	while ( fragment != 0 )
-	{
-		memcpy ( &ret[offsethdr + fragment->offset] , fragment->data , fragment->len );
-		tmp = fragment;
-		fragment = fragment->next;
-		free ( tmp->data );
-		free ( tmp );
-		sem_post ( &session->max_fragments );
-	}
-	flow->fragments = 0;
+	/* the fragments are already in place, just before the final IP header */
+	if ( flow->buffer != 0 )
+		return flow->buffer + DEFRAG_HEADROOM - offsethdr;
+
+	if ( ( ret = (unsigned char*) calloc ( flow->total , sizeof ( unsigned char ) ) ) == 0 )
+		return 0;
 
-	/* fix ip header data */
 	if ( offsethdr > 0 )
+		memcpy ( ret , flow->final_iphdr , offsethdr );
+
+	for ( fragment = flow->fragments ; fragment != 0 ; fragment = fragment->next )
+		memcpy ( &ret[offsethdr + fragment->offset] , fragment->data , fragment->len );
+
+	return ret;
+}
+
+/* sorts the fragments list by offset (it is mostly in descending order, so mostly reversed) */
+inline static pntoh_ipv4_fragment_t sort_fragments ( pntoh_ipv4_fragment_t list )
+{
+	pntoh_ipv4_fragment_t	ret = 0;
+	pntoh_ipv4_fragment_t	item = 0;
+	pntoh_ipv4_fragment_t	*pos = 0;
+
+	while ( ( item = list ) != 0 )
 	{
-		memcpy ( ret , iphdr , offsethdr );
-		iphdr = (struct ip*)ret;
-		iphdr->ip_len = htons(flow->total);
-		iphdr->ip_sum = 0;
-		iphdr->ip_sum = cksum ( (unsigned short*) iphdr , (int)offsethdr );
-		free ( flow->final_iphdr );
+		list = list->next;
+
+		for ( pos = &ret ; *pos != 0 && (*pos)->offset < item->offset ; pos = &(*pos)->next );
 
-		flow->meat += offsethdr;
-		flow->total += offsethdr;
+		item->next = *pos;
+		*pos = item;
 	}
 
 	return ret;
 }
 
-inline static void __ipv4_free_flow ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t *flow , unsigned short reason )
+/* delivers the datagram as the fixed IP header and the ordered slices of the fragments, without copying them */
+inline static int deliver_iovec ( pntoh_ipv4_flow_t flow , unsigned short reason )
 {
-	unsigned char *buffer = 0;
-	pntoh_ipv4_flow_t item = 0;
+	struct iovec		stack[DEFAULT_IPV4_IOVEC];
+	struct iovec		*iov = stack;
+	pntoh_ipv4_fragment_t	fragment;
+	unsigned char		*data = 0;
+	size_t			end = 0;
+	size_t			skip = 0;
+	size_t			len = 0;
+	int			count = 0;
 
-	if ( !flow || !(*flow) )
+	fix_header ( flow );
+
+	if ( flow->buffer != 0 )
+	{
+		iov[0].iov_base = flow->buffer + DEFRAG_HEADROOM;
+		iov[0].iov_len = len = flow->total;
+		count = 1;
+	}else{
+		flow->fragments = sort_fragments ( flow->fragments );
+
+		for ( fragment = flow->fragments ; fragment != 0 ; fragment = fragment->next , count++ );
+
+		/* without room for the vector the slices are copied into a single one */
+		if ( count > DEFAULT_IPV4_IOVEC && ( iov = (struct iovec*) calloc ( count , sizeof ( struct iovec ) ) ) == 0 )
+		{
+			iov = stack;
+			if ( ( data = (unsigned char*) malloc ( flow->total ) ) == 0 )
+				return NTOH_ERROR_NOMEM;
+		}
+
+		/* overlapped data is taken from the fragment with the lower offset */
+		for ( fragment = flow->fragments , count = 0 ; fragment != 0 ; fragment = fragment->next )
+		{
+			if ( fragment->offset + fragment->len <= end )
+				continue;
+
+			skip = fragment->offset < end ? end - fragment->offset : 0;
+			if ( data == 0 )
+			{
+				iov[count].iov_base = fragment->data + skip;
+				iov[count++].iov_len = fragment->len - skip;
+			}else
+				memcpy ( data + len , fragment->data + skip , fragment->len - skip );
+			len += fragment->len - skip;
+			end = fragment->offset + fragment->len;
+		}
+
+		if ( data != 0 )
+		{
+			iov[0].iov_base = data;
+			iov[0].iov_len = len;
+			count = 1;
+		}
+	}
+
+	( (pipv4_dfvcallback_t) flow->vfunction )( flow , &flow->ident , flow->final_iphdr , iov , count , len , reason );
+
+	if ( iov != stack )
+		free ( iov );
+
+	if ( data != 0 )
+		free ( data );
+
+	return NTOH_OK;
+}
+
+/* releases the fragments (or the datagram buffer) of a flow */
+inline static void free_fragments ( pntoh_ipv4_flow_t flow )
+{
+	pntoh_ipv4_fragment_t tmp;
+
+	if ( flow->buffer != 0 )
+	{
+		free ( flow->buffer );
+		free ( flow->coverage );
 		return;
+	}
 
-	item = *flow;
+	while ( flow->fragments != 0 )
+	{
+		tmp = flow->fragments;
+		flow->fragments = tmp->next;
+		free ( tmp->data );
+		free ( tmp );
+	}
 
-	buffer = build_datagram ( session , item );
+	free ( flow->final_iphdr );
 
-	/* notify to the user */
-	( (pipv4_dfcallback_t) item->function )( item, &item->ident, buffer , item->meat , reason );
-	free ( buffer );
+	return;
+}
 
+/** @brief Unlinks a flow from its session, the session must be locked **/
+inline static void unlink_flow ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t item )
+{
 	htable_remove ( session->flows , item->key, &(item->ident) );
+	twheel_del ( &session->timers , &item->timer );
+
+	if ( item->prev != 0 )
+		item->prev->next = item->next;
+	else
+		session->flows_head = item->next;
 
+	if ( item->next != 0 )
+		item->next->prev = item->prev;
+	else
+		session->flows_tail = item->prev;
+
+	__atomic_sub_fetch ( &session->stats.mem_used , item->mem , __ATOMIC_RELAXED );
 	sem_post( &session->max_flows );
 
+	return;
+}
+
+/** @brief Delivers the datagram of an unlinked flow (carrying TCP to 'link', if any) and releases the flow **/
+inline static int release_flow ( pntoh_tcp_link_t link , pntoh_ipv4_flow_t item , unsigned short reason )
+{
+	unsigned char *buffer = 0;
+	int ret = NTOH_OK;
+
+	/* datagrams carrying TCP go straight to the linked session */
+	if ( link != 0 && reason == NTOH_REASON_DEFRAGMENTED_DATAGRAM && item->ident.protocol == IPPROTO_TCP )
+	{
+		if ( ( buffer = build_datagram ( item ) ) != 0 )
+			ret = tcp_link_datagram ( link , buffer , item->meat );
+		else
+			ret = NTOH_ERROR_NOMEM;
+
+		if ( item->buffer == 0 )
+			free ( buffer );
+	}
+	/* notify to the user */
+	else if ( item->vfunction != 0 )
+		ret = deliver_iovec ( item , reason );
+	else if ( item->function != 0 )
+	{
+		if ( ( buffer = build_datagram ( item ) ) != 0 )
+			( (pipv4_dfcallback_t) item->function )( item, &item->ident, buffer , item->meat , reason );
+		else
+			ret = NTOH_ERROR_NOMEM;
+
+		if ( item->buffer == 0 )
+			free ( buffer );
+	}
+
+	free_fragments ( item );
+
+	/* locked by the caller, it is released unlocked */
+	unlock_access ( &item->lock );
 	free_lockaccess ( &item->lock );
 
 	free( item );
 
+	return ret;
+}
+
+inline static int __ipv4_free_flow ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t *flow , unsigned short reason )
+{
+	pntoh_ipv4_flow_t item = 0;
+
+	if ( !flow || !(*flow) )
+		return NTOH_OK;
+
+	item = *flow;
 	*flow = 0;
 
-	return;
+	unlink_flow ( session , item );
+
+	return release_flow ( session->link , item , reason );
 }
 
 void ntoh_ipv4_free_flow ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t *flow , unsigned short reason )
@@ -296,6 +555,168 @@ void ntoh_ipv4_free_flow ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t *flo
 	return;
 }
 
+/** @brief Releases the oldest flow holding fragments and not in use, other than 'current' (the one being filled) **/
+inline static int evict_flow ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t current )
+{
+	pntoh_ipv4_flow_t	item = 0;
+	pntoh_ipv4_flow_t	victim = 0;
+	size_t			mem = 0;
+	unsigned int		i;
+
+	lock_access ( &session->lock );
+
+	for ( item = session->flows_head , i = 0 ; item != 0 && i < DEFAULT_IPV4_EVICT_SCAN ; item = item->next , i++ )
+	{
+		/* empty flows release nothing, and the current one is skipped (trylock_access always succeeds with NTOH_SESSION_LOCK_NONE) */
+		if ( item != current && item->mem > 0 && trylock_access ( &item->lock ) )
+		{
+			victim = item;
+			break;
+		}
+	}
+
+	if ( victim != 0 )
+	{
+		mem = victim->mem;
+		__ipv4_free_flow ( session , &victim , NTOH_REASON_EVICTED );
+
+		__atomic_add_fetch ( &session->stats.evicted , 1 , __ATOMIC_RELAXED );
+		__atomic_add_fetch ( &session->stats.evicted_bytes , mem , __ATOMIC_RELAXED );
+	}
+
+	unlock_access ( &session->lock );
+
+	return mem > 0;
+}
+
+/** @brief Charges 'size' bytes to the fragments memory budget, evicting older flows if the session policy allows it **/
+inline static int reserve_memory ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t flow , size_t size )
+{
+	while ( __atomic_add_fetch ( &session->stats.mem_used , size , __ATOMIC_RELAXED ) > session->stats.mem_max )
+	{
+		__atomic_sub_fetch ( &session->stats.mem_used , size , __ATOMIC_RELAXED );
+
+		if ( size > session->stats.mem_max || ! ( session->flags & NTOH_SESSION_ADMISSION_MASK ) || ! evict_flow ( session , flow ) )
+		{
+			__atomic_add_fetch ( &session->stats.rejected , 1 , __ATOMIC_RELAXED );
+			return NTOH_FRAGMENTS_BUDGET_EXCEEDED;
+		}
+	}
+
+	flow->mem += size;
+
+	return NTOH_OK;
+}
+
+/** @brief Grows the datagram buffer and the coverage bitmap of a flow up to 'size' data bytes **/
+inline static int grow_buffer ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t flow , size_t size )
+{
+	size_t		charge = ( size - flow->size ) + COVERAGE_BYTES(size) - COVERAGE_BYTES(flow->size);
+	size_t		final = 0;
+	unsigned char	*buffer = 0;
+	unsigned char	*coverage = 0;
+	int		ret = NTOH_OK;
+
+	if ( flow->buffer == 0 )
+		charge += DEFRAG_HEADROOM;
+
+	if ( ( ret = reserve_memory ( session , flow , charge ) ) != NTOH_OK )
+		return ret;
+
+	/* the final header lives in the buffer */
+	if ( flow->final_iphdr != 0 )
+		final = (unsigned char*) flow->final_iphdr - flow->buffer;
+
+	if ( ( buffer = (unsigned char*) realloc ( flow->buffer , DEFRAG_HEADROOM + size ) ) != 0 )
+		flow->buffer = buffer;
+
+	if ( buffer != 0 && ( coverage = (unsigned char*) realloc ( flow->coverage , COVERAGE_BYTES(size) ) ) != 0 )
+		flow->coverage = coverage;
+
+	if ( coverage == 0 )
+	{
+		/* no memory for the datagram, given back */
+		__atomic_sub_fetch ( &session->stats.mem_used , charge , __ATOMIC_RELAXED );
+		flow->mem -= charge;
+		return NTOH_FRAGMENTS_BUDGET_EXCEEDED;
+	}
+
+	/* holes are delivered as zeros when the flow does not complete */
+	memset ( buffer + DEFRAG_HEADROOM + flow->size , 0 , size - flow->size );
+	memset ( coverage + COVERAGE_BYTES(flow->size) , 0 , COVERAGE_BYTES(size) - COVERAGE_BYTES(flow->size) );
+	if ( flow->final_iphdr != 0 )
+		flow->final_iphdr = (struct ip*) ( buffer + final );
+
+	flow->size = size;
+
+	return ret;
+}
+
+/** @brief Copies a fragment at its offset of the flow datagram buffer (NTOH_SESSION_INPLACE_DEFRAG), the flow must be locked **/
+inline static int copy_fragment ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t flow , unsigned int offset , unsigned char *data , unsigned int len , struct ip *final )
+{
+	size_t	end = offset + len;
+	size_t	last = 0;
+	size_t	block = 0;
+	size_t	next = 0;
+	size_t	size = 0;
+	int	covered = 0;
+	int	ret = NTOH_OK;
+
+	/* the end of the datagram is known since the final fragment, nothing can go further */
+	if ( flow->final_iphdr != 0 ? ( end > flow->total || ( final != 0 && end != flow->total ) ) : ( final != 0 && end < flow->total ) )
+		return NTOH_IP_FRAGMENT_OVERRUN;
+
+	/* sized by the final fragment, otherwise doubled to hold the next ones */
+	if ( end > flow->size )
+	{
+		size = final != 0 ? end : 2 * end;
+		if ( size > MAX_IPV4_DATAGRAM_LENGTH )
+			size = MAX_IPV4_DATAGRAM_LENGTH;
+
+		if ( ( ret = grow_buffer ( session , flow , size ) ) != NTOH_OK )
+			return ret;
+	}
+
+	/* overlapped data is kept from the fragment which brought it first, only the blocks not covered yet are copied */
+	for ( block = offset / 8 ; block * 8 < end ; block = next )
+	{
+		covered = ( flow->coverage[block / 8] >> ( block % 8 ) ) & 1;
+		for ( next = block + 1 ; next * 8 < end && ( ( flow->coverage[next / 8] >> ( next % 8 ) ) & 1 ) == covered ; next++ );
+
+		if ( ! covered )
+			memcpy ( flow->buffer + DEFRAG_HEADROOM + block * 8 , data + block * 8 - offset , ( next * 8 < end ? next * 8 : end ) - block * 8 );
+	}
+
+	/* offsets are multiples of 8, so only the final fragment covers a partial block */
+	last = final != 0 ? end : offset + ( len & ~7 );
+	for ( block = offset / 8 ; block * 8 < last ; block++ )
+	{
+		/* a whole bitmap byte (64 data bytes) at once */
+		if ( block % 8 == 0 && last - block * 8 >= 64 )
+		{
+			flow->meat += 8 * ( 8 - __builtin_popcount ( flow->coverage[block / 8] ) );
+			flow->coverage[block / 8] = 0xFF;
+			block += 7;
+			continue;
+		}
+
+		if ( flow->coverage[block / 8] & ( 1 << ( block % 8 ) ) )
+			continue;
+
+		flow->coverage[block / 8] |= 1 << ( block % 8 );
+		flow->meat += last - block * 8 < 8 ? last - block * 8 : 8;
+	}
+
+	if ( final != 0 && flow->final_iphdr == 0 )
+	{
+		flow->final_iphdr = (struct ip*) ( flow->buffer + DEFRAG_HEADROOM - 4 * final->ip_hl );
+		memcpy ( flow->final_iphdr , final , 4 * final->ip_hl );
+	}
+
+	return ret;
+}
+
 int ntoh_ipv4_add_fragment ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t flow , struct ip *iphdr )
 {
 	size_t			iphdr_len = 0;
@@ -306,6 +727,10 @@ int ntoh_ipv4_add_fragment ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t fl
 	unsigned char		*data = 0;
 	int			ret = NTOH_OK;
 	pntoh_ipv4_fragment_t	frag = 0;
+	unsigned short		final = 0;
+	size_t			charge = 0;
+	ntoh_tcp_link_t		link;
+	pntoh_tcp_link_t	linked = 0;
 
 	if ( !params.init )
 		return NTOH_NOT_INITIALIZED;
@@ -373,37 +798,76 @@ int ntoh_ipv4_add_fragment ( pntoh_ipv4_session_t session , pntoh_ipv4_flow_t fl
 		goto exitp;
 	}
 
-	sem_wait ( &session->max_fragments );
+	if ( session->flags & NTOH_SESSION_INPLACE_DEFRAG )
+	{
+		if ( ( ret = copy_fragment ( session , flow , offset , data , data_len , IS_SET(flags,IP_MF) ? 0 : iphdr ) ) != NTOH_OK )
+			goto exitp;
+	}else{
+		/* only the first final fragment header is kept */
+		final = !IS_SET(flags,IP_MF) && flow->final_iphdr == 0;
 
-	/* inserts the new fragment into the list */
-	frag = (pntoh_ipv4_fragment_t) calloc ( 1 , sizeof ( ntoh_ipv4_fragment_t ) );
-	frag->len = data_len;
-	frag->offset = offset;
-	frag->data = (unsigned char*) calloc ( data_len , sizeof ( unsigned char ) );
-	memcpy ( frag->data , data , data_len );
-	flow->fragments = insert_fragment ( flow->fragments , frag );
+		charge = sizeof ( ntoh_ipv4_fragment_t ) + data_len + ( final ? iphdr_len : 0 );
 
-    if ( flow->total < offset + data_len )
-		flow->total = offset + data_len;
+		if ( ( ret = reserve_memory ( session , flow , charge ) ) != NTOH_OK )
+			goto exitp;
 
-	flow->meat += data_len;
+		if ( ( frag = (pntoh_ipv4_fragment_t) calloc ( 1 , sizeof ( ntoh_ipv4_fragment_t ) ) ) != 0 && ! ( frag->data = (unsigned char*) calloc ( data_len , sizeof ( unsigned char ) ) ) )
+		{
+			free ( frag );
+			frag = 0;
+		}
 
-	/* it is the final fragment */
-	if ( !IS_SET(flags,IP_MF) )
-	{
-		flow->final_iphdr = (struct ip*) calloc ( iphdr_len , sizeof ( unsigned char ) );
-		memcpy ( flow->final_iphdr , iphdr , iphdr_len );
+		if ( frag != 0 && final && ! ( flow->final_iphdr = (struct ip*) calloc ( iphdr_len , sizeof ( unsigned char ) ) ) )
+		{
+			free ( frag->data );
+			free ( frag );
+			frag = 0;
+		}
+
+		if ( frag == 0 )
+		{
+			/* no memory for the fragment, given back */
+			__atomic_sub_fetch ( &session->stats.mem_used , charge , __ATOMIC_RELAXED );
+			flow->mem -= charge;
+			ret = NTOH_ERROR_NOMEM;
+			goto exitp;
+		}
+
+		/* inserts the new fragment into the list */
+		frag->len = data_len;
+		frag->offset = offset;
+		memcpy ( frag->data , data , data_len );
+		flow->fragments = insert_fragment ( flow->fragments , frag );
+		flow->meat += data_len;
+
+		/* it is the final fragment */
+		if ( final )
+			memcpy ( flow->final_iphdr , iphdr , iphdr_len );
 	}
 
+	if ( flow->total < offset + data_len )
+		flow->total = offset + data_len;
+
 	/* if there are no holes */
 	if ( flow->final_iphdr != 0 && flow->total == flow->meat )
 	{
-
+		/* the datagram is delivered once the flow is unlinked, out of the session lock (the link is copied under it) */
 		lock_access ( &session->lock );
-		__ipv4_free_flow ( session , &flow , NTOH_REASON_DEFRAGMENTED_DATAGRAM );
+
+		if ( session->link != 0 )
+		{
+			link = *session->link;
+			linked = &link;
+		}
+
+		unlink_flow ( session , flow );
+
 		unlock_access ( &session->lock );
+
+		ret = release_flow ( linked , flow , NTOH_REASON_DEFRAGMENTED_DATAGRAM );
+		flow = 0;
 	}else
-		gettimeofday( &flow->last_activ, 0 );
+		get_session_time ( session->flags , &session->clock , &flow->last_activ );
 
 exitp:
 	if ( flow != 0 )
@@ -432,68 +896,165 @@ unsigned int ntoh_ipv4_count_flows ( pntoh_ipv4_session_t session )
 	return ret;
 }
 
-inline static void ip_check_timeouts ( pntoh_ipv4_session_t session )
+int ntoh_ipv4_get_stats ( pntoh_ipv4_session_t session , pntoh_defrag_stats_t stats )
 {
-	struct timeval		tv = { 0 , 0 };
-	pntoh_ipv4_flow_t	item;
-	unsigned int		i = 0;
-	phtnode_t		node = 0;
-	phtnode_t		prev = 0;
+	if ( !session || !stats )
+		return NTOH_ERROR_PARAMS;
 
-	lock_access( &session->lock );
+	stats->mem_used = __atomic_load_n ( &session->stats.mem_used , __ATOMIC_RELAXED );
+	stats->mem_max = session->stats.mem_max;
+	stats->rejected = __atomic_load_n ( &session->stats.rejected , __ATOMIC_RELAXED );
+	stats->evicted = __atomic_load_n ( &session->stats.evicted , __ATOMIC_RELAXED );
+	stats->evicted_bytes = __atomic_load_n ( &session->stats.evicted_bytes , __ATOMIC_RELAXED );
+	/* IPv4 datagrams complete on arrival are not fragments, there are no atomic ones */
+	stats->atomic = 0;
+	stats->flows = ntoh_ipv4_count_flows ( session );
+
+	return NTOH_OK;
+}
+
+int ntoh_ipv4_link_tcp ( pntoh_ipv4_session_t session , pntoh_tcp_session_t tcp , pntoh_tcp_callback_t function , void *udata , unsigned short enable_check_timeout , unsigned short enable_check_nowindow )
+{
+	pntoh_tcp_link_t link = 0;
+
+	if ( !session || ( tcp != 0 && !function ) )
+		return NTOH_ERROR_PARAMS;
 
-	/* iterates between flows */
-	for ( i = 0 ; i < session->flows->table_size ; i++ )
+	if ( tcp != 0 )
 	{
-		gettimeofday ( &tv , 0 );
-		node = prev = session->flows->table[i];
-		while ( node != 0 )
-		{
-			item = (pntoh_ipv4_flow_t) node->val;
+		if ( ! ( link = (pntoh_tcp_link_t) calloc ( 1 , sizeof ( ntoh_tcp_link_t ) ) ) )
+			return NTOH_ERROR_NOMEM;
+
+		link->tcp = tcp;
+		link->function = function;
+		link->udata = udata;
+		link->enable_check_timeout = enable_check_timeout;
+		link->enable_check_nowindow = enable_check_nowindow;
+	}
 
-			/* timeout expired */
-			if ( DEFAULT_IPV4_FRAGMENT_TIMEOUT < tv.tv_sec - item->last_activ.tv_sec )
-			{
-				lock_access ( &item->lock );
+	lock_access ( &session->lock );
+
+	free ( session->link );
+	session->link = link;
+
+	unlock_access ( &session->lock );
+
+	return NTOH_OK;
+}
+
+/**
+ * @brief Expires the timed out flows
+ *
+ * Flows are queued in the session timer wheel when created, and the deadline is not
+ * updated on each fragment. When a timer fires, the real deadline is computed from the
+ * last activity and the flow is queued again if still alive. At most
+ * DEFAULT_IPV4_EXPIRE_BATCH flows are handled while holding the session lock.
+ *
+ * Up to 'max' timers due at 'now' are handled (all of them if 'max' is 0), returns how many.
+ */
+inline static unsigned int ip_expire_timers ( pntoh_ipv4_session_t session , unsigned long now , unsigned int max )
+{
+	unsigned long		deadline = 0;
+	unsigned int		count = 0;
+	unsigned int		total = 0;
+	ptwentry_t		timer;
+	pntoh_ipv4_flow_t	item;
+
+	do
+	{
+		lock_access( &session->lock );
+
+		for ( count = 0 ; count < DEFAULT_IPV4_EXPIRE_BATCH && ( !max || total < max ) && ( timer = twheel_expire ( &session->timers , now ) ) != 0 ; count++ , total++ )
+		{
+			item = TWHEEL_ITEM ( timer , ntoh_ipv4_flow_t , timer );
+
+			if ( ( deadline = item->last_activ.tv_sec + DEFAULT_IPV4_FRAGMENT_TIMEOUT + 1 ) > now )
+				twheel_add ( &session->timers , timer , deadline );
+			/* a flow being fed right now is checked again in a second (never wait for it holding the session lock) */
+			else if ( !trylock_access ( &item->lock ) )
+				twheel_add ( &session->timers , timer , now + 1 );
+			else
 				__ipv4_free_flow ( session , &item , NTOH_REASON_TIMEDOUT_FRAGMENTS );
-				if (node != prev)
-				{
-				      node = prev;
-				}else{
-				      node = 0;
-				}
-			}else{
-				prev = node;
-				node = node->next;
-			}
 		}
-	}
 
-	unlock_access( &session->lock );
+		unlock_access( &session->lock );
+	}while ( count == DEFAULT_IPV4_EXPIRE_BATCH && ( !max || total < max ) );
+
+	return total;
+}
+
+/* expires everything due at the current time of the session */
+inline static void ip_check_timeouts ( pntoh_ipv4_session_t session )
+{
+	struct timeval tv = { 0 , 0 };
+
+	get_session_time ( session->flags , &session->clock , &tv );
+	ip_expire_timers ( session , tv.tv_sec , 0 );
 
 	return;
 }
 
-static void *timeouts_thread ( void *p )
+/* timer service check */
+static void timeouts_check ( void *p )
+{
+	ip_check_timeouts( (pntoh_ipv4_session_t) p );
+}
+
+int ntoh_ipv4_set_time ( pntoh_ipv4_session_t session , const struct timeval *tv )
 {
-	pthread_setcanceltype( PTHREAD_CANCEL_DEFERRED, 0 );
+	if ( !session || !tv || !( session->flags & NTOH_SESSION_CALLER_CLOCK ) )
+		return NTOH_ERROR_PARAMS;
 
-	while ( 1 )
-	{
-		ip_check_timeouts( (pntoh_ipv4_session_t) p );
-		pthread_testcancel();
-		sleep( 1 );
-	}
+	if ( set_session_time ( &session->clock , tv ) )
+		ip_check_timeouts ( session );
 
-	pthread_exit( 0 );
-	//dummy return
-	return 0;
+	return NTOH_OK;
+}
+
+unsigned int ntoh_ipv4_tick ( pntoh_ipv4_session_t session , const struct timeval *now , unsigned int max )
+{
+	struct timeval tv = { 0 , 0 };
+
+	if ( !session )
+		return 0;
+
+	if ( now != 0 && ( session->flags & NTOH_SESSION_CALLER_CLOCK ) )
+		set_session_time ( &session->clock , now );
+
+	get_session_time ( session->flags , &session->clock , &tv );
+
+	return ip_expire_timers ( session , tv.tv_sec , max );
+}
+
+int ntoh_ipv4_next_deadline ( pntoh_ipv4_session_t session , struct timeval *deadline )
+{
+	unsigned long expire = 0;
+
+	if ( !session || !deadline )
+		return NTOH_ERROR_PARAMS;
+
+	lock_access ( &session->lock );
+
+	if ( ! twheel_next ( &session->timers , &expire ) )
+		expire = 0;
+
+	unlock_access ( &session->lock );
+
+	deadline->tv_sec = expire;
+	deadline->tv_usec = 0;
+
+	return NTOH_OK;
 }
 
 pntoh_ipv4_session_t ntoh_ipv4_new_session ( unsigned int max_flows , unsigned long max_mem , unsigned int *error )
+{
+	return ntoh_ipv4_new_session_ex ( max_flows , max_mem , NTOH_SESSION_DEFAULT , error );
+}
+
+pntoh_ipv4_session_t ntoh_ipv4_new_session_ex ( unsigned int max_flows , unsigned long max_mem , unsigned int flags , unsigned int *error )
 {
 	pntoh_ipv4_session_t	session;
-	unsigned int		max_fragments;
+	struct timeval		tv = { 0 , 0 };
 
 	if ( !max_flows )
 		max_flows = DEFAULT_IPV4_MAX_FLOWS;
@@ -505,17 +1066,22 @@ pntoh_ipv4_session_t ntoh_ipv4_new_session ( unsigned int max_flows , unsigned l
 		return 0;
 	}
 
-	session->flows = htable_map (max_flows , &ipv4_equal_tuple );
-	sem_init ( &session->max_flows , 0 , max_flows );
-	session->lock.use = 0;
-	pthread_mutex_init ( &session->lock.mutex , 0 );
-	pthread_cond_init ( &session->lock.pcond , 0 );
+	session->flags = flags;
+	get_session_time ( flags , &session->clock , &tv );
 
-	max_fragments = (int)(max_mem / sizeof ( ntoh_ipv4_fragment_t ));
-	if ( !max_fragments )
-		max_fragments = DEFAULT_IPV4_MAX_FRAGMENTS;
+	if ( ! twheel_init ( &session->timers , DEFAULT_TWHEEL_SLOTS , tv.tv_sec ) )
+	{
+		free ( session );
+		if ( error != 0 )
+			*error = NTOH_ERROR_NOMEM;
+		return 0;
+	}
+
+	session->flows = htable_map ( max_flows , &ipv4_equal_tuple , HTABLE_ENGINE(flags) );
+	sem_init ( &session->max_flows , 0 , max_flows );
+	init_lockaccess ( &session->lock , LOCK_MODE(flags) );
 
-	sem_init ( &session->max_fragments , 0 , max_fragments );
+	session->stats.mem_max = max_mem > 0 ? max_mem : DEFAULT_IPV4_MAX_MEM;
 
 	ntoh_ipv4_init();
 
@@ -530,14 +1096,16 @@ pntoh_ipv4_session_t ntoh_ipv4_new_session ( unsigned int max_flows , unsigned l
 	if ( error != 0 )
 		*error = NTOH_OK;
 
-	pthread_create ( &session->tID , 0 , timeouts_thread , (void*) session );
+	/* timeouts are checked by ntoh_ipv4_set_time / ntoh_ipv4_tick */
+	if ( ! ( flags & ( NTOH_SESSION_CALLER_CLOCK | NTOH_SESSION_MANUAL_TIMERS ) ) && LOCK_MODE(flags) != LOCK_NONE )
+		timers_register ( &session->timer , timeouts_check , (void*) session , DEFAULT_IPV4_TIMEOUT_DELAY );
 
 	return session;
 }
 
 inline static void __ipv4_free_session ( pntoh_ipv4_session_t session )
 {
-	ntoh_ipv4_key_t		first = 0;
+	htiter_t		it = { 0 , 0 , 0 };
 	pntoh_ipv4_session_t	ptr = 0;
 	pntoh_ipv4_flow_t	item = 0;
 
@@ -555,20 +1123,24 @@ inline static void __ipv4_free_session ( pntoh_ipv4_session_t session )
 			return;
 	}
 
+	/* no check can be running from here on */
+	timers_unregister ( &session->timer );
+
 	lock_access( &session->lock );
 
-	while ( ( first = htable_first ( session->flows ) ) != 0 )
+	while ( ( item = (pntoh_ipv4_flow_t) htable_iterate ( session->flows , &it ) ) != 0 )
 	{
 		lock_access ( &item->lock );
 		__ipv4_free_flow ( session , &item , NTOH_REASON_EXIT );
 	}
 
 	htable_destroy ( &(session->flows) );
+	twheel_free ( &session->timers );
+	free ( session->link );
+
+	unlock_access( &session->lock );
 
-	pthread_cancel ( session->tID );
-	pthread_join ( session->tID , 0 );
 	sem_destroy ( &session->max_flows );
-	sem_destroy ( &session->max_fragments );
 
 	free_lockaccess ( &session->lock );
 
@@ -593,48 +1165,31 @@ void ntoh_ipv4_free_session ( pntoh_ipv4_session_t session )
 
 int ntoh_ipv4_resize_session ( pntoh_ipv4_session_t session , size_t newsize )
 {
-        pipv4_flows_table_t	newht = 0 , curht = 0;
-        pntoh_ipv4_flow_t	item = 0;
-        int                     current = 0;
+	size_t	cursize = 0;
+	int	ret = NTOH_OK;
 
 	if ( ! session )
 		return NTOH_INCORRECT_SESSION;
 
-	if ( ! newsize || newsize == session->flows->table_size )
+	if ( ! newsize )
 		return NTOH_OK;
 
 	lock_access ( &session->lock );
 
-	curht = session->flows;
-
-        // increase the size
-        if ( newsize > curht->table_size )
-                newht = htable_map ( newsize , &ipv4_equal_tuple );
-        // decrease the size
-        else
-        {
-                sem_getvalue ( &session->max_flows , &current );
-                if ( newsize < current )
-                {
-                        unlock_access ( &session->lock );
-                        return NTOH_ERROR_NOSPACE;
-                }
-        }
-
-        // moves all the flows to the new sessions table
-        while ( ( current = htable_first ( curht ) ) != 0 )
-        {
-                item = (pntoh_ipv4_flow_t) htable_remove ( curht , current , 0 );
-                htable_insert ( newht , current , item );
-        }
-        htable_destroy ( &curht );
-
-	sem_init ( &session->max_flows , 0 , newsize );
-	session->flows = newht;
+	/* the flows are moved to the new table a few buckets at a time (see htable_resize) */
+	if ( ( cursize = session->flows->table_size ) == newsize )
+		ret = NTOH_OK;
+	else if ( ! resize_semaphore ( &session->max_flows , cursize , newsize ) )
+		ret = NTOH_ERROR_NOSPACE;
+	else if ( ! htable_resize ( session->flows , newsize ) )
+	{
+		resize_semaphore ( &session->max_flows , newsize , cursize );
+		ret = NTOH_ERROR_NOMEM;
+	}
 
 	unlock_access ( &session->lock );
 
-	return NTOH_OK;
+	return ret;
 }
 
 void ntoh_ipv4_init ( void )
@@ -642,9 +1197,7 @@ void ntoh_ipv4_init ( void )
 	if ( params.init )
 		return;
 
-	params.lock.use = 0;
-	pthread_mutex_init( &params.lock.mutex, 0 );
-	pthread_cond_init( &params.lock.pcond, 0 );
+	init_lockaccess ( &params.lock , LOCK_CONDVAR );
 
 	params.init = 1;
 	return;
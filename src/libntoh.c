@@ -69,7 +69,15 @@ static const char retval_descriptions[][48] =
 		"No TCP window space left",
 		"Not a TCP segment",
 		"Synchronizing connection",
-		"Library not initialized"
+		"Library not initialized",
+
+		/* ntoh_process_packet */
+		"Packet ignored",
+		"Shard ring full",
+		"Duplicated segment",
+
+		/* ntoh_add_ipv(4|6)fragment (cont.) */
+		"IP fragments memory budget exceeded"
 };
 
 /** @brief reason description strings **/
@@ -91,7 +99,10 @@ static const char reason_descriptions[][30]=
 
 		/* IP */
 		"Defragmented IP datagram",
-		"Timeout expired"
+		"Timeout expired",
+
+		/* TCP / IP (cont.) */
+		"Evicted"
 };
 
 /* API errors */
@@ -111,11 +122,16 @@ const char* ntoh_version ( void )
 	return (const char*) VERSION;
 }
 
+unsigned int ntoh_abi_version ( void )
+{
+	return NTOH_ABI_VERSION;
+}
+
 const char* ntoh_get_retval_desc ( int val )
 {
 	unsigned int pos = (unsigned int)(val * (-1));
 
-	if ( pos > (sizeof(retval_descriptions) / sizeof(*retval_descriptions) ) )
+	if ( pos >= (sizeof(retval_descriptions) / sizeof(*retval_descriptions) ) )
 		return 0;
 
 	return retval_descriptions[pos];
@@ -148,9 +164,11 @@ void ntoh_init ( void )
 
 void ntoh_exit ( void )
 {
+	ntoh_shard_exit();
 	ntoh_tcp_exit();
 	ntoh_ipv4_exit();
 	ntoh_ipv6_exit();
+	timers_exit();
 
 	return;
 }
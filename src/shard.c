@@ -0,0 +1,438 @@
+/********************************************************************************
+ * Copyright (c) 2012, Chema Garcia                                             *
+ * All rights reserved.                                                         *
+ *                                                                              *
+ * Redistribution and use in source and binary forms, with or                   *
+ * without modification, are permitted provided that the following              *
+ * conditions are met:                                                          *
+ *                                                                              *
+ *    * Redistributions of source code must retain the above                    *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer.                                                             *
+ *                                                                              *
+ *    * Redistributions in binary form must reproduce the above                 *
+ *      copyright notice, this list of conditions and the following             *
+ *      disclaimer in the documentation and/or other materials provided         *
+ *      with the distribution.                                                  *
+ *                                                                              *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"  *
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE    *
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE   *
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE    *
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR          *
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF         *
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS     *
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN      *
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)      *
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE   *
+ * POSSIBILITY OF SUCH DAMAGE.                                                  *
+ ********************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#define __FAVOR_BSD
+#include <libntoh.h>
+
+/** @brief fixed seed of the shard selection hash, both directions must go to the same shard **/
+#define SHARD_HASH_SEED		0x6e746f68
+
+/** @brief sharded sessions list **/
+static pntoh_tcp_sharded_session_t	sessions_list = 0;
+static ntoh_lock_t			sessions_lock = { PTHREAD_MUTEX_INITIALIZER , PTHREAD_COND_INITIALIZER , 0 };
+
+/** @brief selects the shard of a segment, both directions of a stream go to the same one **/
+inline static pntoh_tcp_shard_t get_shard ( pntoh_tcp_sharded_session_t session , pntoh_tcp_tuple5_t tuple )
+{
+	/* as a NIC with the symmetric RSS key and the default indirection table */
+	if ( session->flags & NTOH_SESSION_TOEPLITZ_HASH )
+		return &session->shards[( ntoh_tcp_hash_tuple ( tuple , NTOH_HASH_TOEPLITZ_SYMMETRIC , 0 ) % NTOH_RSS_RETA_SIZE ) % session->count];
+
+	return &session->shards[ntoh_tcp_hash_tuple ( tuple , NTOH_HASH_SYMMETRIC , SHARD_HASH_SEED ) % session->count];
+}
+
+/** @brief gives the current time to the session of a shard **/
+inline static void shard_tick ( pntoh_tcp_shard_t shard , const struct timeval *ts )
+{
+	struct timeval		tv;
+	unsigned long long	usecs;
+
+	if ( ts != 0 )
+		tv = *ts;
+	else if ( ! ( shard->owner->flags & NTOH_SESSION_CALLER_CLOCK ) )
+		gettimeofday ( &tv , 0 );
+	else if ( ( usecs = __atomic_load_n ( &shard->clock , __ATOMIC_RELAXED ) ) != 0 )
+	{
+		tv.tv_sec = usecs / 1000000;
+		tv.tv_usec = usecs % 1000000;
+	}
+	else
+		return;
+
+	ntoh_tcp_set_time ( shard->session , &tv );
+}
+
+/** @brief worker thread of a shard, processes the queued segments in bursts **/
+static void *shard_worker ( void *p )
+{
+	pntoh_tcp_shard_t	shard = (pntoh_tcp_shard_t) p;
+	pntoh_shard_ring_t	ring = &shard->ring;
+	pntoh_dispatcher_t	config = &shard->owner->config;
+	pntoh_packet_t		pkts[DEFAULT_TCP_BURST];
+	void			*udata[DEFAULT_TCP_BURST];
+	int			ret[DEFAULT_TCP_BURST];
+	pntoh_shard_slot_t	slot = 0;
+	unsigned int		head , tail , n , i , idle = 0;
+	unsigned long		errors;
+	int			stop;
+
+	tail = ring->tail;
+
+	while ( 1 )
+	{
+		/* stop is read first, so the last segments queued before it are seen */
+		stop = __atomic_load_n ( &shard->stop , __ATOMIC_ACQUIRE );
+		head = __atomic_load_n ( &ring->head , __ATOMIC_ACQUIRE );
+
+		if ( head == tail )
+		{
+			if ( stop )
+				break;
+
+			if ( ++idle < DEFAULT_SHARD_SPIN )
+			{
+				sched_yield();
+				continue;
+			}
+
+			shard_tick ( shard , 0 );
+			usleep ( DEFAULT_SHARD_SLEEP );
+			continue;
+		}
+
+		idle = 0;
+		n = head - tail < DEFAULT_TCP_BURST ? head - tail : DEFAULT_TCP_BURST;
+
+		for ( i = 0 ; i < n ; i++ )
+		{
+			slot = &ring->slots[( tail + i ) & ring->mask];
+			pkts[i] = &slot->pkt;
+			udata[i] = slot->udata;
+		}
+
+		shard_tick ( shard , shard->owner->flags & NTOH_SESSION_CALLER_CLOCK ? &slot->ts : 0 );
+
+		tcp_process_burst ( shard->session , pkts , udata , ret , n , config->tcp_function , config->udata , config->enable_check_timeout , config->enable_check_nowindow );
+
+		for ( i = 0 , errors = 0 ; i < n ; i++ )
+			if ( ret[i] != NTOH_OK && ret[i] != NTOH_SYNCHRONIZING )
+				errors++;
+
+		__atomic_add_fetch ( &shard->processed , n , __ATOMIC_RELAXED );
+		__atomic_add_fetch ( &shard->errors , errors , __ATOMIC_RELAXED );
+
+		/* the slots can be reused now */
+		tail += n;
+		__atomic_store_n ( &ring->tail , tail , __ATOMIC_RELEASE );
+	}
+
+	/* the remaining streams are notified from this thread too */
+	ntoh_tcp_free_session ( shard->session );
+	shard->session = 0;
+
+	pthread_exit ( 0 );
+	//dummy return
+	return 0;
+}
+
+/** @brief stops the workers and frees the session (sessions_lock must be held) **/
+static void __tcp_free_sharded_session ( pntoh_tcp_sharded_session_t session )
+{
+	pntoh_tcp_sharded_session_t	ptr = 0;
+	unsigned int			i;
+
+	if ( session == sessions_list )
+		sessions_list = session->next;
+	else
+	{
+		for ( ptr = sessions_list ; ptr != 0 && ptr->next != session ; ptr = ptr->next );
+
+		if ( ptr != 0 )
+			ptr->next = session->next;
+	}
+
+	for ( i = 0 ; i < session->count ; i++ )
+	{
+		if ( !session->shards[i].ring.slots )
+			continue;
+
+		if ( session->shards[i].tID != 0 )
+		{
+			__atomic_store_n ( &session->shards[i].stop , 1 , __ATOMIC_RELEASE );
+			pthread_join ( session->shards[i].tID , 0 );
+		}
+		else if ( session->shards[i].session != 0 )
+			ntoh_tcp_free_session ( session->shards[i].session );
+
+		free ( session->shards[i].ring.slots );
+	}
+
+	free ( session->shards );
+	free ( session );
+
+	return;
+}
+
+/** @brief API to create a new sharded session **/
+pntoh_tcp_sharded_session_t ntoh_tcp_new_sharded_session ( unsigned int shards , unsigned int max_streams , unsigned int max_timewait , unsigned int ring_size , unsigned int flags , pntoh_dispatcher_t config , unsigned int *error )
+{
+	pntoh_tcp_sharded_session_t	session = 0;
+	pntoh_tcp_shard_t		shard = 0;
+	unsigned int			size = 1 , err = NTOH_OK , i;
+
+	if ( !shards || shards > NTOH_MAX_SHARDS || !config )
+	{
+		if ( error != 0 )
+			*error = NTOH_ERROR_PARAMS;
+		return 0;
+	}
+
+	if ( !config->tcp_function )
+	{
+		if ( error != 0 )
+			*error = NTOH_ERROR_NOFUNCTION;
+		return 0;
+	}
+
+	if ( !max_streams )
+		max_streams = DEFAULT_TCP_MAX_STREAMS;
+
+	if ( !max_timewait )
+		max_timewait = DEFAULT_TCP_MAX_TIMEWAIT_STREAMS(max_streams);
+
+	if ( !ring_size )
+		ring_size = DEFAULT_SHARD_RING_SIZE;
+
+	while ( size < ring_size )
+		size <<= 1;
+
+	if ( ! ( session = (pntoh_tcp_sharded_session_t) calloc ( 1 , sizeof ( ntoh_tcp_sharded_session_t ) ) ) || ! ( session->shards = (pntoh_tcp_shard_t) calloc ( shards , sizeof ( ntoh_tcp_shard_t ) ) ) )
+	{
+		free ( session );
+		if ( error != 0 )
+			*error = NTOH_ERROR_NOMEM;
+		return 0;
+	}
+
+	session->flags = flags;
+	session->config = *config;
+	session->config.tcp = 0;
+	session->config.ipv4 = 0;
+	session->config.ipv6 = 0;
+	session->count = shards;
+
+	lock_access ( &sessions_lock );
+
+	for ( i = 0 ; i < shards && err == NTOH_OK ; i++ )
+	{
+		shard = &session->shards[i];
+		shard->owner = session;
+		shard->ring.mask = size - 1;
+
+		if ( ! ( shard->ring.slots = (pntoh_shard_slot_t) calloc ( size , sizeof ( ntoh_shard_slot_t ) ) ) )
+		{
+			err = NTOH_ERROR_NOMEM;
+			break;
+		}
+
+		/* the worker drives the clock of its session */
+		if ( ! ( shard->session = ntoh_tcp_new_session_ex ( ( max_streams + shards - 1 ) / shards , ( max_timewait + shards - 1 ) / shards , flags | NTOH_SESSION_CALLER_CLOCK , &err ) ) )
+			break;
+
+		if ( pthread_create ( &shard->tID , 0 , shard_worker , (void*) shard ) != 0 )
+		{
+			shard->tID = 0;
+			err = NTOH_ERROR_NOMEM;
+		}
+	}
+
+	if ( err != NTOH_OK )
+	{
+		__tcp_free_sharded_session ( session );
+		session = 0;
+	}
+	else
+	{
+		session->next = sessions_list;
+		sessions_list = session;
+	}
+
+	unlock_access ( &sessions_lock );
+
+	if ( error != 0 )
+		*error = err;
+
+	return session;
+}
+
+/** @brief API to free a sharded session **/
+void ntoh_tcp_free_sharded_session ( pntoh_tcp_sharded_session_t session )
+{
+	if ( !session )
+		return;
+
+	lock_access ( &sessions_lock );
+
+	__tcp_free_sharded_session ( session );
+
+	unlock_access ( &sessions_lock );
+
+	return;
+}
+
+/** @brief API to queue a frame to its shard **/
+int ntoh_tcp_sharded_add_packet ( pntoh_tcp_sharded_session_t session , void *frame , size_t len , const struct timeval *ts , void *udata )
+{
+	pntoh_tcp_shard_t	shard = 0;
+	pntoh_shard_ring_t	ring = 0;
+	pntoh_shard_slot_t	slot = 0;
+	ntoh_packet_t		pkt;
+	unsigned int		head;
+	int			ret;
+
+	if ( !session || !frame || ( !ts && ( session->flags & NTOH_SESSION_CALLER_CLOCK ) ) )
+		return NTOH_ERROR_PARAMS;
+
+	if ( ( ret = ntoh_decode_packet ( session->config.linktype , frame , len , &pkt ) ) != NTOH_OK )
+		return ret;
+
+	if ( pkt.fragment || pkt.protocol != IPPROTO_TCP )
+		return NTOH_PACKET_IGNORED;
+
+	if ( pkt.len > DEFAULT_SHARD_SNAPLEN )
+		return NTOH_INCORRECT_LENGTH;
+
+	shard = get_shard ( session , &pkt.tuple );
+	ring = &shard->ring;
+	head = ring->head;
+
+	if ( head - __atomic_load_n ( &ring->tail , __ATOMIC_ACQUIRE ) > ring->mask )
+	{
+		__atomic_add_fetch ( &shard->dropped , 1 , __ATOMIC_RELAXED );
+		return NTOH_RING_FULL;
+	}
+
+	/* the headers are rebased to the copy */
+	slot = &ring->slots[head & ring->mask];
+	memcpy ( slot->data , pkt.ip , pkt.len );
+	slot->pkt = pkt;
+	slot->pkt.ip = (void*) slot->data;
+	slot->pkt.tcp = (struct tcphdr*) ( slot->data + ( (unsigned char*) pkt.tcp - (unsigned char*) pkt.ip ) );
+	slot->udata = udata;
+
+	if ( ts != 0 )
+		slot->ts = *ts;
+
+	__atomic_store_n ( &ring->head , head + 1 , __ATOMIC_RELEASE );
+	__atomic_add_fetch ( &shard->queued , 1 , __ATOMIC_RELAXED );
+
+	return NTOH_OK;
+}
+
+/** @brief API to set the time of the idle shards **/
+int ntoh_tcp_sharded_set_time ( pntoh_tcp_sharded_session_t session , const struct timeval *tv )
+{
+	unsigned long long	usecs;
+	unsigned int		i;
+
+	if ( !session || !tv || ! ( session->flags & NTOH_SESSION_CALLER_CLOCK ) )
+		return NTOH_ERROR_PARAMS;
+
+	usecs = (unsigned long long) tv->tv_sec * 1000000 + tv->tv_usec;
+
+	for ( i = 0 ; i < session->count ; i++ )
+		__atomic_store_n ( &session->shards[i].clock , usecs , __ATOMIC_RELAXED );
+
+	return NTOH_OK;
+}
+
+/** @brief API to wait until the rings are empty **/
+void ntoh_tcp_sharded_flush ( pntoh_tcp_sharded_session_t session )
+{
+	unsigned int i;
+
+	if ( !session )
+		return;
+
+	for ( i = 0 ; i < session->count ; i++ )
+		while ( __atomic_load_n ( &session->shards[i].ring.tail , __ATOMIC_ACQUIRE ) != session->shards[i].ring.head )
+			usleep ( DEFAULT_SHARD_SLEEP );
+
+	return;
+}
+
+/** @brief API to pin a shard worker to a CPU **/
+int ntoh_tcp_sharded_set_cpu ( pntoh_tcp_sharded_session_t session , unsigned int shard , unsigned int cpu )
+{
+	cpu_set_t set;
+
+	if ( !session || shard >= session->count || cpu >= CPU_SETSIZE )
+		return NTOH_ERROR_PARAMS;
+
+	CPU_ZERO ( &set );
+	CPU_SET ( cpu , &set );
+
+	if ( pthread_setaffinity_np ( session->shards[shard].tID , sizeof ( set ) , &set ) != 0 )
+		return NTOH_ERROR_PARAMS;
+
+	return NTOH_OK;
+}
+
+/** @brief API to get the counters of a shard **/
+int ntoh_tcp_sharded_get_stats ( pntoh_tcp_sharded_session_t session , unsigned int shard , pntoh_shard_stats_t stats )
+{
+	pntoh_tcp_shard_t ptr = 0;
+
+	if ( !session || shard >= session->count || !stats )
+		return NTOH_ERROR_PARAMS;
+
+	ptr = &session->shards[shard];
+	stats->queued = __atomic_load_n ( &ptr->queued , __ATOMIC_RELAXED );
+	stats->dropped = __atomic_load_n ( &ptr->dropped , __ATOMIC_RELAXED );
+	stats->processed = __atomic_load_n ( &ptr->processed , __ATOMIC_RELAXED );
+	stats->errors = __atomic_load_n ( &ptr->errors , __ATOMIC_RELAXED );
+	stats->streams = ntoh_tcp_count_streams ( ptr->session );
+
+	return NTOH_OK;
+}
+
+/** @brief API to get the amount of streams of all the shards **/
+unsigned int ntoh_tcp_sharded_count_streams ( pntoh_tcp_sharded_session_t session )
+{
+	unsigned int ret = 0 , i;
+
+	if ( !session )
+		return ret;
+
+	for ( i = 0 ; i < session->count ; i++ )
+		ret += ntoh_tcp_count_streams ( session->shards[i].session );
+
+	return ret;
+}
+
+/** @brief API to free all the sharded sessions **/
+void ntoh_shard_exit ( void )
+{
+	lock_access ( &sessions_lock );
+
+	while ( sessions_list != 0 )
+		__tcp_free_sharded_session ( sessions_list );
+
+	unlock_access ( &sessions_lock );
+
+	return;
+}
@@ -32,13 +32,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <poll.h>
 #include <sys/time.h>
+#include <sched.h>
 #include <libntoh.h>
 
 static ntoh_tcp_params_t params = { 0 , 0 };
 
-#define IS_TIMEWAIT(peer,side) (peer.status == DEFAULT_TCP_TIMEWAIT_TIMEOUT || side.status == DEFAULT_TCP_TIMEWAIT_TIMEOUT )
+#define IS_TIMEWAIT(peer,side) (peer.status == NTOH_STATUS_TIMEWAIT || side.status == NTOH_STATUS_TIMEWAIT )
 
 static const char tcp_status[][1024] = {
 		"Closed",
@@ -63,39 +63,271 @@ const char *ntoh_tcp_get_status ( unsigned int status )
 	return tcp_status[status];
 }
 
-/** @brief Returns the key for the stream identified by 'data' **/
-inline static ntoh_tcp_key_t tcp_getkey ( pntoh_tcp_session_t session , pntoh_tcp_tuple5_t data )
+/** @brief default RSS key of the NICs **/
+static const unsigned char rss_key[NTOH_RSS_KEY_LEN] =
+{
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+/** @brief symmetric RSS key, its 16 bits period makes swapping the addresses and the ports a no-op **/
+static const unsigned char rss_symmetric_key[NTOH_RSS_KEY_LEN] =
+{
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+	0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a
+};
+
+/** @brief SuperFastHash of the tuple with the lowest endpoint first, so both directions get the same value **/
+inline static unsigned int tcp_symmetric_hash ( pntoh_tcp_tuple5_t data , unsigned int seed )
+{
+	unsigned int	val[(IP6_ADDR_WORDS*2)+1];
+	int		cmp = memcmp ( data->source , data->destination , IP6_ADDR_LEN );
+
+	/* IPv4 tuples have the unused words zeroed (see ntoh_tcp_get_tuple5) */
+	if ( cmp < 0 || ( cmp == 0 && data->sport <= data->dport ) )
+	{
+		memcpy ( (void*) val , (void*) data->source , IP6_ADDR_LEN );
+		memcpy ( (void*) &val[IP6_ADDR_WORDS] , (void*) data->destination , IP6_ADDR_LEN );
+		val[IP6_ADDR_WORDS*2] = (unsigned int) data->sport | ( (unsigned int) data->dport << 16 );
+	}
+	else
+	{
+		memcpy ( (void*) val , (void*) data->destination , IP6_ADDR_LEN );
+		memcpy ( (void*) &val[IP6_ADDR_WORDS] , (void*) data->source , IP6_ADDR_LEN );
+		val[IP6_ADDR_WORDS*2] = (unsigned int) data->dport | ( (unsigned int) data->sport << 16 );
+	}
+
+	return sfhash ( val , sizeof ( val ) , seed );
+}
+
+/** @brief Toeplitz hash of the RSS input (source address, destination address, source port, destination port) **/
+inline static unsigned int tcp_toeplitz_hash ( pntoh_tcp_tuple5_t data , const unsigned char *key )
 {
-	#define ARRAY_SIZE	(IP6_ADDR_LEN*2)+2
-	unsigned int	val[ARRAY_SIZE] = {0};
-	size_t		len = ARRAY_SIZE;
+	unsigned char	input[IP6_ADDR_LEN * 2 + 4];
+	size_t		len = data->protocol == 4 ? 4 : IP6_ADDR_LEN;
+
+	/* addresses and ports are kept in network byte order */
+	memcpy ( input , data->source , len );
+	memcpy ( input + len , data->destination , len );
+	memcpy ( input + 2 * len , &data->sport , 2 );
+	memcpy ( input + 2 * len + 2 , &data->dport , 2 );
+
+	return toeplitz_hash ( key , input , 2 * len + 4 );
+}
 
+/** @brief Returns the key for the stream identified by 'data', the same one for both directions **/
+inline static ntoh_tcp_key_t tcp_getkey ( pntoh_tcp_session_t session , pntoh_tcp_tuple5_t data )
+{
 	if ( !data || !session )
 		return 0;
 
-	if ( data->protocol != IPPROTO_IPV6 )
-		len -= (IP6_ADDR_LEN - IP4_ADDR_LEN) * 2;
+	return tcp_symmetric_hash ( data , session->rand );
+}
+
+/** @brief API to hash a tuple5 **/
+unsigned int ntoh_tcp_hash_tuple ( pntoh_tcp_tuple5_t tuple , unsigned int function , unsigned int seed )
+{
+	if ( !tuple )
+		return 0;
+
+	switch ( function )
+	{
+		case NTOH_HASH_SYMMETRIC:
+			return tcp_symmetric_hash ( tuple , seed );
+
+		case NTOH_HASH_TOEPLITZ:
+			return tcp_toeplitz_hash ( tuple , rss_key );
+
+		case NTOH_HASH_TOEPLITZ_SYMMETRIC:
+			return tcp_toeplitz_hash ( tuple , rss_symmetric_key );
+	}
+
+	return 0;
+}
+
+/** @brief forward pointers of the skiplist levels **/
+#define SEGMENT_NEXT(seg,l)	( (l) == 0 ? &(seg)->next : &(seg)->skip[(l) - 1] )
+#define PEER_FIRST(peer,l)	( (l) == 0 ? &(peer)->segments : &(peer)->skip[(l) - 1] )
+
+/** @brief Random skiplist levels of a segment (one of each 4 segments goes up a level) **/
+inline static unsigned char segment_levels ( pntoh_tcp_segment_t segment )
+{
+	/* the pool address and the seq are random enough, the high bits of the product are the mixed ones */
+	unsigned int	h = ( (unsigned int) ( (unsigned long) segment >> 4 ) ^ (unsigned int) segment->seq ) * 0x9E3779B1;
+	unsigned char	levels = 1;
+
+	for ( h >>= 16 ; levels < DEFAULT_TCP_SEGMENT_LEVELS && ( h & 3 ) == 0 ; h >>= 2 )
+		levels++;
+
+	return levels;
+}
+
+/** @brief Inserts a segment into the peer queue, ordered by seq (segments with the same seq keep the arrival order) **/
+inline static int queue_segment ( pntoh_tcp_peer_t peer , pntoh_tcp_segment_t segment )
+{
+	pntoh_tcp_segment_t	*link[DEFAULT_TCP_SEGMENT_LEVELS];
+	pntoh_tcp_segment_t	prev = 0;
+	int			l;
+
+	if ( !peer )
+		return NTOH_OK;
+
+	/* last segment of each level with seq <= segment->seq */
+	for ( l = DEFAULT_TCP_SEGMENT_LEVELS - 1 ; l >= 0 ; l-- )
+	{
+		link[l] = prev != 0 ? SEGMENT_NEXT ( prev , l ) : PEER_FIRST ( peer , l );
+
+		while ( *link[l] != 0 && (*link[l])->seq <= segment->seq )
+		{
+			prev = *link[l];
+			link[l] = SEGMENT_NEXT ( prev , l );
+		}
+	}
+
+	/* its bytes (and flags) are already queued */
+	if ( prev != 0 && segment->payload_len > 0 && prev->seq + prev->payload_len >= segment->seq + segment->payload_len &&
+		! ( segment->flags & ~prev->flags & ( TH_FIN | TH_RST ) ) )
+		return NTOH_SEGMENT_DUPLICATED;
+
+	segment->levels = segment_levels ( segment );
+
+	for ( l = 0 ; l < segment->levels ; l++ )
+	{
+		*SEGMENT_NEXT ( segment , l ) = *link[l];
+		*link[l] = segment;
+	}
+
+	peer->totalwin -= segment->payload_len;
+	peer->queued += segment->payload_len;
+
+	return NTOH_OK;
+}
+
+/** @brief Unlinks the first queued segment of a peer **/
+inline static pntoh_tcp_segment_t pop_segment ( pntoh_tcp_peer_t peer )
+{
+	pntoh_tcp_segment_t	segment = peer->segments;
+	int			l;
+
+	if ( !segment )
+		return 0;
+
+	/* the first segment is the first one of all its levels */
+	for ( l = 0 ; l < segment->levels ; l++ )
+		*PEER_FIRST ( peer , l ) = *SEGMENT_NEXT ( segment , l );
+
+	peer->queued -= segment->payload_len;
+
+	return segment;
+}
+
+/** @brief Stores the payload of a segment in the buffer of its peer (NTOH_SESSION_STREAM_BUFFERS) **/
+inline static int buffer_store ( pntoh_tcp_peer_t peer , unsigned long seq , unsigned char *payload , size_t len )
+{
+	pntoh_tcp_buffer_t	buf = &peer->buffer;
+	unsigned long		end = seq + len;
+	unsigned char		*data = 0;
+	size_t			need , size;
+
+	/* first payload of this peer */
+	if ( !buf->end )
+		buf->base = buf->end = peer->next_seq;
+
+	/* retransmission of bytes already delivered */
+	if ( end <= buf->base )
+		return NTOH_OK;
+
+	if ( seq < buf->base )
+	{
+		payload += buf->base - seq;
+		seq = buf->base;
+	}
+
+	if ( buf->start + ( end - buf->base ) > buf->size )
+	{
+		/* move the bytes not delivered yet to the beginning */
+		if ( buf->end > buf->base )
+			memmove ( buf->data , buf->data + buf->start , buf->end - buf->base );
+		buf->start = 0;
+
+		if ( ( need = end - buf->base ) > buf->size )
+		{
+			if ( need > DEFAULT_TCP_BUFFER_MAX )
+				return NTOH_NO_WINDOW_SPACE_LEFT;
+
+			for ( size = buf->size > 0 ? buf->size : DEFAULT_TCP_BUFFER_SIZE ; size < need ; size <<= 1 );
+
+			if ( size > DEFAULT_TCP_BUFFER_MAX )
+				size = DEFAULT_TCP_BUFFER_MAX;
+
+			if ( ! ( data = (unsigned char*) realloc ( buf->data , size ) ) )
+				return NTOH_ERROR_NOMEM;
+
+			buf->data = data;
+			buf->size = size;
+		}
+	}
+
+	memcpy ( buf->data + buf->start + ( seq - buf->base ) , payload , end - seq );
+
+	if ( end > buf->end )
+		buf->end = end;
+
+	return NTOH_OK;
+}
+
+/** @brief Points the segment to its bytes not delivered yet **/
+inline static void buffer_range ( pntoh_tcp_peer_t peer , pntoh_tcp_segment_t segment )
+{
+	pntoh_tcp_buffer_t	buf = &peer->buffer;
+	unsigned long		seq = segment->seq;
+	unsigned long		end = segment->seq + segment->payload_len;
+
+	segment->data = 0;
+	segment->data_len = 0;
 
-	memcpy ( (void*) val , (void*)data->source , len );
-	val[len] = data->protocol;
-	memcpy ( (void*) &val[len] , (void*)data->destination , IP6_ADDR_LEN );
-	val[(len*2)+1] = data->sport | (data->dport << 16);
+	if ( !buf->data || end <= buf->base || end > buf->end )
+		return;
+
+	if ( seq < buf->base )
+		seq = buf->base;
+
+	segment->data = buf->data + buf->start + ( seq - buf->base );
+	segment->data_len = end - seq;
+}
+
+/** @brief Releases the bytes delivered with a segment (and those of a lost segment before it) **/
+inline static void buffer_consume ( pntoh_tcp_peer_t peer , pntoh_tcp_segment_t segment )
+{
+	pntoh_tcp_buffer_t	buf = &peer->buffer;
+	unsigned long		end = segment->seq + segment->payload_len;
+
+	if ( !buf->data || end <= buf->base || end > buf->end )
+		return;
 
-	return sfhash ( val , len , session->rand );
-/*
-	return (
-			( ( ( data->sport | (data->protocol & 0x0F) ) & 0xFF ) |
-			( ( ( data->dport | (data->protocol & 0xF0) ) & 0xFF ) << 8 ) |
-			( ( data->source & 0xFF ) << 16 ) |
-			( ( data->destination & 0xFF ) << 24 ) )
-		);*/
+	buf->start += end - buf->base;
+	buf->base = end;
+
+	if ( buf->base < buf->end )
+		return;
+
+	/* empty, a grown buffer goes back to the system */
+	buf->start = 0;
+	if ( buf->size > DEFAULT_TCP_BUFFER_SIZE )
+	{
+		free ( buf->data );
+		buf->data = 0;
+		buf->size = 0;
+	}
 }
 
 /** @brief Sends the given segment to the user **/
 inline static void send_single_segment ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stream , pntoh_tcp_peer_t origin , pntoh_tcp_peer_t destination , pntoh_tcp_segment_t segment , int reason , int extra )
 {
-	//send this segment
-	if ( extra != NTOH_REASON_OOO )
+	//send this segment, a retransmission overlapping new bytes moves the next seq too
+	if ( segment->seq + segment->payload_len > origin->next_seq )
 		origin->next_seq = segment->seq + segment->payload_len;
 
 	origin->totalwin += segment->payload_len;
@@ -117,10 +349,16 @@ inline static void send_single_segment ( pntoh_tcp_session_t session , pntoh_tcp
 		origin->next_seq++;
 	}
 
+	if ( session->flags & NTOH_SESSION_STREAM_BUFFERS )
+		buffer_range ( origin , segment );
+
 	if ( origin->receive )
 		((pntoh_tcp_callback_t) stream->function) ( stream , origin , destination , segment , reason , extra );
 
-	free ( segment );
+	if ( session->flags & NTOH_SESSION_STREAM_BUFFERS )
+		buffer_consume ( origin , segment );
+
+	pool_free ( &session->segment_pool , segment );
 
 	return;
 }
@@ -135,18 +373,189 @@ inline static void flush_peer_queues ( pntoh_tcp_session_t session , pntoh_tcp_s
 	for ( i = 0 ; i < 2 ; i++ )
 		while ( peers[i]->segments != 0 )
 		{
-			seg = peers[i]->segments;
+			seg = pop_segment ( peers[i] );
 			if (i == 0)
 				seg->origin = NTOH_SENT_BY_CLIENT;
 			else
 				seg->origin = NTOH_SENT_BY_SERVER;
 
-			peers[i]->segments = seg->next;
-
 			send_single_segment(session,stream,peers[i],peers[(i+1)%2] , seg , seg->payload_len > 0 ? NTOH_REASON_DATA : NTOH_REASON_SYNC , extra );
 		}
 }
 
+/** @brief Appends a stream to a session queue (LRU or TIME-WAIT) **/
+inline static void stream_queue_push ( pntoh_tcp_stream_t *head , pntoh_tcp_stream_t *tail , pntoh_tcp_stream_t stream )
+{
+	stream->next = 0;
+	stream->prev = *tail;
+
+	if ( *tail != 0 )
+		(*tail)->next = stream;
+	else
+		*head = stream;
+
+	*tail = stream;
+
+	return;
+}
+
+/** @brief Unlinks a stream from a session queue (LRU or TIME-WAIT) **/
+inline static void stream_queue_unlink ( pntoh_tcp_stream_t *head , pntoh_tcp_stream_t *tail , pntoh_tcp_stream_t stream )
+{
+	if ( stream->prev != 0 )
+		stream->prev->next = stream->next;
+	else
+		*head = stream->next;
+
+	if ( stream->next != 0 )
+		stream->next->prev = stream->prev;
+	else
+		*tail = stream->prev;
+
+	stream->next = stream->prev = 0;
+
+	return;
+}
+
+/** @brief Marks a stream as the most recently used one, the session must be locked **/
+inline static void touch_stream ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stream )
+{
+	/* the order only matters to the eviction policies */
+	if ( ! ( session->flags & NTOH_SESSION_ADMISSION_MASK ) || session->lru_tail == stream )
+		return;
+
+	stream_queue_unlink ( &session->lru_head , &session->lru_tail , stream );
+	stream_queue_push ( &session->lru_head , &session->lru_tail , stream );
+
+	return;
+}
+
+/** @brief Allocates an empty lookup index of at least 'size' buckets **/
+inline static pntoh_tcp_index_t new_index ( size_t size )
+{
+	pntoh_tcp_index_t	ret = 0;
+	size_t			buckets = 1;
+
+	for ( ; buckets < size ; buckets <<= 1 );
+
+	if ( ( ret = (pntoh_tcp_index_t) calloc ( 1 , sizeof ( ntoh_tcp_index_t ) + buckets * sizeof ( pntoh_tcp_stream_t ) ) ) != 0 )
+		ret->mask = buckets - 1;
+
+	return ret;
+}
+
+/**
+ * @brief Moves the streams of the lookup index to a new one of 'size' buckets, the session must be locked
+ *
+ * The streams are relinked all at once, index_seq being odd meanwhile so the lookups missing a stream
+ * take the session lock. The old index is freed once no reader can reach it (see reclaim_streams).
+ */
+inline static void resize_index ( pntoh_tcp_session_t session , size_t size )
+{
+	pntoh_tcp_index_t	old = session->index;
+	pntoh_tcp_index_t	index = 0;
+	pntoh_tcp_stream_t	item = 0;
+	pntoh_tcp_stream_t	next = 0;
+	pntoh_tcp_stream_t	*link = 0;
+	unsigned int		i;
+
+	/* without memory the current index is kept, just with longer chains */
+	if ( old == 0 || ( index = new_index ( size ) ) == 0 )
+		return;
+
+	if ( index->mask == old->mask )
+	{
+		free ( index );
+		return;
+	}
+
+	/* the readers seeing a relinked stream see the odd sequence too */
+	__atomic_store_n ( &session->index_seq , session->index_seq + 1 , __ATOMIC_RELAXED );
+	__atomic_thread_fence ( __ATOMIC_RELEASE );
+
+	/* each bucket keeps its order (same order as the chained tables) */
+	for ( i = 0 ; i <= old->mask ; i++ )
+		for ( item = old->buckets[i] ; item != 0 ; item = next )
+		{
+			next = item->hnext;
+
+			for ( link = &index->buckets[item->key & index->mask] ; *link != 0 ; link = &(*link)->hnext );
+
+			__atomic_store_n ( &item->hnext , 0 , __ATOMIC_RELEASE );
+			__atomic_store_n ( link , item , __ATOMIC_RELEASE );
+		}
+
+	__atomic_store_n ( &session->index , index , __ATOMIC_RELEASE );
+	__atomic_store_n ( &session->index_seq , session->index_seq + 1 , __ATOMIC_RELEASE );
+
+	old->retired = epoch_retire();
+	old->next = session->retired_index;
+	session->retired_index = old;
+
+	return;
+}
+
+/** @brief Links a stream at the end of its bucket of the lookup index (same order as the chained tables), the session must be locked **/
+inline static void index_insert ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stream )
+{
+	pntoh_tcp_stream_t *link = 0;
+
+	if ( !session->index )
+		return;
+
+	for ( link = &session->index->buckets[stream->key & session->index->mask] ; *link != 0 ; link = &(*link)->hnext );
+
+	/* published once initialized, the readers do not take the session lock */
+	stream->hnext = 0;
+	__atomic_store_n ( link , stream , __ATOMIC_RELEASE );
+
+	return;
+}
+
+/** @brief Unlinks a stream from the lookup index, the session must be locked. Its own link is kept for the readers walking it **/
+inline static void index_remove ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stream )
+{
+	pntoh_tcp_stream_t *link = 0;
+
+	if ( !session->index )
+		return;
+
+	for ( link = &session->index->buckets[stream->key & session->index->mask] ; *link != 0 ; link = &(*link)->hnext )
+		if ( *link == stream )
+		{
+			__atomic_store_n ( link , stream->hnext , __ATOMIC_RELEASE );
+			break;
+		}
+
+	return;
+}
+
+/** @brief Gives back to the pool the released streams (and frees the replaced indexes) no reader can reach anymore, the session must be locked **/
+inline static void reclaim_streams ( pntoh_tcp_session_t session )
+{
+	pntoh_tcp_stream_t item = 0;
+	pntoh_tcp_index_t index = 0;
+	pntoh_tcp_index_t *link = 0;
+
+	while ( ( item = session->retired_head ) != 0 && epoch_expired ( item->retired ) )
+	{
+		stream_queue_unlink ( &session->retired_head , &session->retired_tail , item );
+		free_lockaccess ( item->lock );
+		pool_free ( &session->stream_pool , item );
+	}
+
+	for ( link = &session->retired_index ; *link != 0 && ! epoch_expired ( (*link)->retired ) ; link = &(*link)->next );
+
+	/* the newest index goes first, so the ones after an expired index have expired too */
+	while ( ( index = *link ) != 0 )
+	{
+		*link = index->next;
+		free ( index );
+	}
+
+	return;
+}
+
 /** @brief Remove the stream from the session streams hash table, and notify the user **/
 inline static void delete_stream ( pntoh_tcp_session_t session , pntoh_tcp_stream_t *stream , int reason , int extra )
 {
@@ -157,15 +566,18 @@ inline static void delete_stream ( pntoh_tcp_session_t session , pntoh_tcp_strea
 
 	item = *stream;
 
-	if ( session->streams != 0 && htable_find ( session->streams, item->key, 0 ) != 0 )
+	twheel_del ( &session->timers , &item->timer );
+
+	if ( session->streams != 0 && htable_remove ( session->streams , item->key , &item->tuple ) != 0 )
 	{
-		htable_remove ( session->streams , item->key, 0);
+		index_remove ( session , item );
+		stream_queue_unlink ( &session->lru_head , &session->lru_tail , item );
 		sem_post ( &session->max_streams );
 	}
 
-	if ( session->timewait != 0 && htable_find ( session->timewait, item->key, 0 ) != 0 )
+	if ( session->timewait != 0 && htable_remove ( session->timewait , item->key , &item->tuple ) != 0 )
 	{
-		htable_remove ( session->timewait , item->key, 0 );
+		stream_queue_unlink ( &session->timewait_head , &session->timewait_tail , item );
 		sem_post ( &session->max_timewait );
 	}
 
@@ -187,9 +599,23 @@ inline static void delete_stream ( pntoh_tcp_session_t session , pntoh_tcp_strea
 	if ( item->client.receive )
 		((pntoh_tcp_callback_t)item->function)(item,&item->client, &item->server,0, reason , extra );
 
-	free_lockaccess ( &item->lock );
+	free ( item->client.buffer.data );
+	free ( item->server.buffer.data );
+
+	/* locked by the caller, it is released unlocked */
+	unlock_access ( item->lock );
+
+	/* the lock-free lookups may still be walking it (and its lock) */
+	if ( session->index != 0 )
+	{
+		item->retired = epoch_retire();
+		stream_queue_push ( &session->retired_head , &session->retired_tail , item );
+		reclaim_streams ( session );
+	}else{
+		free_lockaccess ( item->lock );
+		pool_free ( &session->stream_pool , item );
+	}
 
-	free ( item );
 	*stream = 0;
 
 	return;
@@ -209,7 +635,7 @@ inline static void __tcp_free_session ( pntoh_tcp_session_t session )
 {
 	pntoh_tcp_session_t	ptr = 0;
 	pntoh_tcp_stream_t 	item = 0;
-	ntoh_tcp_key_t		first = 0;
+	pntoh_tcp_index_t	index = 0;
 
 	if ( params.sessions_list == session )
 		params.sessions_list = session->next;
@@ -219,26 +645,34 @@ inline static void __tcp_free_session ( pntoh_tcp_session_t session )
 			ptr->next = session->next;
 	}
 
+	/* no check can be running from here on */
+	timers_unregister ( &session->timer );
+
 	lock_access( &session->lock );
 
-	while ( ( first = htable_first ( session->timewait ) ) != 0 )
+	/* both walks are linear, delete_stream removes each stream from its table and queue */
+	while ( ( item = session->timewait_head ) != 0 )
 	{
-		item = (pntoh_tcp_stream_t)htable_remove(session->timewait,first,0);
-		lock_access ( &item->lock );
+		lock_access ( item->lock );
 		__tcp_free_stream ( session , &item , NTOH_REASON_SYNC , NTOH_REASON_EXIT );
 	}
 
-	while ( ( first = htable_first ( session->streams ) ) != 0 )
+	while ( ( item = session->lru_head ) != 0 )
 	{
-		item = (pntoh_tcp_stream_t)htable_remove(session->streams,first, 0);
-		lock_access ( &item->lock );
+		lock_access ( item->lock );
 		__tcp_free_stream ( session , &item , NTOH_REASON_SYNC , NTOH_REASON_EXIT );
 	}
 
+	/* no reader is left, the retired streams only keep their locks */
+	while ( ( item = session->retired_head ) != 0 )
+	{
+		stream_queue_unlink ( &session->retired_head , &session->retired_tail , item );
+		free_lockaccess ( item->lock );
+	}
+
 	unlock_access( &session->lock );
 
-	pthread_cancel ( session->tID );
-	pthread_join ( session->tID , 0 );
+	twheel_free ( &session->timers );
 	sem_destroy ( &session->max_streams );
 	sem_destroy ( &session->max_timewait );
 
@@ -246,124 +680,123 @@ inline static void __tcp_free_session ( pntoh_tcp_session_t session )
 
 	htable_destroy ( &session->streams );
 	htable_destroy ( &session->timewait );
+	free ( session->index );
+	while ( ( index = session->retired_index ) != 0 )
+	{
+		session->retired_index = index->next;
+		free ( index );
+	}
+	free ( session->halfopen );
+
+	pool_destroy ( &session->stream_pool );
+	pool_destroy ( &session->segment_pool );
+	pool_destroy ( &session->node_pool );
 
 	free ( session );
 
 	return;
 }
 
-inline static void tcp_check_timeouts ( pntoh_tcp_session_t session )
+/** @brief Absolute time (seconds) when a stream times out in its current status, 0 if it does not **/
+inline static unsigned long tcp_stream_deadline ( pntoh_tcp_stream_t stream )
 {
 	#define IS_FINWAIT2(peer,side) (peer.status == NTOH_STATUS_FINWAIT2 || side.status == NTOH_STATUS_FINWAIT2 )
 
-	struct timeval		tv = { 0 , 0 };
-	unsigned int		val = 0;
-	unsigned int		i = 0;
-	unsigned short		timedout = 0;
-	pntoh_tcp_stream_t	item;
-	phtnode_t		node = 0;
-	phtnode_t		prev = 0;
-
-	lock_access( &session->lock );
+	unsigned int timeout = 0;
 
-	/* iterating manually between flows */
-	for ( i = 0 ; i < session->streams->table_size ; i++ )
+	switch ( stream->status )
 	{
-		node = prev = session->streams->table[i];
-		while ( node != 0 )
-		{
-			timedout = 0;
-			gettimeofday ( &tv , 0 );
-			item = (pntoh_tcp_stream_t) node->val;
-			val = tv.tv_sec - item->last_activ.tv_sec;
+		case NTOH_STATUS_SYNSENT:
+			if ( stream->enable_check_timeout & NTOH_CHECK_TCP_SYNSENT_TIMEOUT )// @contrib: di3online - https://github.com/di3online
+				timeout = DEFAULT_TCP_SYNSENT_TIMEOUT;
+			break;
 
-			switch ( item->status )
-			{
-				case NTOH_STATUS_SYNSENT:
-					if ( (item->enable_check_timeout & NTOH_CHECK_TCP_SYNSENT_TIMEOUT) && (val > DEFAULT_TCP_SYNSENT_TIMEOUT) )// @contrib: di3online - https://github.com/di3online
-						timedout = 1;
-					break;
-
-				case NTOH_STATUS_SYNRCV:
-					if ( (item->enable_check_timeout & NTOH_CHECK_TCP_SYNRCV_TIMEOUT) && (val > DEFAULT_TCP_SYNRCV_TIMEOUT) )// @contrib: di3online - https://github.com/di3online
-						timedout = 1;
-					break;
-
-				case NTOH_STATUS_ESTABLISHED:
-					if ( (item->enable_check_timeout & NTOH_CHECK_TCP_ESTABLISHED_TIMEOUT) && (val > DEFAULT_TCP_ESTABLISHED_TIMEOUT) )// @contrib: di3online - https://github.com/di3online
-						timedout = 1;
-					break;
-
-				case NTOH_STATUS_CLOSING:
-					if ( IS_FINWAIT2(item->client,item->server) && (item->enable_check_timeout & NTOH_CHECK_TCP_FINWAIT2_TIMEOUT) && (val < DEFAULT_TCP_FINWAIT2_TIMEOUT) )// @contrib: di3online - https://github.com/di3online
-						timedout = 1;
-					else if ( IS_TIMEWAIT(item->client,item->server) && (item->enable_check_timeout & NTOH_CHECK_TCP_TIMEWAIT_TIMEOUT) &&  val < DEFAULT_TCP_TIMEWAIT_TIMEOUT )// @contrib: di3online - https://github.com/di3online
-						timedout = 1;
-					break;
-			}
+		case NTOH_STATUS_SYNRCV:
+			if ( stream->enable_check_timeout & NTOH_CHECK_TCP_SYNRCV_TIMEOUT )// @contrib: di3online - https://github.com/di3online
+				timeout = DEFAULT_TCP_SYNRCV_TIMEOUT;
+			break;
 
-			/* timeout expired */
-			if ( timedout )
-			{
-				lock_access ( &item->lock );
-				__tcp_free_stream ( session , &item , NTOH_REASON_SYNC , NTOH_REASON_TIMEDOUT );
-				// @contrib: Eosis - https://github.com/Eosis
-				if (node != prev)
-					node = prev;
-				else
-					node = 0;
-			}else{
-				prev = node;
-				node = node->next;
-			}
-		}
+		case NTOH_STATUS_ESTABLISHED:
+			if ( stream->enable_check_timeout & NTOH_CHECK_TCP_ESTABLISHED_TIMEOUT )// @contrib: di3online - https://github.com/di3online
+				timeout = DEFAULT_TCP_ESTABLISHED_TIMEOUT;
+			break;
+
+		case NTOH_STATUS_CLOSING:
+			if ( IS_FINWAIT2(stream->client,stream->server) && (stream->enable_check_timeout & NTOH_CHECK_TCP_FINWAIT2_TIMEOUT) )// @contrib: di3online - https://github.com/di3online
+				timeout = DEFAULT_TCP_FINWAIT2_TIMEOUT;
+			else if ( IS_TIMEWAIT(stream->client,stream->server) && (stream->enable_check_timeout & NTOH_CHECK_TCP_TIMEWAIT_TIMEOUT) )// @contrib: di3online - https://github.com/di3online
+				timeout = DEFAULT_TCP_TIMEWAIT_TIMEOUT;
+			break;
 	}
 
-	/* handly iterates between flows */
-	for ( i = 0 ; i < session->timewait->table_size ; i++ )
+	if ( ! timeout )
+		return 0;
+
+	/* idle for more than 'timeout' seconds */
+	return stream->last_activ.tv_sec + timeout + 1;
+}
+
+/**
+ * @brief Expires the timed out streams
+ *
+ * Streams are queued in the session timer wheel when created, and the deadline is not
+ * updated on each segment. When a timer fires, the real deadline is computed from the
+ * last activity and the current status, and the stream is queued again if still alive.
+ * At most DEFAULT_TCP_EXPIRE_BATCH streams are handled while holding the session lock.
+ *
+ * Up to 'max' timers due at 'now' are handled (all of them if 'max' is 0), returns how many.
+ */
+inline static unsigned int tcp_expire_timers ( pntoh_tcp_session_t session , unsigned long now , unsigned int max )
+{
+	unsigned long		deadline = 0;
+	unsigned int		count = 0;
+	unsigned int		total = 0;
+	ptwentry_t		timer;
+	pntoh_tcp_stream_t	item;
+
+	do
 	{
-		node = prev = session->timewait->table[i];
-		while ( node != 0 )
-		{
-			item = (pntoh_tcp_stream_t) node->val;
+		lock_access( &session->lock );
 
-			gettimeofday ( &tv , 0 );
-			val = tv.tv_sec - item->last_activ.tv_sec;
+		reclaim_streams ( session );
 
-			if ( (item->enable_check_timeout & NTOH_CHECK_TCP_TIMEWAIT_TIMEOUT) && val > DEFAULT_TCP_TIMEWAIT_TIMEOUT )// @contrib: di3online - https://github.com/di3online
-			{
-				lock_access ( &item->lock );
+		for ( count = 0 ; count < DEFAULT_TCP_EXPIRE_BATCH && ( !max || total < max ) && ( timer = twheel_expire ( &session->timers , now ) ) != 0 ; count++ , total++ )
+		{
+			item = TWHEEL_ITEM ( timer , ntoh_tcp_stream_t , timer );
+
+			if ( ( deadline = tcp_stream_deadline ( item ) ) > now )
+				twheel_add ( &session->timers , timer , deadline );
+			/* a stream being fed right now is checked again in a second (never wait for it holding the session lock) */
+			else if ( deadline != 0 && !trylock_access ( item->lock ) )
+				twheel_add ( &session->timers , timer , now + 1 );
+			else if ( deadline != 0 )
 				__tcp_free_stream ( session , &item , NTOH_REASON_SYNC , NTOH_REASON_TIMEDOUT );
-				if (node != prev)
-					node = prev;
-				else
-					node = 0;
-			}else{
-				prev = node;
-				node = node->next;
-			}
+			/* no timeout in this status, check again later (status may change) */
+			else if ( item->enable_check_timeout )
+				twheel_add ( &session->timers , timer , now + DEFAULT_TCP_SYNSENT_TIMEOUT );
 		}
-	}
 
-	unlock_access( &session->lock );
+		unlock_access( &session->lock );
+	}while ( count == DEFAULT_TCP_EXPIRE_BATCH && ( !max || total < max ) );
 
-	return;
+	return total;
 }
 
-static void *timeouts_thread ( void *p )
+/* expires everything due at the current time of the session */
+inline static void tcp_check_timeouts ( pntoh_tcp_session_t session )
 {
-	pthread_setcanceltype( PTHREAD_CANCEL_DEFERRED, 0 );
+	struct timeval tv = { 0 , 0 };
 
-	while ( 1 )
-	{
-		tcp_check_timeouts( (pntoh_tcp_session_t) p );
-		pthread_testcancel();
-		poll ( 0 , 0 , DEFAULT_TIMEOUT_DELAY );
-	}
+	get_session_time ( session->flags , &session->clock , &tv );
+	tcp_expire_timers ( session , tv.tv_sec , 0 );
 
-	pthread_exit( 0 );
-	//dummy return
-	return 0;
+	return;
+}
+
+/* timer service check */
+static void timeouts_check ( void *p )
+{
+	tcp_check_timeouts( (pntoh_tcp_session_t) p );
 }
 
 /** @brief API to get a tuple5 **/
@@ -405,15 +838,24 @@ unsigned int ntoh_tcp_get_tuple5 ( void *ip , struct tcphdr *tcp , pntoh_tcp_tup
 
 unsigned short tcp_equal_tuple ( void *a , void *b )
 {
-	unsigned short ret = 0;
+	pntoh_tcp_tuple5_t	tuple = (pntoh_tcp_tuple5_t) a;
+	pntoh_tcp_tuple5_t	other = &((pntoh_tcp_stream_t)b)->tuple;
+
+	if ( tuple->protocol != other->protocol )
+		return 0;
 
-        if ( ! memcmp ( a , (void*)&((pntoh_tcp_stream_t)b)->tuple , sizeof ( ntoh_tcp_tuple5_t ) ) )
-                ret++;
+	/* field by field, the padding of the tuple given by the user is not initialized */
+	if ( tuple->sport == other->sport && tuple->dport == other->dport &&
+		! memcmp ( tuple->source , other->source , IP6_ADDR_LEN ) &&
+		! memcmp ( tuple->destination , other->destination , IP6_ADDR_LEN ) )
+		return 1;
 
-	return ret;
+	/* the keys are symmetric, both directions share the bucket */
+	return	tuple->sport == other->dport && tuple->dport == other->sport &&
+		! memcmp ( tuple->source , other->destination , IP6_ADDR_LEN ) &&
+		! memcmp ( tuple->destination , other->source , IP6_ADDR_LEN );
 }
 
-
 /** @brief API to get the size of the sessions table (max allowed streams) **/
 unsigned int ntoh_tcp_get_size ( pntoh_tcp_session_t session )
 {
@@ -432,13 +874,21 @@ unsigned int ntoh_tcp_get_size ( pntoh_tcp_session_t session )
 /** @brief API to create a new session and add it to the global sessions list **/
 pntoh_tcp_session_t ntoh_tcp_new_session ( unsigned int max_streams , unsigned int max_timewait , unsigned int *error )
 {
-	pntoh_tcp_session_t session;
+	return ntoh_tcp_new_session_ex ( max_streams , max_timewait , NTOH_SESSION_DEFAULT , error );
+}
+
+/** @brief API to create a new session with the given flags and add it to the global sessions list **/
+pntoh_tcp_session_t ntoh_tcp_new_session_ex ( unsigned int max_streams , unsigned int max_timewait , unsigned int flags , unsigned int *error )
+{
+	pntoh_tcp_session_t	session;
+	struct timeval		tv = { 0 , 0 };
 
 	if ( !max_streams )
 		max_streams = DEFAULT_TCP_MAX_STREAMS;
 
-	if ( !max_timewait )
-		max_timewait = DEFAULT_TCP_MAX_TIMEWAIT_STREAMS(max_streams);
+	/* at least one TIME-WAIT slot, small sessions would get an empty table */
+	if ( !max_timewait && ! ( max_timewait = DEFAULT_TCP_MAX_TIMEWAIT_STREAMS(max_streams) ) )
+		max_timewait = 1;
 
 	if ( ! (session = (pntoh_tcp_session_t) calloc ( 1 , sizeof ( ntoh_tcp_session_t ) ) ) )
 	{
@@ -449,15 +899,50 @@ pntoh_tcp_session_t ntoh_tcp_new_session ( unsigned int max_streams , unsigned i
 
 	ntoh_tcp_init();
 
-	session->streams = htable_map ( max_streams , &tcp_equal_tuple );
-	session->timewait = htable_map ( max_timewait , &tcp_equal_tuple );
+	session->flags = flags;
+	get_session_time ( flags , &session->clock , &tv );
+
+	if ( ! twheel_init ( &session->timers , DEFAULT_TWHEEL_SLOTS , tv.tv_sec ) )
+	{
+		free ( session );
+		if ( error != 0 )
+			*error = NTOH_ERROR_NOMEM;
+		return 0;
+	}
+
+	if ( flags & NTOH_SESSION_HALFOPEN_TABLE )
+	{
+		for ( session->halfopen_mask = DEFAULT_TCP_HALFOPEN_WAYS ; session->halfopen_mask < DEFAULT_TCP_HALFOPEN_ENTRIES(max_streams) ; session->halfopen_mask <<= 1 );
+
+		if ( ! ( session->halfopen = (pntoh_tcp_halfopen_t) calloc ( session->halfopen_mask , sizeof ( ntoh_tcp_halfopen_t ) ) ) )
+		{
+			twheel_free ( &session->timers );
+			free ( session );
+			if ( error != 0 )
+				*error = NTOH_ERROR_NOMEM;
+			return 0;
+		}
+
+		session->halfopen_mask--;
+	}
+
+	/* without the index, the lookups just take the session lock */
+	if ( LOCK_MODE(flags) != LOCK_NONE )
+		session->index = new_index ( max_streams );
+
+	/* the pools grow on demand, preallocation is just a hint */
+	pool_init ( &session->stream_pool , sizeof ( ntoh_tcp_stream_t ) + ( LOCK_MODE(flags) != LOCK_NONE ? sizeof ( ntoh_lock_t ) : 0 ) , DEFAULT_TCP_POOL_PREALLOC(max_streams) , LOCK_MODE(flags) );
+	pool_init ( &session->segment_pool , sizeof ( ntoh_tcp_segment_t ) , DEFAULT_TCP_POOL_SEGMENTS * DEFAULT_TCP_POOL_PREALLOC(max_streams) , LOCK_MODE(flags) );
+	pool_init ( &session->node_pool , sizeof ( htnode_t ) , HTABLE_ENGINE(flags) == HTABLE_CHAINED ? DEFAULT_TCP_POOL_PREALLOC(max_streams) : 0 , LOCK_MODE(flags) );
+
+	session->streams = htable_map ( max_streams , &tcp_equal_tuple , HTABLE_ENGINE(flags) );
+	session->timewait = htable_map ( max_timewait , &tcp_equal_tuple , HTABLE_ENGINE(flags) );
+	session->streams->pool = session->timewait->pool = &session->node_pool;
 
 	sem_init ( &session->max_streams , 0 , max_streams );
 	sem_init ( &session->max_timewait , 0 , max_timewait );
 
-	session->lock.use = 0;
-	pthread_mutex_init( &session->lock.mutex, 0 );
-	pthread_cond_init( &session->lock.pcond, 0 );
+	init_lockaccess ( &session->lock , LOCK_MODE(flags) );
 
 	srand((int)time(NULL));
 
@@ -475,7 +960,9 @@ pntoh_tcp_session_t ntoh_tcp_new_session ( unsigned int max_streams , unsigned i
 	if ( error != 0 )
 		*error = NTOH_OK;
 
-	pthread_create ( &session->tID , 0 , timeouts_thread , (void*) session );
+	/* timeouts are checked by ntoh_tcp_set_time / ntoh_tcp_tick */
+	if ( ! ( flags & ( NTOH_SESSION_CALLER_CLOCK | NTOH_SESSION_MANUAL_TIMERS ) ) && LOCK_MODE(flags) != LOCK_NONE )
+		timers_register ( &session->timer , timeouts_check , (void*) session , DEFAULT_TIMEOUT_DELAY );
 
 	return session;
 }
@@ -504,7 +991,7 @@ void ntoh_tcp_free_stream ( pntoh_tcp_session_t session , pntoh_tcp_stream_t *st
 
 	lock_access( &session->lock );
 
-	lock_access( &(*stream)->lock );
+	lock_access( (*stream)->lock );
 	__tcp_free_stream ( session , stream , reason ,extra );
 
 	unlock_access(&session->lock);
@@ -538,73 +1025,236 @@ void ntoh_tcp_init ( void )
 	if ( params.init )
 		return;
 
-	params.lock.use = 0;
-	pthread_mutex_init( &params.lock.mutex, 0 );
-	pthread_cond_init( &params.lock.pcond, 0 );
+	init_lockaccess ( &params.lock , LOCK_CONDVAR );
 
 	params.init = 1;
 
 	return;
 }
 
+/** @brief Looks for the stream of 'tuple5' in both directions (single lookup, the key is symmetric), the session must be locked **/
+inline static pntoh_tcp_stream_t lookup_stream ( pntoh_tcp_session_t session , pntoh_tcp_tuple5_t tuple5 )
+{
+	pntoh_tcp_stream_t ret = (pntoh_tcp_stream_t) htable_find ( session->streams , tcp_getkey( session , tuple5 ) , tuple5 );
+
+	if ( ret != 0 )
+		touch_stream ( session , ret );
+
+	return ret;
+}
+
+/** @brief Looks for the stream of 'tuple5' in a lookup index, the caller must be in a read section (see ntoh_epoch_enter) **/
+inline static pntoh_tcp_stream_t index_find ( pntoh_tcp_index_t index , ntoh_tcp_key_t key , pntoh_tcp_tuple5_t tuple5 )
+{
+	pntoh_tcp_stream_t item = __atomic_load_n ( &index->buckets[key & index->mask] , __ATOMIC_ACQUIRE );
+
+	for ( ; item != 0 ; item = __atomic_load_n ( &item->hnext , __ATOMIC_ACQUIRE ) )
+		if ( item->key == key && tcp_equal_tuple ( tuple5 , item ) )
+			break;
+
+	return item;
+}
+
+/** @brief Payload bytes held by a stream (queued segments and undelivered buffered bytes) **/
+inline static unsigned long stream_held_bytes ( pntoh_tcp_stream_t stream )
+{
+	return stream->client.queued + stream->server.queued + ( stream->client.buffer.end - stream->client.buffer.base ) + ( stream->server.buffer.end - stream->server.buffer.base );
+}
+
+/** @brief Locks a stream to release it, unless it is in use or pinned by a burst (trylock_access always succeeds with NTOH_SESSION_LOCK_NONE) **/
+inline static int grab_stream ( pntoh_tcp_stream_t stream )
+{
+	if ( ! trylock_access ( stream->lock ) )
+		return 0;
+
+	if ( stream->pinned )
+	{
+		unlock_access ( stream->lock );
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Releases a stream following the admission policy of the session, the session must be locked
+ *
+ * Only the DEFAULT_TCP_EVICT_SCAN least recently used streams are candidates. They are taken with
+ * grab_stream, so the streams in use (by other threads or by the current burst) are skipped.
+ */
+inline static int evict_stream ( pntoh_tcp_session_t session )
+{
+	unsigned int		policy = session->flags & NTOH_SESSION_ADMISSION_MASK;
+	pntoh_tcp_stream_t	item = 0;
+	pntoh_tcp_stream_t	victim = 0;
+	unsigned long		held = 0;
+	unsigned int		i;
+
+	if ( policy == NTOH_SESSION_ADMIT_REJECT )
+		return 0;
+
+	for ( item = session->lru_head , i = 0 ; item != 0 && i < DEFAULT_TCP_EVICT_SCAN ; item = item->next , i++ )
+	{
+		if ( ! grab_stream ( item ) )
+			continue;
+
+		/* the first one is the LRU one, and the fallback of the other policies */
+		if ( victim == 0 )
+		{
+			victim = item;
+			held = stream_held_bytes ( item );
+
+			if ( policy == NTOH_SESSION_EVICT_LRU || ( policy == NTOH_SESSION_EVICT_HALFOPEN && item->status < NTOH_STATUS_ESTABLISHED ) )
+				break;
+
+			continue;
+		}
+
+		if ( ( policy == NTOH_SESSION_EVICT_HALFOPEN && item->status < NTOH_STATUS_ESTABLISHED ) ||
+			( policy == NTOH_SESSION_EVICT_BUFFERED && stream_held_bytes ( item ) > held ) )
+		{
+			unlock_access ( victim->lock );
+			victim = item;
+			held = stream_held_bytes ( item );
+
+			if ( policy == NTOH_SESSION_EVICT_HALFOPEN )
+				break;
+		}else
+			unlock_access ( item->lock );
+	}
+
+	if ( victim == 0 )
+		return 0;
+
+	__tcp_free_stream ( session , &victim , NTOH_REASON_SYNC , NTOH_REASON_EVICTED );
+
+	return 1;
+}
+
 /** @brief API to look for a TCP stream identified by 'tuple5' **/
 pntoh_tcp_stream_t ntoh_tcp_find_stream ( pntoh_tcp_session_t session , pntoh_tcp_tuple5_t tuple5 )
 {
-	ntoh_tcp_key_t		key = 0;
-	ntoh_tcp_tuple5_t	tuplerev = {{0},{0},0};
 	pntoh_tcp_stream_t	ret = 0;
-	unsigned int		i;
+	unsigned long		seq = 0;
 
 	if ( !session || !tuple5 )
 		return ret;
 
-	key = tcp_getkey( session , tuple5 );
-
-	lock_access( &session->lock );
-
-	if ( ! ( ret = (pntoh_tcp_stream_t) htable_find ( session->streams , key , 0) ) )
+	/* lock-free, the released streams (and replaced indexes) are not reused until the read section ends */
+	if ( __atomic_load_n ( &session->index , __ATOMIC_RELAXED ) != 0 && ntoh_epoch_enter() == NTOH_OK )
 	{
-		for ( i = 0 ; i < IP6_ADDR_LEN ; i++ )
+		seq = __atomic_load_n ( &session->index_seq , __ATOMIC_ACQUIRE );
+		ret = index_find ( __atomic_load_n ( &session->index , __ATOMIC_ACQUIRE ) , tcp_getkey ( session , tuple5 ) , tuple5 );
+
+		/* a miss is only trusted if the index was not being replaced meanwhile */
+		if ( ret != 0 || ( ! ( seq & 1 ) && __atomic_load_n ( &session->index_seq , __ATOMIC_ACQUIRE ) == seq ) )
 		{
-			tuplerev.destination[i] = tuple5->source[i];
-			tuplerev.source[i] = tuple5->destination[i];
+			ntoh_epoch_exit();
+			return ret;
 		}
 
-		tuplerev.sport = tuple5->dport;
-		tuplerev.dport = tuple5->sport;
-		tuplerev.protocol = tuple5->protocol;
+		ntoh_epoch_exit();
+	}
 
-		key = tcp_getkey( session , &tuplerev );
+	lock_access( &session->lock );
 
-		ret = (pntoh_tcp_stream_t) htable_find ( session->streams , key , 0);
-	}
+	ret = lookup_stream ( session , tuple5 );
 
 	unlock_access( &session->lock );
 
 	return ret;
 }
 
-/** @brief API to create a new TCP stream and add it to the given session **/
-pntoh_tcp_stream_t ntoh_tcp_new_stream ( pntoh_tcp_session_t session , pntoh_tcp_tuple5_t tuple5 , pntoh_tcp_callback_t function ,void *udata , unsigned int *error, unsigned short enable_check_timeout, unsigned short enable_check_nowindow )
+/** @brief Creates a new TCP stream and inserts it into the session, the session must be locked **/
+inline static pntoh_tcp_stream_t create_stream ( pntoh_tcp_session_t session , pntoh_tcp_tuple5_t tuple5 , pntoh_tcp_callback_t function ,void *udata , unsigned int *error, unsigned short enable_check_timeout, unsigned short enable_check_nowindow )
 {
 	pntoh_tcp_stream_t	stream = 0;
 	ntoh_tcp_key_t		key = 0;
 	unsigned int		i;
 
-	if ( error != 0 )
-		*error = 0;
+	if ( !(key = tcp_getkey( session , tuple5 )) )
+	{
+		*error = NTOH_ERROR_NOKEY;
+		return 0;
+	}
 
-	if ( !session )
+	/* with an eviction policy, a stream is released to make room for the new one */
+	if ( sem_trywait( &session->max_streams ) != 0 && ( ! evict_stream ( session ) || sem_trywait ( &session->max_streams ) != 0 ) )
 	{
-		if ( error != 0 )
-			*error = NTOH_ERROR_PARAMS;
+		*error = NTOH_ERROR_NOSPACE;
 		return 0;
 	}
 
-	if ( !(key = tcp_getkey( session , tuple5 )) )
+	if ( !( stream = (pntoh_tcp_stream_t) pool_alloc ( &session->stream_pool ) ) )
+	{
+		sem_post ( &session->max_streams );
+		*error = NTOH_ERROR_NOMEM;
+		return 0;
+	}
+
+	memcpy( (void*)&( stream->tuple ), (void*)tuple5, sizeof(ntoh_tcp_tuple5_t) );
+	stream->key = key;
+
+	for ( i = 0 ; i < IP6_ADDR_WORDS ; i++ )
+	{
+		stream->client.addr[i] = stream->tuple.source[i];
+		stream->server.addr[i] = stream->tuple.destination[i];
+	}
+
+	stream->client.port = stream->tuple.sport;
+	stream->server.port = stream->tuple.dport;
+	stream->client.receive = 1;
+	stream->server.receive = 1;
+
+	get_session_time ( session->flags , &session->clock , &stream->last_activ );
+	stream->status = stream->client.status = stream->server.status = NTOH_STATUS_CLOSED;
+	stream->function = (void*) function;
+	stream->udata = udata;
+	stream->enable_check_timeout = enable_check_timeout;// @contrib: di3online - https://github.com/di3online
+	stream->enable_check_nowindow = enable_check_nowindow;// @contrib: di3online - https://github.com/di3online
+
+	/* the lock lives right after the stream, in the same pool object */
+	if ( session->lock.mode != LOCK_NONE )
+	{
+		stream->lock = (pntoh_lock_t) ( stream + 1 );
+		init_lockaccess ( stream->lock , session->lock.mode );
+	}
+
+	/* never published, so it goes straight back to the pool */
+	if ( ! htable_insert ( session->streams , key , stream ) )
+	{
+		free_lockaccess ( stream->lock );
+		pool_free ( &session->stream_pool , stream );
+		sem_post ( &session->max_streams );
+		*error = NTOH_ERROR_NOMEM;
+		return 0;
+	}
+
+	index_insert ( session , stream );
+	stream_queue_push ( &session->lru_head , &session->lru_tail , stream );
+
+	/* streams without any timeout check are never queued */
+	if ( enable_check_timeout )
+		twheel_add ( &session->timers , &stream->timer , stream->last_activ.tv_sec + DEFAULT_TCP_SYNSENT_TIMEOUT );
+
+	*error = NTOH_OK;
+
+	return stream;
+}
+
+/** @brief API to create a new TCP stream and add it to the given session **/
+pntoh_tcp_stream_t ntoh_tcp_new_stream ( pntoh_tcp_session_t session , pntoh_tcp_tuple5_t tuple5 , pntoh_tcp_callback_t function ,void *udata , unsigned int *error, unsigned short enable_check_timeout, unsigned short enable_check_nowindow )
+{
+	pntoh_tcp_stream_t	stream = 0;
+	unsigned int		err = 0;
+
+	if ( error != 0 )
+		*error = 0;
+
+	if ( !session || !tuple5 )
 	{
 		if ( error != 0 )
-			*error = NTOH_ERROR_NOKEY;
+			*error = NTOH_ERROR_PARAMS;
 		return 0;
 	}
 
@@ -624,56 +1274,124 @@ pntoh_tcp_stream_t ntoh_tcp_new_stream ( pntoh_tcp_session_t session , pntoh_tcp
 
 	lock_access( &session->lock );
 
-	if ( sem_trywait( &session->max_streams ) != 0 )
-	{
-		unlock_access( &session->lock );
-		if ( error != 0 )
-			*error = NTOH_ERROR_NOSPACE;
-		return 0;
-	}
+	stream = create_stream ( session , tuple5 , function , udata , &err , enable_check_timeout , enable_check_nowindow );
 
-	if ( !( stream = (pntoh_tcp_stream_t) calloc( 1, sizeof ( ntoh_tcp_stream_t ) ) ) )
-	{
-		unlock_access( &session->lock );
+	unlock_access( &session->lock );
 
-		if ( error != 0 )
-			*error = NTOH_ERROR_NOMEM;
+	if ( error != 0 )
+		*error = err;
+
+	return stream;
+}
+
+/** @brief API to set the current time of a session (NTOH_SESSION_CALLER_CLOCK) **/
+int ntoh_tcp_set_time ( pntoh_tcp_session_t session , const struct timeval *tv )
+{
+	if ( !session || !tv || !( session->flags & NTOH_SESSION_CALLER_CLOCK ) )
+		return NTOH_ERROR_PARAMS;
+
+	if ( set_session_time ( &session->clock , tv ) )
+		tcp_check_timeouts ( session );
+
+	return NTOH_OK;
+}
+
+unsigned int ntoh_tcp_tick ( pntoh_tcp_session_t session , const struct timeval *now , unsigned int max )
+{
+	struct timeval tv = { 0 , 0 };
+
+	if ( !session )
 		return 0;
-	}
 
-	memcpy( (void*)&( stream->tuple ), (void*)tuple5, sizeof(ntoh_tcp_tuple5_t) );
-	stream->key = key;
+	if ( now != 0 && ( session->flags & NTOH_SESSION_CALLER_CLOCK ) )
+		set_session_time ( &session->clock , now );
+
+	get_session_time ( session->flags , &session->clock , &tv );
+
+	return tcp_expire_timers ( session , tv.tv_sec , max );
+}
+
+int ntoh_tcp_next_deadline ( pntoh_tcp_session_t session , struct timeval *deadline )
+{
+	unsigned long expire = 0;
+
+	if ( !session || !deadline )
+		return NTOH_ERROR_PARAMS;
+
+	lock_access ( &session->lock );
+
+	if ( ! twheel_next ( &session->timers , &expire ) )
+		expire = 0;
+
+	unlock_access ( &session->lock );
+
+	deadline->tv_sec = expire;
+	deadline->tv_usec = 0;
+
+	return NTOH_OK;
+}
+
+/** @brief API to get the tuple of a stream **/
+pntoh_tcp_tuple5_t ntoh_tcp_stream_tuple ( pntoh_tcp_stream_t stream )
+{
+	return stream != 0 ? &stream->tuple : 0;
+}
 
-	for ( i = 0 ; i < IP6_ADDR_LEN ; i++ )
+/** @brief API to get the status of a stream **/
+unsigned int ntoh_tcp_stream_status ( pntoh_tcp_stream_t stream )
+{
+	return stream != 0 ? stream->status : NTOH_STATUS_CLOSED;
+}
+
+/** @brief API to get a peer of a stream **/
+pntoh_tcp_peer_t ntoh_tcp_stream_peer ( pntoh_tcp_stream_t stream , unsigned short who )
+{
+	if ( !stream )
+		return 0;
+
+	switch ( who )
 	{
-		stream->client.addr[i] = stream->tuple.source[i];
-		stream->server.addr[i] = stream->tuple.destination[i];
+		case NTOH_SENT_BY_CLIENT:
+			return &stream->client;
+
+		case NTOH_SENT_BY_SERVER:
+			return &stream->server;
 	}
 
-	stream->client.port = stream->tuple.sport;
-	stream->server.port = stream->tuple.dport;
-	stream->client.receive = 1;
-	stream->server.receive = 1;
+	return 0;
+}
 
-	gettimeofday( &stream->last_activ, 0 );
-	stream->status = stream->client.status = stream->server.status = NTOH_STATUS_CLOSED;
-	stream->function = (void*) function;
-	stream->udata = udata;
-	stream->enable_check_timeout = enable_check_timeout;// @contrib: di3online - https://github.com/di3online
-	stream->enable_check_nowindow = enable_check_nowindow;// @contrib: di3online - https://github.com/di3online
+/** @brief API to get the user-defined data of a stream **/
+void *ntoh_tcp_stream_udata ( pntoh_tcp_stream_t stream )
+{
+	return stream != 0 ? stream->udata : 0;
+}
 
-	stream->lock.use = 0;
-	pthread_mutex_init( &stream->lock.mutex, 0 );
-	pthread_cond_init( &stream->lock.pcond, 0 );
+/** @brief API to get the statistics of the session object pools **/
+int ntoh_tcp_get_pool_stats ( pntoh_tcp_session_t session , unsigned short pool , pntoh_pool_stats_t stats )
+{
+	if ( !session || !stats )
+		return NTOH_ERROR_PARAMS;
 
-	htable_insert ( session->streams , key , stream );
+	switch ( pool )
+	{
+		case NTOH_POOL_STREAMS:
+			pool_get_stats ( &session->stream_pool , stats );
+			break;
 
-	unlock_access( &session->lock );
+		case NTOH_POOL_SEGMENTS:
+			pool_get_stats ( &session->segment_pool , stats );
+			break;
 
-	if ( error != 0 )
-		*error = NTOH_OK;
+		case NTOH_POOL_NODES:
+			pool_get_stats ( &session->node_pool , stats );
+			break;
 
-	return stream;
+		default:
+			return NTOH_ERROR_PARAMS;
+	}
+
+	return NTOH_OK;
 }
 
 /** @brief API to get the amount of streams stored in a session **/
@@ -795,48 +1513,20 @@ inline static void get_timestamp ( struct tcphdr *tcp , size_t tcp_len , unsigne
     }
 }
 
-/** @brief Adds a segment to the given peer queue **/
-inline static void queue_segment ( pntoh_tcp_session_t session , pntoh_tcp_peer_t peer , pntoh_tcp_segment_t segment )
-{
-	pntoh_tcp_segment_t	qu = 0;
-
-	if ( !peer )
-		return;
-
-	if ( peer->segments == 0 )
-		peer->segments = segment;
-	else{
-		if ( segment->seq < peer->segments->seq )
-		{
-			segment->next = peer->segments;
-			peer->segments = segment;
-		}else{
-			// insert the new segment into the list
-			for ( qu = peer->segments ; qu->next != 0 && qu->next->seq < segment->seq ; qu = qu->next );
-
-			segment->next = qu->next;
-			qu->next = segment;
-		}
-	}
-
-	peer->totalwin -= segment->payload_len;
-
-	return;
-}
-
 /** @brief Creates a new segment **/
-inline static pntoh_tcp_segment_t new_segment ( unsigned long seq , unsigned long ack , unsigned long payload_len , unsigned char flags , void *udata )
+inline static pntoh_tcp_segment_t new_segment ( pntoh_tcp_session_t session , unsigned long seq , unsigned long ack , unsigned long payload_len , unsigned char flags , void *udata , struct timeval *tv )
 {
 	pntoh_tcp_segment_t ret = 0;
 
 	// allocates the new segment
-	ret = (pntoh_tcp_segment_t) calloc ( 1 , sizeof ( ntoh_tcp_segment_t ) );
+	if ( ! ( ret = (pntoh_tcp_segment_t) pool_alloc ( &session->segment_pool ) ) )
+		return ret;
 	ret->ack = ack;
 	ret->seq = seq;
 	ret->payload_len = payload_len;
 	ret->flags = flags;
 	ret->user_data = udata;
-	gettimeofday ( &ret->tv , 0 );
+	ret->tv = *tv;
 
 	return ret;
 }
@@ -846,7 +1536,7 @@ inline static unsigned int send_peer_segments ( pntoh_tcp_session_t session , pn
 {
 	pntoh_tcp_segment_t 	segment = 0;
 	unsigned int		ret = 0;
-
+	int			reason = extra;
 
 	if ( !origin->segments )
 		return ret;
@@ -862,7 +1552,7 @@ inline static unsigned int send_peer_segments ( pntoh_tcp_session_t session , pn
 
 	        segment->origin = who;// @contrib: di3online - https://github.com/di3online
 
-	        origin->segments = segment->next;
+	        pop_segment ( origin );
 
 		send_single_segment ( session , stream , origin , destination , segment , segment->payload_len > 0 ? NTOH_REASON_DATA : NTOH_REASON_SYNC , extra );
 		ret++;
@@ -872,14 +1562,18 @@ inline static unsigned int send_peer_segments ( pntoh_tcp_session_t session , pn
 
 	while ( origin->segments != 0 && origin->next_seq <= ack )
 	{
+		/* the reason is decided for each segment, an OOO one does not taint the next ones */
 		if ( origin->segments->seq == origin->next_seq )
+		{
+			reason = extra;
 			goto tosend;
+		}
 		else if ( origin->segments->seq < origin->next_seq )
 		{
-			extra = NTOH_REASON_OOO;
+			reason = NTOH_REASON_OOO;
 			goto tosend;
 		}else { // @contrib: di3online - https://github.com/di3online
-			extra = NTOH_REASON_SEGMENT_LOST; /// NTOH_REASON_XXX; @contrib: sch3m4 - lost segment
+			reason = NTOH_REASON_SEGMENT_LOST; /// NTOH_REASON_XXX; @contrib: sch3m4 - lost segment
 			// break; // before treatment is not followed by processing problems in testing POST uploaded file (incomplete)
 			          // Add a new option to continue treatment now, but this option is how to deal with the follow-up
 			          // For example, a reference window OOO did not do
@@ -890,12 +1584,10 @@ inline static unsigned int send_peer_segments ( pntoh_tcp_session_t session , pn
 
 		tosend:
 			/* unlink the segment */
-			segment = origin->segments;
+			segment = pop_segment ( origin );
 			segment->origin = who;// @contrib: di3online - https://github.com/di3online
 
-			origin->segments = segment->next;
-
-			send_single_segment ( session , stream , origin , destination , segment , segment->payload_len > 0 ? NTOH_REASON_DATA : NTOH_REASON_SYNC, extra );
+			send_single_segment ( session , stream , origin , destination , segment , segment->payload_len > 0 ? NTOH_REASON_DATA : NTOH_REASON_SYNC, reason );
 			ret++;
 	}
 
@@ -982,13 +1674,36 @@ inline static int handle_new_connection ( pntoh_tcp_stream_t stream , struct tcp
 	return NTOH_OK;
 }
 
-/** @brief What to do when an incoming segment arrives to a closing connection? **/
-inline static void handle_closing_connection ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stream , pntoh_tcp_peer_t origin , pntoh_tcp_peer_t destination , pntoh_tcp_segment_t segment, int who )
+/**
+ * @brief Takes a TIME-WAIT slot, evicting the oldest TIME-WAIT stream not in use if needed, the session must be locked
+ *
+ * Only the DEFAULT_TCP_EVICT_SCAN oldest streams are candidates, and the busy ones are skipped:
+ * the session lock is held, so waiting for a stream lock could deadlock.
+ */
+inline static int reserve_timewait ( pntoh_tcp_session_t session )
 {
-	pntoh_tcp_peer_t	peer = origin;
-	pntoh_tcp_peer_t	side = destination;
-	pntoh_tcp_stream_t	twait = 0;
-	ntoh_tcp_key_t		key = 0;
+	pntoh_tcp_stream_t	item = 0;
+	unsigned int		i;
+
+	while ( sem_trywait ( &session->max_timewait ) != 0 )
+	{
+		for ( item = session->timewait_head , i = 0 ; item != 0 && i < DEFAULT_TCP_EVICT_SCAN && ! grab_stream ( item ) ; item = item->next , i++ );
+
+		if ( item == 0 || i == DEFAULT_TCP_EVICT_SCAN )
+			return 0;
+
+		/* delete_stream gives back its slot */
+		__tcp_free_stream ( session , &item , NTOH_REASON_SYNC , NTOH_REASON_CLOSED );
+	}
+
+	return 1;
+}
+
+/** @brief What to do when an incoming segment arrives to a closing connection? **/
+inline static void handle_closing_connection ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stream , pntoh_tcp_peer_t origin , pntoh_tcp_peer_t destination , pntoh_tcp_segment_t segment, int who )
+{
+	pntoh_tcp_peer_t	peer = origin;
+	pntoh_tcp_peer_t	side = destination;
 
 	send_peer_segments ( session , stream , destination , origin , origin->next_seq , 0 , 0, who );
 
@@ -1011,8 +1726,7 @@ inline static void handle_closing_connection ( pntoh_tcp_session_t session , pnt
 	if ( origin->segments->seq == origin->next_seq && origin->segments->ack == destination->next_seq )
 	{
 		/* unlink the first segment */
-		segment = origin->segments;
-		origin->segments = segment->next;
+		segment = pop_segment ( origin );
 	}else
 		return;
 
@@ -1106,28 +1820,39 @@ inline static void handle_closing_connection ( pntoh_tcp_session_t session , pnt
 	if ( segment->flags & (TH_FIN | TH_RST) )
 		origin->next_seq++;
 
+	if ( session->flags & NTOH_SESSION_STREAM_BUFFERS )
+		buffer_range ( origin , segment );
+
 	if ( stream->status != NTOH_STATUS_CLOSED && origin->receive )
 		((pntoh_tcp_callback_t)stream->function) ( stream , origin , destination , segment , NTOH_REASON_SYNC , 0 );
 
-	free ( segment );
+	if ( session->flags & NTOH_SESSION_STREAM_BUFFERS )
+		buffer_consume ( origin , segment );
+
+	pool_free ( &session->segment_pool , segment );
 
 	/* should we add this stream to TIMEWAIT queue? */
 	if ( stream->status == NTOH_STATUS_CLOSING && IS_TIMEWAIT(stream->client , stream->server) )
 	{
-		if ( ! htable_find ( session->timewait , stream->key , 0 ) )
-		{
-			htable_remove ( session->streams , stream->key, 0 );
-			sem_post ( &session->max_streams );
+		lock_access ( &session->lock );
 
-			while ( sem_trywait ( &session->max_timewait ) != 0 )
-			{
-				key = htable_first ( session->timewait );
-				twait = htable_remove ( session->timewait , key, 0 );
-				__tcp_free_stream ( session , &twait , NTOH_REASON_SYNC , NTOH_REASON_CLOSED );
+		/* without a TIME-WAIT slot, the stream stays in the streams table until it times out */
+		if ( ! htable_find ( session->timewait , stream->key , &stream->tuple ) && reserve_timewait ( session ) )
+		{
+			/* the same if the TIME-WAIT table cannot hold it (the stream is still in use, it cannot be released here) */
+			if ( ! htable_insert ( session->timewait , stream->key , stream ) )
+				sem_post ( &session->max_timewait );
+			else{
+				htable_remove ( session->streams , stream->key , &stream->tuple );
+				index_remove ( session , stream );
+				stream_queue_unlink ( &session->lru_head , &session->lru_tail , stream );
+				sem_post ( &session->max_streams );
+
+				stream_queue_push ( &session->timewait_head , &session->timewait_tail , stream );
 			}
-
-			htable_insert ( session->timewait , stream->key , stream );
 		}
+
+		unlock_access ( &session->lock );
 	}
 
 	send_peer_segments ( session , stream , destination , origin , origin->next_seq , 0 , 0, who );
@@ -1136,11 +1861,12 @@ inline static void handle_closing_connection ( pntoh_tcp_session_t session , pnt
 }
 
 /** @brief What to do when an incoming segment arrives to an established connection? **/
-inline static int handle_established_connection ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stream , struct tcphdr *tcp , size_t payload_len , pntoh_tcp_peer_t origin , pntoh_tcp_peer_t destination , void *udata, int who )
+inline static int handle_established_connection ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stream , struct tcphdr *tcp , size_t payload_len , pntoh_tcp_peer_t origin , pntoh_tcp_peer_t destination , void *udata, int who , struct timeval *tv )
 {
 	pntoh_tcp_segment_t	segment = 0;
 	unsigned long 		seq = ntohl(tcp->th_seq) - origin->isn;
 	unsigned long 		ack = ntohl(tcp->th_ack) - origin->ian;
+	int			ret = NTOH_OK;
 
 	/* only store segments with data */
 	if ( payload_len > 0 )
@@ -1158,11 +1884,25 @@ inline static int handle_established_connection ( pntoh_tcp_session_t session ,
 			if ( origin->totalwin < payload_len )
 				return NTOH_NO_WINDOW_SPACE_LEFT;
 		}
+
+		if ( ( session->flags & NTOH_SESSION_STREAM_BUFFERS ) && ( ret = buffer_store ( origin , seq , (unsigned char*) tcp + tcp->th_off * 4 , payload_len ) ) != NTOH_OK )
+			return ret;
 	}
 
 	/* creates a new segment and push it into the queue */
-	segment = new_segment ( seq , ack , payload_len , tcp->th_flags , udata );
-	queue_segment ( session , origin , segment );
+	if ( ! ( segment = new_segment ( session , seq , ack , payload_len , tcp->th_flags , udata , tv ) ) )
+		return NTOH_ERROR_NOMEM;
+
+	if ( ( ret = queue_segment ( origin , segment ) ) != NTOH_OK )
+	{
+		pool_free ( &session->segment_pool , segment );
+
+		/* a retransmission may still acknowledge new data of the other side */
+		if ( tcp->th_flags & TH_ACK )
+			send_peer_segments ( session , stream , destination , origin , ack , 0 , 0, !who );
+
+		return ret;
+	}
 
 	/* wants to close the connection ? */
 	if ( ( tcp->th_flags & (TH_FIN | TH_RST) ) || origin->final_seq != 0 )
@@ -1180,23 +1920,176 @@ inline static int handle_established_connection ( pntoh_tcp_session_t session ,
 	return NTOH_OK;
 }
 
-/** @brief API for add an incoming segment **/
-int ntoh_tcp_add_segment ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stream , void *ip , size_t len , void *udata )
+/** @brief PAWS and SEQ/ACK numbers checks of an incoming segment **/
+inline static int check_segment_numbers ( pntoh_tcp_peer_t origin , pntoh_tcp_peer_t destination , struct tcphdr *tcp , unsigned int tstamp )
 {
-	size_t			iphdr_len = 0;
-	size_t			tcphdr_len = 0;
-	size_t			payload_len = 0;
-	struct tcphdr		*tcp = 0;
+	/* PAWS check */
+	if ( tstamp > 0 && origin->lastts > 0 )
+	{
+		if ( tstamp < origin->lastts )
+			return NTOH_PAWS_FAILED;
+
+		if ( ntohl(tcp->th_seq) <= origin->next_seq )
+			origin->lastts = tstamp;
+
+	}else if ( tstamp > 0 && !(origin->lastts) )
+		origin->lastts = tstamp;
+
+	if ( origin->next_seq > 0 && (origin->isn - ntohl ( tcp->th_seq ) ) < origin->next_seq )
+		return NTOH_TOO_LOW_SEQ_NUMBER;
+
+	if ( destination->next_seq > 0 && (origin->ian - ntohl(tcp->th_ack) ) < destination->next_seq )
+		return NTOH_TOO_LOW_ACK_NUMBER;
+
+	return NTOH_OK;
+}
+
+/**
+ * @brief Adds a decoded segment to a stream
+ *
+ * The stream must be locked by the caller, who releases the lock afterwards.
+ * '*pstream' is set to 0 when the stream has been freed.
+ */
+inline static int add_decoded_segment ( pntoh_tcp_session_t session , pntoh_tcp_stream_t *pstream , pntoh_packet_t pkt , void *udata , struct timeval *tv )
+{
+	pntoh_tcp_stream_t	stream = *pstream;
+	struct tcphdr		*tcp = pkt->tcp;
+	size_t			payload_len = pkt->payload_len;
+	unsigned int		tstamp = pkt->tstamp;
 	pntoh_tcp_peer_t	origin = 0;
 	pntoh_tcp_peer_t	destination = 0;
-	unsigned int		tstamp = 0;
 	int			ret = NTOH_OK;
 	pntoh_tcp_segment_t	segment = 0;
+	int			who;// @contrib: di3online - https://github.com/di3online
+
+	/* get origin and destination */
+	if ( !memcmp ( (void*)stream->tuple.source , (void*)pkt->tuple.source , IP6_ADDR_LEN ) && stream->tuple.sport == tcp->th_sport ) // @contrib: harjotgill - https://github.com/harjotgill
+	{
+		origin = &stream->client;
+		destination = &stream->server;
+		who = NTOH_SENT_BY_CLIENT;// @contrib: di3online - https://github.com/di3online
+	}else{
+		origin = &stream->server;
+		destination = &stream->client;
+		who = NTOH_SENT_BY_SERVER;// @contrib: di3online - https://github.com/di3online
+	}
+
+	if ( ( ret = check_segment_numbers ( origin , destination , tcp , tstamp ) ) != NTOH_OK )
+		goto exitp;
+
+	/* @todo some TCP/IP stacks implementations overloads the MSS on certain segments */
+	/*if ( origin->mss > 0 && payload_len > origin->mss )
+		return NTOH_SEGMENT_EXCEEDS_MSS;*/
+
+	/* switch between connection status */
+	switch ( stream->status )
+	{
+		case NTOH_STATUS_CLOSED:
+		case NTOH_STATUS_SYNSENT:
+		case NTOH_STATUS_SYNRCV:
+			if ( payload_len > 0 )
+			{
+				ret = NTOH_HANDSHAKE_FAILED;
+				goto exitp;
+			}
+
+			ret = handle_new_connection ( stream , tcp , origin ,  destination , udata );
+			if ( ret == NTOH_OK )
+			{
+				if ( origin->receive )
+				{
+					if ( stream->status == NTOH_STATUS_ESTABLISHED )
+						((pntoh_tcp_callback_t)stream->function) ( stream , origin , destination , 0 , NTOH_REASON_SYNC , NTOH_REASON_ESTABLISHED );
+					else
+						((pntoh_tcp_callback_t)stream->function) ( stream , origin , destination , 0 , NTOH_REASON_SYNC , NTOH_REASON_SYNC );
+				}
+			}else{
+				lock_access ( &session->lock );
+				delete_stream ( session , &stream , NTOH_REASON_SYNC , ret );
+				unlock_access ( &session->lock );
+			}
+
+			break;
+
+		case NTOH_STATUS_ESTABLISHED:
+			ret = handle_established_connection ( session , stream , tcp , payload_len , origin , destination , udata, who , tv );
+			break;
+
+		default:
+			if ( payload_len > 0 && ( session->flags & NTOH_SESSION_STREAM_BUFFERS ) &&
+				( ret = buffer_store ( origin , ntohl ( tcp->th_seq ) - origin->isn , (unsigned char*) tcp + pkt->tcphdr_len , payload_len ) ) != NTOH_OK )
+				break;
+
+			if ( ! ( segment = new_segment( session , ntohl ( tcp->th_seq ) - origin->isn , ntohl ( tcp->th_ack ) - origin->ian , payload_len , tcp->th_flags , udata , tv ) ) )
+			{
+				ret = NTOH_ERROR_NOMEM;
+				break;
+			}
+
+			if ( ( ret = queue_segment ( origin , segment ) ) != NTOH_OK )
+			{
+				pool_free ( &session->segment_pool , segment );
+				break;
+			}
+
+			handle_closing_connection ( session , stream , origin , destination , segment, who );
+
+			if ( stream->status == NTOH_STATUS_CLOSED )
+			{
+				lock_access ( &session->lock );
+				__tcp_free_stream ( session , &stream , NTOH_REASON_SYNC , NTOH_REASON_CLOSED );
+				unlock_access ( &session->lock );
+				stream = 0;
+			}
+			break;
+	}
+
+	if ( ret == NTOH_OK )
+	{
+		if ( stream != 0 )
+			stream->last_activ = *tv;
+
+		if ( payload_len == 0 )
+			ret = NTOH_SYNCHRONIZING;
+	}
+
+exitp:
+	*pstream = stream;
+
+	return ret;
+}
+
+/** @brief Validates the TCP header of a decoded IP packet, filling the TCP fields of the descriptor **/
+_HIDDEN int tcp_decode_header ( pntoh_packet_t pkt )
+{
+	struct tcphdr	*tcp = (struct tcphdr*) ( (unsigned char*)pkt->ip + pkt->iphdr_len );
+
+	if ( pkt->len < pkt->iphdr_len + sizeof(struct tcphdr) )
+		return NTOH_INCORRECT_LENGTH;
+
+	/* check TCP header */
+	if ( ( pkt->tcphdr_len = tcp->th_off * 4 ) < sizeof(struct tcphdr) || pkt->iphdr_len + pkt->tcphdr_len > pkt->len )
+		return NTOH_INCORRECT_TCP_HEADER_LENGTH;
+
+	if ( !tcp->th_flags || tcp->th_flags == 0xFF )
+		return NTOH_INVALID_FLAGS;
+
+	pkt->tcp = tcp;
+	pkt->payload_len = pkt->len - pkt->iphdr_len - pkt->tcphdr_len;
+	pkt->tstamp = 0;
+	get_timestamp ( tcp , pkt->tcphdr_len , &pkt->tstamp );
+
+	return ntoh_tcp_get_tuple5 ( pkt->ip , tcp , &pkt->tuple );
+}
+
+/** @brief API for add an incoming segment **/
+int ntoh_tcp_add_segment ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stream , void *ip , size_t len , void *udata )
+{
+	ntoh_packet_t		pkt;
 	struct ip		*ip4hdr = (struct ip*)ip;
 	struct ip6_hdr		*ip6hdr = (struct ip6_hdr*)ip;
-	int			who;// @contrib: di3online - https://github.com/di3online
-	unsigned int		saddr[IP6_ADDR_LEN] = {0};
-	unsigned int		daddr[IP6_ADDR_LEN] = {0};
+	int			ret = NTOH_OK;
+	struct timeval		tv = { 0 , 0 };
 
 	if ( !stream || !session )
 		return NTOH_ERROR_PARAMS;
@@ -1215,13 +2108,17 @@ int ntoh_tcp_add_segment ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stre
 	) // no data
 		return NTOH_INCORRECT_LENGTH;
 
+	memset ( &pkt , 0 , sizeof ( pkt ) );
+	pkt.ip = ip;
+	pkt.version = ip4hdr->ip_v;
+
 	if (
-		( ip4hdr->ip_v == 4 && ( iphdr_len = 4 * ( ip4hdr->ip_hl ) ) < sizeof(struct ip) )
+		( ip4hdr->ip_v == 4 && ( pkt.iphdr_len = 4 * ( ip4hdr->ip_hl ) ) < sizeof(struct ip) )
 	) // incorrect ip header length
 		return NTOH_INCORRECT_IP_HEADER_LENGTH;
 
         if ( ip4hdr->ip_v == 6 )
-                iphdr_len = sizeof ( struct ip6_hdr );
+                pkt.iphdr_len = sizeof ( struct ip6_hdr );
 
 	if (
 		( ip4hdr->ip_v == 4 && len < ntohs( ip4hdr->ip_len ) ) ||
@@ -1229,225 +2126,502 @@ int ntoh_tcp_add_segment ( pntoh_tcp_session_t session , pntoh_tcp_stream_t stre
 	 ) // incorrect capture length
 		return NTOH_NOT_ENOUGH_DATA;
 
-	if ( ip4hdr->ip_v == 4 )
-	{
-		saddr[0] = ip4hdr->ip_src.s_addr;
-		daddr[0] = ip4hdr->ip_dst.s_addr;
-	}else{
-		memcpy ( (void*)saddr , (void*)&(ip6hdr->ip6_src) , IP6_ADDR_LEN );
-		memcpy ( (void*)daddr , (void*)&(ip6hdr->ip6_dst) , IP6_ADDR_LEN );
-	}
-
-	/* check IP addresses */
-	if ( ! (
-		( !memcmp ( (void*)stream->client.addr , (void*)saddr , IP6_ADDR_LEN ) && !memcmp ( (void*)stream->server.addr , (void*)daddr , IP6_ADDR_LEN ) ) ||
-		( !memcmp ( (void*)stream->client.addr , (void*)daddr , IP6_ADDR_LEN ) && !memcmp ( (void*)stream->server.addr , (void*)saddr , IP6_ADDR_LEN ) )
-	) )
-		return NTOH_IP_ADDRESSES_MISMATCH;
-		
-
 	if (
 		( ip4hdr->ip_v == 4 && ip4hdr->ip_p != IPPROTO_TCP ) ||
 		( ip4hdr->ip_v == 6 && ip6hdr->ip6_nxt != IPPROTO_TCP )
 	)
 		return NTOH_NOT_TCP;
 
-	tcp = (struct tcphdr*) ( (unsigned char*)ip + iphdr_len );
-
-	/* check TCP header */
-	if ( ( tcphdr_len = tcp->th_off * 4 ) < sizeof(struct tcphdr) )
-		return NTOH_INCORRECT_TCP_HEADER_LENGTH;
+	pkt.protocol = IPPROTO_TCP;
+	if ( ip4hdr->ip_v == 4 )
+		pkt.len = ntohs ( ip4hdr->ip_len );
+	else
+		pkt.len = sizeof ( struct ip6_hdr ) + ntohs ( ip6hdr->ip6_plen );
 
-	if ( !tcp->th_flags || tcp->th_flags == 0xFF )
-		return NTOH_INVALID_FLAGS;
+	if ( ( ret = tcp_decode_header ( &pkt ) ) != NTOH_OK )
+		return ret;
 
-	lock_access ( &stream->lock );
+	/* check IP addresses */
+	if ( ! (
+		( !memcmp ( (void*)stream->client.addr , (void*)pkt.tuple.source , IP6_ADDR_LEN ) && !memcmp ( (void*)stream->server.addr , (void*)pkt.tuple.destination , IP6_ADDR_LEN ) ) ||
+		( !memcmp ( (void*)stream->client.addr , (void*)pkt.tuple.destination , IP6_ADDR_LEN ) && !memcmp ( (void*)stream->server.addr , (void*)pkt.tuple.source , IP6_ADDR_LEN ) )
+	) )
+		return NTOH_IP_ADDRESSES_MISMATCH;
 
 	/* check TCP ports */
 	if ( !(
-		( tcp->th_dport == stream->tuple.dport && tcp->th_sport == stream->tuple.sport ) ||
-    		( tcp->th_dport == stream->tuple.sport && tcp->th_sport == stream->tuple.dport )
+		( pkt.tuple.dport == stream->tuple.dport && pkt.tuple.sport == stream->tuple.sport ) ||
+    		( pkt.tuple.dport == stream->tuple.sport && pkt.tuple.sport == stream->tuple.dport )
 	))
 		return NTOH_TCP_PORTS_MISMATCH;
 
-	if ( ip4hdr->ip_v == 4 )
-		payload_len = ntohs(ip4hdr->ip_len) - iphdr_len - tcphdr_len;
-	else
-		payload_len = ntohs(ip6hdr->ip6_plen) - tcphdr_len;
+	/* one clock read per segment */
+	get_session_time ( session->flags , &session->clock , &tv );
 
-	/* get origin and destination */
-	if ( !memcmp ( (void*)stream->tuple.source , (void*)saddr , IP6_ADDR_LEN ) && stream->tuple.sport == tcp->th_sport ) // @contrib: harjotgill - https://github.com/harjotgill
+	lock_access ( stream->lock );
+
+	ret = add_decoded_segment ( session , &stream , &pkt , udata , &tv );
+
+	if ( stream != 0 )
+		unlock_access ( stream->lock );
+
+	return ret;
+}
+
+/** @brief First entry of the half-open table set of a key **/
+#define HALFOPEN_SET(session,key)	( &(session)->halfopen[ (key) & (session)->halfopen_mask & ~( DEFAULT_TCP_HALFOPEN_WAYS - 1 ) ] )
+
+/** @brief Side (NTOH_SENT_BY_*) of a tuple in a half-open connection, -1 if it is another connection **/
+inline static int halfopen_side ( pntoh_tcp_halfopen_t entry , pntoh_tcp_tuple5_t tuple )
+{
+	if ( ( entry->flags & NTOH_HALFOPEN_IPV6 ) != ( tuple->protocol == 6 ? NTOH_HALFOPEN_IPV6 : 0 ) )
+		return -1;
+
+	if ( entry->sport == tuple->sport && entry->dport == tuple->dport &&
+		!memcmp ( entry->source , tuple->source , IP6_ADDR_LEN ) && !memcmp ( entry->destination , tuple->destination , IP6_ADDR_LEN ) )
+		return NTOH_SENT_BY_CLIENT;
+
+	if ( entry->sport == tuple->dport && entry->dport == tuple->sport &&
+		!memcmp ( entry->source , tuple->destination , IP6_ADDR_LEN ) && !memcmp ( entry->destination , tuple->source , IP6_ADDR_LEN ) )
+		return NTOH_SENT_BY_SERVER;
+
+	return -1;
+}
+
+/** @brief Rebuilds the stream (not inserted anywhere) of a half-open connection, as handle_new_connection left it **/
+inline static void halfopen_load ( pntoh_tcp_halfopen_t entry , pntoh_tcp_stream_t stream )
+{
+	pntoh_tcp_peer_t	peer;
+	unsigned int		i;
+
+	memset ( stream , 0 , sizeof ( ntoh_tcp_stream_t ) );
+
+	memcpy ( stream->tuple.source , entry->source , IP6_ADDR_LEN );
+	memcpy ( stream->tuple.destination , entry->destination , IP6_ADDR_LEN );
+	stream->tuple.sport = entry->sport;
+	stream->tuple.dport = entry->dport;
+	stream->tuple.protocol = entry->flags & NTOH_HALFOPEN_IPV6 ? 6 : 4;
+
+	memcpy ( stream->client.addr , entry->source , IP6_ADDR_LEN );
+	memcpy ( stream->server.addr , entry->destination , IP6_ADDR_LEN );
+	stream->client.port = entry->sport;
+	stream->server.port = entry->dport;
+	stream->client.receive = 1;
+	stream->server.receive = 1;
+
+	for ( i = 0 ; i < 2 ; i++ )
 	{
-		origin = &stream->client;
-		destination = &stream->server;
-		who = NTOH_SENT_BY_CLIENT;// @contrib: di3online - https://github.com/di3online
-	}else{
-		origin = &stream->server;
-		destination = &stream->client;
-		who = NTOH_SENT_BY_SERVER;// @contrib: di3online - https://github.com/di3online
+		peer = i == NTOH_SENT_BY_CLIENT ? &stream->client : &stream->server;
+		peer->isn = entry->isn[i];
+		peer->wsize = entry->wsize[i];
+		peer->mss = entry->mss[i];
+		peer->wscale = ( entry->wscale >> ( 4 * i ) ) & 0x0F;
+		peer->sack = ( entry->flags & NTOH_HALFOPEN_SACK(i) ) ? 1 : 0;
+		peer->totalwin = peer->wsize << peer->wscale;
 	}
 
-	get_timestamp ( tcp , tcphdr_len , &tstamp );
+	/* SYN seen */
+	stream->status = entry->status;
+	stream->client.status = NTOH_STATUS_SYNSENT;
+	stream->client.next_seq = 1;
+	stream->server.status = NTOH_STATUS_LISTEN;
+	stream->server.ian = stream->client.isn;
+	stream->synack_retries = entry->retries;
 
-	/* PAWS check */
-	if ( tstamp > 0 && origin->lastts > 0 )
+	/* SYN/ACK seen */
+	if ( entry->status == NTOH_STATUS_SYNRCV )
 	{
-		if ( tstamp < origin->lastts )
+		stream->server.status = NTOH_STATUS_SYNRCV;
+		stream->server.next_seq = 1;
+		stream->client.ian = stream->server.isn;
+	}
+
+	return;
+}
+
+/** @brief Saves the handshake status of a stream rebuilt by halfopen_load **/
+inline static void halfopen_store ( pntoh_tcp_halfopen_t entry , pntoh_tcp_stream_t stream , unsigned int expire )
+{
+	pntoh_tcp_peer_t	peer;
+	unsigned int		i;
+
+	memcpy ( entry->source , stream->tuple.source , IP6_ADDR_LEN );
+	memcpy ( entry->destination , stream->tuple.destination , IP6_ADDR_LEN );
+	entry->sport = stream->tuple.sport;
+	entry->dport = stream->tuple.dport;
+	entry->flags = stream->tuple.protocol == 6 ? NTOH_HALFOPEN_IPV6 : 0;
+	entry->wscale = 0;
+
+	for ( i = 0 ; i < 2 ; i++ )
+	{
+		peer = i == NTOH_SENT_BY_CLIENT ? &stream->client : &stream->server;
+		entry->isn[i] = (unsigned int) peer->isn;
+		entry->wsize[i] = (unsigned short) peer->wsize;
+		entry->mss[i] = (unsigned short) peer->mss;
+		entry->wscale |= ( peer->wscale < 0x0F ? peer->wscale : 0x0F ) << ( 4 * i );
+
+		if ( peer->sack )
+			entry->flags |= NTOH_HALFOPEN_SACK(i);
+	}
+
+	entry->status = (unsigned char) stream->status;
+	entry->retries = (unsigned char) stream->synack_retries;
+	entry->expire = expire;
+
+	return;
+}
+
+/**
+ * @brief Handles a segment without stream through the half-open table, the session must be locked
+ *
+ * A SYN takes a free or expired entry of its set (or the one expiring first) and the next
+ * handshake segments go through handle_new_connection on the rebuilt stream. On the last ACK
+ * the stream is created and returned, locked, in '*pstream'.
+ */
+inline static int halfopen_segment ( pntoh_tcp_session_t session , pntoh_packet_t pkt , pntoh_tcp_callback_t function , void *udata , unsigned short enable_check_timeout , unsigned short enable_check_nowindow , struct timeval *tv , pntoh_tcp_stream_t *pstream )
+{
+	pntoh_tcp_halfopen_t	set = HALFOPEN_SET ( session , tcp_getkey ( session , &pkt->tuple ) );
+	pntoh_tcp_halfopen_t	entry = 0;
+	pntoh_tcp_stream_t	stream = 0;
+	ntoh_tcp_stream_t	aux;
+	unsigned int		now = (unsigned int) tv->tv_sec;
+	unsigned int		error = 0;
+	unsigned int		i;
+	int			who = -1;
+	int			ret;
+
+	*pstream = 0;
+
+	for ( i = 0 ; i < DEFAULT_TCP_HALFOPEN_WAYS && who < 0 ; i++ )
+		if ( set[i].status != NTOH_STATUS_CLOSED && (int) ( set[i].expire - now ) > 0 && ( who = halfopen_side ( &set[i] , &pkt->tuple ) ) >= 0 )
+			entry = &set[i];
+
+	if ( !entry )
+	{
+		/* only a SYN opens a new connection */
+		if ( pkt->tcp->th_flags != TH_SYN || !pkt->tuple.sport || !pkt->tuple.dport )
+			return NTOH_PACKET_IGNORED;
+
+		if ( pkt->payload_len > 0 )
+			return NTOH_HANDSHAKE_FAILED;
+
+		/* a free one, or the one expiring first */
+		for ( i = 0 , entry = set ; i < DEFAULT_TCP_HALFOPEN_WAYS ; i++ )
 		{
-			ret = NTOH_PAWS_FAILED;
-			goto exitp;
+			if ( set[i].status == NTOH_STATUS_CLOSED || (int) ( set[i].expire - now ) <= 0 )
+			{
+				entry = &set[i];
+				break;
+			}
+
+			if ( (int) ( set[i].expire - entry->expire ) < 0 )
+				entry = &set[i];
 		}
 
-		if ( ntohl(tcp->th_seq) <= origin->next_seq )
-			origin->lastts = tstamp;
+		memset ( &aux , 0 , sizeof ( aux ) );
+		memcpy ( &aux.tuple , &pkt->tuple , sizeof ( ntoh_tcp_tuple5_t ) );
+		handle_new_connection ( &aux , pkt->tcp , &aux.client , &aux.server , 0 );
+		halfopen_store ( entry , &aux , now + DEFAULT_TCP_SYNSENT_TIMEOUT );
 
-	}else if ( tstamp > 0 && !(origin->lastts) )
-		origin->lastts = tstamp;
+		return NTOH_SYNCHRONIZING;
+	}
 
-	if ( origin->next_seq > 0 && (origin->isn - ntohl ( tcp->th_seq ) ) < origin->next_seq )
+	halfopen_load ( entry , &aux );
+
+	if ( ( ret = check_segment_numbers ( who == NTOH_SENT_BY_CLIENT ? &aux.client : &aux.server , who == NTOH_SENT_BY_CLIENT ? &aux.server : &aux.client , pkt->tcp , 0 ) ) != NTOH_OK )
+		return ret;
+
+	if ( pkt->payload_len > 0 )
+		ret = NTOH_HANDSHAKE_FAILED;
+	else if ( who == NTOH_SENT_BY_CLIENT )
+		ret = handle_new_connection ( &aux , pkt->tcp , &aux.client , &aux.server , 0 );
+	else
+		ret = handle_new_connection ( &aux , pkt->tcp , &aux.server , &aux.client , 0 );
+
+	if ( ret != NTOH_OK )
 	{
-		ret = NTOH_TOO_LOW_SEQ_NUMBER;
-		goto exitp;
+		entry->status = NTOH_STATUS_CLOSED;
+		return ret;
 	}
 
-	if ( destination->next_seq > 0 && (origin->ian - ntohl(tcp->th_ack) ) < destination->next_seq )
+	if ( aux.status != NTOH_STATUS_ESTABLISHED )
 	{
-		ret = NTOH_TOO_LOW_ACK_NUMBER;
-		goto exitp;
+		halfopen_store ( entry , &aux , aux.status == NTOH_STATUS_SYNRCV && entry->status == NTOH_STATUS_SYNSENT ? now + DEFAULT_TCP_SYNRCV_TIMEOUT : entry->expire );
+		return NTOH_SYNCHRONIZING;
 	}
 
-	/* @todo some TCP/IP stacks implementations overloads the MSS on certain segments */
-	/*if ( origin->mss > 0 && payload_len > origin->mss )
-		return NTOH_SEGMENT_EXCEEDS_MSS;*/
+	/* established, the entry is given back whatever happens */
+	entry->status = NTOH_STATUS_CLOSED;
 
-	/* switch between connection status */
-	switch ( stream->status )
+	if ( ! ( stream = create_stream ( session , &aux.tuple , function , udata , &error , enable_check_timeout , enable_check_nowindow ) ) )
+		return error;
+
+	stream->client = aux.client;
+	stream->server = aux.server;
+	stream->status = aux.status;
+	stream->synack_retries = aux.synack_retries;
+
+	/* nobody else can hold a stream that has just been created */
+	trylock_access ( stream->lock );
+	*pstream = stream;
+
+	return NTOH_SYNCHRONIZING;
+}
+
+/** @brief Looks for the stream of a decoded segment (creating it on a SYN) and adds the segment, taking the session lock once **/
+_HIDDEN int tcp_process_packet ( pntoh_tcp_session_t session , pntoh_packet_t pkt , pntoh_tcp_callback_t function , void *udata , void *segment_udata , unsigned short enable_check_timeout , unsigned short enable_check_nowindow )
+{
+	pntoh_tcp_stream_t	stream = 0;
+	unsigned int		error = 0;
+	int			ret = NTOH_OK;
+	struct timeval		tv = { 0 , 0 };
+
+	get_session_time ( session->flags , &session->clock , &tv );
+
+	while ( 1 )
 	{
-		case NTOH_STATUS_CLOSED:
-		case NTOH_STATUS_SYNSENT:
-		case NTOH_STATUS_SYNRCV:
-			if ( payload_len > 0 )
+		lock_access ( &session->lock );
+
+		if ( ! ( stream = lookup_stream ( session , &pkt->tuple ) ) && ( session->flags & NTOH_SESSION_HALFOPEN_TABLE ) )
+		{
+			ret = halfopen_segment ( session , pkt , function , udata , enable_check_timeout , enable_check_nowindow , &tv , &stream );
+
+			unlock_access ( &session->lock );
+
+			/* the last ACK of the handshake has just created the stream */
+			if ( stream != 0 )
 			{
-				ret = NTOH_HANDSHAKE_FAILED;
-				goto exitp;
+				if ( stream->client.receive )
+					((pntoh_tcp_callback_t)stream->function) ( stream , &stream->client , &stream->server , 0 , NTOH_REASON_SYNC , NTOH_REASON_ESTABLISHED );
+
+				stream->last_activ = tv;
+				unlock_access ( stream->lock );
 			}
 
-			ret = handle_new_connection ( stream , tcp , origin ,  destination , udata );
-			if ( ret == NTOH_OK )
+			return ret;
+		}
+
+		if ( !stream )
+		{
+			/* only a SYN opens a new stream */
+			if ( pkt->tcp->th_flags != TH_SYN || !pkt->tuple.sport || !pkt->tuple.dport )
 			{
-				if ( origin->receive )
-				{
-					if ( stream->status == NTOH_STATUS_ESTABLISHED )
-						((pntoh_tcp_callback_t)stream->function) ( stream , origin , destination , 0 , NTOH_REASON_SYNC , NTOH_REASON_ESTABLISHED );
-					else
-						((pntoh_tcp_callback_t)stream->function) ( stream , origin , destination , 0 , NTOH_REASON_SYNC , NTOH_REASON_SYNC );
-				}
-			}else{
-				lock_access ( &session->lock );
-				delete_stream ( session , &stream , NTOH_REASON_SYNC , ret );
 				unlock_access ( &session->lock );
+				return NTOH_PACKET_IGNORED;
 			}
 
-			break;
-
-		case NTOH_STATUS_ESTABLISHED:
-			ret = handle_established_connection ( session , stream , tcp , payload_len , origin , destination , udata, who );
-			break;
-
-		default:
-			segment = new_segment( ntohl ( tcp->th_seq ) - origin->isn , ntohl ( tcp->th_ack ) - origin->ian , payload_len , tcp->th_flags , udata );
-			queue_segment ( session , origin , segment );
-			handle_closing_connection ( session , stream , origin , destination , segment, who );
-
-			if ( stream->status == NTOH_STATUS_CLOSED )
+			if ( ! ( stream = create_stream ( session , &pkt->tuple , function , udata , &error , enable_check_timeout , enable_check_nowindow ) ) )
 			{
-				lock_access ( &session->lock );
-				__tcp_free_stream ( session , &stream , NTOH_REASON_SYNC , NTOH_REASON_CLOSED );
 				unlock_access ( &session->lock );
-				stream = 0;
+				return error;
 			}
+		}
+
+		/*
+		 * The stream is locked before releasing the session lock, so it cannot be freed in between.
+		 * Whoever holds the stream lock may be waiting for the session lock, so do not wait for it here
+		 */
+		if ( trylock_access ( stream->lock ) )
 			break;
+
+		unlock_access ( &session->lock );
+		sched_yield ();
 	}
 
-	if ( ret == NTOH_OK )
-	{
-		if ( stream != 0 )
-			gettimeofday ( & (stream->last_activ) , 0 );
+	unlock_access ( &session->lock );
 
-		if ( payload_len == 0 )
-			ret = NTOH_SYNCHRONIZING;
-	}
+	ret = add_decoded_segment ( session , &stream , pkt , segment_udata , &tv );
 
-exitp:
 	if ( stream != 0 )
-		unlock_access ( &stream->lock );
+		unlock_access ( stream->lock );
 
 	return ret;
 }
 
+/** @brief state of each segment of a burst **/
+enum tcp_burst_state
+{
+	TCP_BURST_DONE = 0,	// result already known
+	TCP_BURST_LOCKED,	// stream locked by the burst
+	TCP_BURST_SINGLE	// added through tcp_process_packet
+};
+
+/**
+ * @brief Adds a burst of decoded segments (at most DEFAULT_TCP_BURST)
+ *
+ * The keys of the whole burst are computed first. Then, taking the session lock once,
+ * the buckets are prefetched, the streams are looked up (or created on a SYN), locked
+ * and prefetched. The segments are added in order after releasing the session lock.
+ *
+ * Once a stream is freed or starts closing (it may move to TIME-WAIT), it is released and
+ * its remaining segments go through tcp_process_packet, as they would one by one.
+ * tcp_process_packet may wait for its stream, so before the first of those segments every
+ * stream still held by the burst is released too (their segments go one by one as well).
+ */
+_HIDDEN void tcp_process_burst ( pntoh_tcp_session_t session , pntoh_packet_t *pkts , void **segment_udata , int *ret , unsigned int count , pntoh_tcp_callback_t function , void *udata , unsigned short enable_check_timeout , unsigned short enable_check_nowindow )
+{
+	ntoh_tcp_key_t		keys[DEFAULT_TCP_BURST];
+	pntoh_tcp_stream_t	streams[DEFAULT_TCP_BURST];
+	unsigned char		state[DEFAULT_TCP_BURST];
+	pntoh_tcp_stream_t	stream = 0;
+	unsigned int		error = 0;
+	unsigned int		i , j , k;
+	struct timeval		tv = { 0 , 0 };
+
+	if ( count > DEFAULT_TCP_BURST )
+		count = DEFAULT_TCP_BURST;
+
+	/* hash the whole burst */
+	for ( i = 0 ; i < count ; i++ )
+		keys[i] = tcp_getkey ( session , &pkts[i]->tuple );
+
+	/* one clock read per burst */
+	get_session_time ( session->flags , &session->clock , &tv );
+
+	lock_access ( &session->lock );
+
+	for ( i = 0 ; i < count ; i++ )
+		htable_prefetch ( session->streams , keys[i] );
+
+	for ( i = 0 ; i < count ; i++ )
+	{
+		ret[i] = NTOH_OK;
+		state[i] = TCP_BURST_DONE;
+
+		if ( ( streams[i] = (pntoh_tcp_stream_t) htable_find ( session->streams , keys[i] , &pkts[i]->tuple ) ) != 0 )
+			touch_stream ( session , streams[i] );
+		else if ( session->flags & NTOH_SESSION_HALFOPEN_TABLE )
+		{
+			/* handshakes go one by one through the half-open table */
+			state[i] = TCP_BURST_SINGLE;
+			continue;
+		}else{
+			/* only a SYN opens a new stream */
+			if ( pkts[i]->tcp->th_flags != TH_SYN || !pkts[i]->tuple.sport || !pkts[i]->tuple.dport )
+			{
+				ret[i] = NTOH_PACKET_IGNORED;
+				continue;
+			}
+
+			if ( ! ( streams[i] = create_stream ( session , &pkts[i]->tuple , function , udata , &error , enable_check_timeout , enable_check_nowindow ) ) )
+			{
+				ret[i] = error;
+				continue;
+			}
+		}
+
+		/* each stream is locked once, by its first segment */
+		for ( j = 0 ; j < i && streams[j] != streams[i] ; j++ );
+
+		if ( j < i )
+			state[i] = state[j];
+		else if ( trylock_access ( streams[i]->lock ) )
+		{
+			/* the later SYNs of the burst must not evict it */
+			streams[i]->pinned = 1;
+			state[i] = TCP_BURST_LOCKED;
+			__builtin_prefetch ( streams[i] );
+		}else
+			state[i] = TCP_BURST_SINGLE;
+	}
+
+	unlock_access ( &session->lock );
+
+	for ( i = 0 ; i < count ; i++ )
+	{
+		if ( state[i] == TCP_BURST_SINGLE )
+		{
+			/* never wait for a stream while holding others */
+			for ( j = i + 1 ; j < count ; j++ )
+			{
+				if ( state[j] != TCP_BURST_LOCKED )
+					continue;
+
+				streams[j]->pinned = 0;
+				unlock_access ( streams[j]->lock );
+
+				for ( k = j ; k < count ; k++ )
+					if ( state[k] == TCP_BURST_LOCKED && streams[k] == streams[j] )
+						state[k] = TCP_BURST_SINGLE;
+			}
+
+			ret[i] = tcp_process_packet ( session , pkts[i] , function , udata , segment_udata[i] , enable_check_timeout , enable_check_nowindow );
+		}
+
+		if ( state[i] != TCP_BURST_LOCKED )
+			continue;
+
+		stream = streams[i];
+		ret[i] = add_decoded_segment ( session , &stream , pkts[i] , segment_udata[i] , &tv );
+
+		/* is there any other segment of this stream? */
+		for ( j = i + 1 ; j < count && ( state[j] != TCP_BURST_LOCKED || streams[j] != streams[i] ) ; j++ );
+
+		if ( stream == 0 || stream->status == NTOH_STATUS_CLOSING )
+		{
+			for ( ; j < count ; j++ )
+				if ( state[j] == TCP_BURST_LOCKED && streams[j] == streams[i] )
+					state[j] = TCP_BURST_SINGLE;
+
+			j = count;
+		}
+
+		if ( stream != 0 && j == count )
+		{
+			stream->pinned = 0;
+			unlock_access ( stream->lock );
+		}
+	}
+
+	return;
+}
 
 /* @brief resizes the hash table of a given TCP session */
 int ntoh_tcp_resize_session ( pntoh_tcp_session_t session , unsigned short table , size_t newsize )
 {
-	ptcprs_streams_table_t	newht = 0 , curht = 0;
-	pntoh_tcp_stream_t	item = 0;
-	int			current = 0;
+	ptcprs_streams_table_t	curht = 0;
+	sem_t			*max = 0;
+	size_t			cursize = 0;
+	int			ret = NTOH_OK;
 
 	if ( !session )
 		return NTOH_INCORRECT_SESSION;
 
-
-	if ( ! newsize || newsize == session->streams->table_size )
-		return NTOH_OK;
-
 	switch ( table )
 	{
 		case NTOH_RESIZE_STREAMS:
 			curht = session->streams;
+			max = &session->max_streams;
 			break;
 
 		case NTOH_RESIZE_TIMEWAIT:
 			curht = session->timewait;
+			max = &session->max_timewait;
 			break;
 
 		default:
 			return NTOH_ERROR_PARAMS;
 	}
 
-	lock_access ( &session->lock );
-	// increase the size
-	if ( newsize > curht->table_size )
-		newht = htable_map ( newsize , &tcp_equal_tuple );
-	// decrease the size
-	else
-	{
-		sem_getvalue ( &session->max_streams , &current );
-		if ( newsize < current )
-		{
-			unlock_access ( &session->lock );
-			return NTOH_ERROR_NOSPACE;
-		}
-	}
-
-	// moves all the streams to the new sessions table
-	while ( ( current = htable_first ( curht ) ) != 0 )
-	{
-		item = (pntoh_tcp_stream_t) htable_remove ( curht , current , 0 );
-		htable_insert ( newht , current , item );
-	}
-	htable_destroy ( &curht );
+	if ( ! newsize )
+		return NTOH_OK;
 
+	lock_access ( &session->lock );
 
-	if ( table == NTOH_RESIZE_TIMEWAIT )
+	/* the streams are moved to the new table a few buckets at a time (see htable_resize) */
+	if ( ( cursize = curht->table_size ) == newsize )
+		ret = NTOH_OK;
+	else if ( ! resize_semaphore ( max , cursize , newsize ) )
+		ret = NTOH_ERROR_NOSPACE;
+	else if ( ! htable_resize ( curht , newsize ) )
 	{
-		sem_init ( &session->max_timewait , 0 , newsize );
-		session->streams = newht;
-	}else{
-		sem_init ( &session->max_streams , 0 , newsize );
-		session->timewait = newht;
+		resize_semaphore ( max , newsize , cursize );
+		ret = NTOH_ERROR_NOMEM;
 	}
+	else if ( table == NTOH_RESIZE_STREAMS )
+		resize_index ( session , newsize );
 
 	unlock_access ( &session->lock );
 
-	return NTOH_OK;
+	return ret;
 }